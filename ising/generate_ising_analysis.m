@@ -3,7 +3,7 @@ addpath(genpath('external/L1General'))
 addpath(genpath('external/minFunc'))
 
 %% Persistent Gibbs Sampling C code
-mex -lm CFLAGS='-O3 -fPIC -std=c99' sample_ising.c
+mex -lm CFLAGS='-O3 -fPIC -std=c99' sample_ising.c ising_gibbs.c
 
 %% Generate ferromagnet experiments
 N_replicates = 1;
@@ -0,0 +1,235 @@
+#include <math.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "ising_gibbs.h"
+
+/*
+ * ISING_GIBBS.C
+ *
+ * Multi-spin coded Gibbs sampler for Ising systems, see ising_gibbs.h.
+ *
+ * Compilation with the MATLAB interface:
+ *  mex -lm CFLAGS='-O3 -fPIC -std=c99' sample_ising.c ising_gibbs.c
+ *
+ * Optionally, add -fopenmp to CFLAGS and LDFLAGS to run groups of
+ * particles in parallel.
+ */
+
+#define RNG_WORDS 4
+
+/* Random streams, xoshiro256** (Blackman & Vigna) seeded by splitmix64 */
+static uint64_t rng_split(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rng_rotate(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+static inline uint64_t rng_next(uint64_t *s) {
+    uint64_t result = rng_rotate(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rng_rotate(s[3], 45);
+    return result;
+}
+
+/* e[l] = exp(x[l]) for ISING_LANES lanes, in single precision, which is
+   ample for draws from 32-bit uniforms. With GCC and clang the lanes are
+   computed in vectors as exp(x) = 2^k exp(r), k = round(x / log 2) and
+   |r| <= log(2) / 2, by a degree 7 Taylor polynomial (to within an ulp or
+   two) and 2^k assembled in the exponent bits, with x clamped so that 2^k
+   stays normal */
+#if defined(__GNUC__) || defined(__clang__)
+typedef float vec_t __attribute__((vector_size(32)));
+typedef int32_t bits_t __attribute__((vector_size(32)));
+#define VEC_LANES   8
+#define EXP_MIN     -87.0f
+#define EXP_MAX     88.0f
+/* 1.5 * 2^23 rounds to integers, which then sit in the low mantissa bits */
+#define EXP_ROUND   12582912.0f
+#define EXP_LOG2E   1.44269504088896340736f
+#define EXP_LN2_HI  0.693359375f
+#define EXP_LN2_LO  -2.12194440e-4f
+
+static void exp_lanes(const float *x, float *e) {
+    for (int l = 0; l < ISING_LANES; l += VEC_LANES) {
+        vec_t v;
+        memcpy(&v, x + l, sizeof(vec_t));
+        bits_t low = (bits_t) (v < EXP_MIN);
+        v = (vec_t) (((bits_t) v & ~low)
+            | ((bits_t) ((vec_t) {0} + EXP_MIN) & low));
+        bits_t high = (bits_t) (v > EXP_MAX);
+        v = (vec_t) (((bits_t) v & ~high)
+            | ((bits_t) ((vec_t) {0} + EXP_MAX) & high));
+        vec_t t = v * EXP_LOG2E + EXP_ROUND;
+        vec_t k = t - EXP_ROUND;
+        vec_t r = v - k * EXP_LN2_HI - k * EXP_LN2_LO;
+        vec_t r2 = r * r;
+        vec_t r4 = r2 * r2;
+        vec_t q0 = r + 1.0f;
+        vec_t q1 = r * (1.0f / 6.0f) + 0.5f;
+        vec_t q2 = r * (1.0f / 120.0f) + (1.0f / 24.0f);
+        vec_t q3 = r * (1.0f / 5040.0f) + (1.0f / 720.0f);
+        vec_t p = (q0 + q1 * r2) + (q2 + q3 * r2) * r4;
+        bits_t pow2 = ((bits_t) t + 127) << 23;
+        v = p * (vec_t) pow2;
+        memcpy(e + l, &v, sizeof(vec_t));
+    }
+}
+#else
+static void exp_lanes(const float *x, float *e) {
+    for (int l = 0; l < ISING_LANES; l++) e[l] = expf(x[l]);
+}
+#endif
+
+/* Adds c * d[l] to the fields of the neighbors of site i for every lane */
+static void add_fields(double *F, int i, const double *d, const int *offsets,
+    const int *neighbors, const double *couplings) {
+    for (int k = offsets[i]; k < offsets[i + 1]; k++) {
+        double c = couplings[k];
+        double *Fj = F + (size_t) neighbors[k] * ISING_LANES;
+        for (int l = 0; l < ISING_LANES; l++) Fj[l] += c * d[l];
+    }
+}
+
+/* Advances group g by n_steps updates */
+static void sample_group(ising_chains_t *chains, int g, long n_steps,
+    const double *h, const int *offsets, const int *neighbors,
+    const double *couplings) {
+    int N = chains->n_spins;
+    int G = chains->n_groups;
+    double *F = chains->fields + (size_t) g * N * ISING_LANES;
+    uint64_t *s = chains->rng + g * RNG_WORDS;
+    double d[ISING_LANES];
+    float x[ISING_LANES], e[ISING_LANES];
+    int32_t u[ISING_LANES];
+    int32_t up[ISING_LANES];
+
+    /* Local fields from scratch */
+    for (int i = 0; i < N; i++)
+        for (int l = 0; l < ISING_LANES; l++) F[i * ISING_LANES + l] = h[i];
+    for (int i = 0; i < N; i++) {
+        uint64_t bits = chains->spins[i * G + g];
+        for (int l = 0; l < ISING_LANES; l++)
+            d[l] = ((bits >> l) & 1) ? 1.0 : -1.0;
+        add_fields(F, i, d, offsets, neighbors, couplings);
+    }
+
+    for (long step = 0; step < n_steps; step++) {
+        int i = (int) (((rng_next(s) >> 32) * (uint64_t) N) >> 32);
+        const double *Fi = F + (size_t) i * ISING_LANES;
+
+        /* Up with probability 1 / (1 + exp(-2 H)), two 24-bit uniforms
+           per random draw */
+        for (int l = 0; l < ISING_LANES; l++) x[l] = (float) (-2.0 * Fi[l]);
+        exp_lanes(x, e);
+        for (int l = 0; l < ISING_LANES; l += 2) {
+            uint64_t r = rng_next(s);
+            u[l] = (int32_t) ((r >> 8) & 0xffffff);
+            u[l + 1] = (int32_t) (r >> 40);
+        }
+        for (int l = 0; l < ISING_LANES; l++)
+            up[l] = ((float) u[l] + 0.5f) * 0x1p-24f * (1.0f + e[l]) < 1.0f;
+        uint64_t bits = 0;
+        for (int l = 0; l < ISING_LANES; l++)
+            bits |= (uint64_t) (up[l] & 1) << l;
+
+        /* Neighbor fields change only in the lanes that flipped */
+        uint64_t flips = bits ^ chains->spins[i * G + g];
+        if (flips) {
+            chains->spins[i * G + g] = bits;
+            for (int l = 0; l < ISING_LANES; l++)
+                d[l] = ((flips >> l) & 1)
+                     ? (((bits >> l) & 1) ? 2.0 : -2.0) : 0.0;
+            add_fields(F, i, d, offsets, neighbors, couplings);
+        }
+    }
+}
+
+ising_chains_t *ising_create(int n_spins, int n_particles, uint64_t seed) {
+    ising_chains_t *chains = (ising_chains_t *) malloc(sizeof(ising_chains_t));
+    chains->n_spins = n_spins;
+    chains->n_particles = n_particles;
+    chains->n_groups = (n_particles + ISING_LANES - 1) / ISING_LANES;
+    int G = chains->n_groups;
+    chains->spins =
+        (uint64_t *) calloc((size_t) n_spins * G, sizeof(uint64_t));
+    chains->fields = (double *)
+        malloc((size_t) G * n_spins * ISING_LANES * sizeof(double));
+    chains->rng = (uint64_t *) malloc(G * RNG_WORDS * sizeof(uint64_t));
+    uint64_t z = seed;
+    for (int k = 0; k < G * RNG_WORDS; k++) chains->rng[k] = rng_split(&z);
+    return chains;
+}
+
+void ising_free(ising_chains_t *chains) {
+    free(chains->spins);
+    free(chains->fields);
+    free(chains->rng);
+    free(chains);
+}
+
+void ising_set_spins(ising_chains_t *chains, const double *x) {
+    int N = chains->n_spins;
+    int G = chains->n_groups;
+    memset(chains->spins, 0, (size_t) N * G * sizeof(uint64_t));
+    for (int p = 0; p < chains->n_particles; p++)
+        for (int i = 0; i < N; i++)
+            if (x[i + (size_t) N * p] > 0)
+                chains->spins[i * G + p / ISING_LANES] |=
+                    (uint64_t) 1 << (p % ISING_LANES);
+}
+
+void ising_get_spins(const ising_chains_t *chains, double *x) {
+    int N = chains->n_spins;
+    int G = chains->n_groups;
+    for (int p = 0; p < chains->n_particles; p++)
+        for (int i = 0; i < N; i++) {
+            uint64_t bits = chains->spins[i * G + p / ISING_LANES];
+            x[i + (size_t) N * p] =
+                ((bits >> (p % ISING_LANES)) & 1) ? 1.0 : -1.0;
+        }
+}
+
+void ising_sample(ising_chains_t *chains, const double *h, const double *J,
+    long n_steps) {
+    int N = chains->n_spins;
+
+    /* A flip of spin i changes the field of spin j by J(i,j) dx_i, so the
+       neighbors of i are the nonzeros of row i of J (column-major) */
+    int *offsets = (int *) malloc((N + 1) * sizeof(int));
+    offsets[0] = 0;
+    for (int i = 0; i < N; i++) {
+        offsets[i + 1] = offsets[i];
+        for (int j = 0; j < N; j++)
+            if (j != i && J[i + (size_t) N * j] != 0) offsets[i + 1]++;
+    }
+    int *neighbors = (int *) malloc((offsets[N] + 1) * sizeof(int));
+    double *couplings = (double *) malloc((offsets[N] + 1) * sizeof(double));
+    for (int i = 0; i < N; i++) {
+        int k = offsets[i];
+        for (int j = 0; j < N; j++)
+            if (j != i && J[i + (size_t) N * j] != 0) {
+                neighbors[k] = j;
+                couplings[k] = J[i + (size_t) N * j];
+                k++;
+            }
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int g = 0; g < chains->n_groups; g++)
+        sample_group(chains, g, n_steps, h, offsets, neighbors, couplings);
+
+    free(offsets);
+    free(neighbors);
+    free(couplings);
+}
@@ -0,0 +1,53 @@
+#ifndef ISING_GIBBS_H
+#define ISING_GIBBS_H
+
+#include <stdint.h>
+
+/*
+ * ISING_GIBBS.H
+ *
+ * Multi-spin coded Gibbs sampling of many particles (persistent chains) of
+ * an Ising system of spins x_i = -1, +1 with
+ *      P(x) ~ exp(Sum_i h_i x_i + Sum_i<j J_ij x_i x_j)
+ *
+ * The particles are packed ISING_LANES to a group, with the spins of site i
+ * stored as the bits of one word per group. Every step draws one random site
+ * per group and updates it in all of the particles of the group at once, on
+ * local fields that are kept incrementally and changed only at the neighbors
+ * (nonzero couplings) of the spins that flip. Groups run in parallel when
+ * compiled with OpenMP, each from its own random stream.
+ */
+
+#define ISING_LANES 64
+
+typedef struct {
+    int n_spins;
+    int n_particles;
+    int n_groups;
+    /* Spin i of particle ISING_LANES * g + l is up if bit l of
+       spins[i * n_groups + g] is set */
+    uint64_t *spins;
+    /* Local fields h_i + Sum_j J_ij x_j, n_groups x n_spins x ISING_LANES */
+    double *fields;
+    /* xoshiro256** state of every group, n_groups x 4 */
+    uint64_t *rng;
+} ising_chains_t;
+
+/* Allocates n_particles chains of n_spins spins, all down, with random
+   streams seeded from seed */
+ising_chains_t *ising_create(int n_spins, int n_particles, uint64_t seed);
+
+void ising_free(ising_chains_t *chains);
+
+/* Sets and gets the spins from x (n_spins x n_particles, column-major as in
+   MATLAB), where positive values are up */
+void ising_set_spins(ising_chains_t *chains, const double *x);
+void ising_get_spins(const ising_chains_t *chains, double *x);
+
+/* Advances every particle by n_steps random-site Gibbs updates under the
+   fields h (n_spins) and the symmetric couplings J (n_spins x n_spins),
+   whose diagonal is ignored */
+void ising_sample(ising_chains_t *chains, const double *h, const double *J,
+    long n_steps);
+
+#endif /* ISING_GIBBS_H */
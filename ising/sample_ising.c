@@ -1,34 +1,22 @@
-#include <math.h>
-#include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include "mex.h"
+#include "ising_gibbs.h"
 
 /*
  * SAMPLE_ISING.C
  *
- * Samples from an Ising system with Gibbs sampling.
+ * Samples from an Ising system with Gibbs sampling. Particles are advanced
+ * 64 at a time by the multi-spin coded sampler of ising_gibbs.c.
  * 
  * Usage:
  *  [x] = sample_ising(h, J, x, n_steps);
  *
  * Compilation:
- *  mex -lm CFLAGS='-O3 -fPIC -std=c99' sample_ising.c
+ *  mex -lm CFLAGS='-O3 -fPIC -std=c99' sample_ising.c ising_gibbs.c
  *
  */
 
-#define randu()         (double)rand() / (double)RAND_MAX
-
-int rand_lim(int limit) {
-    /* return a random integer between 0 and limit, inclusive.
-     *      -from stackoverflow user Jerry Coffin-        */
-    int divisor = RAND_MAX/(limit+1);
-    int retval;
-    do {
-        retval = rand() / divisor;
-    } while (retval > limit);
-    return retval;
-}
-
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     /* Interface to MATLAB */
 
@@ -36,7 +24,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     double *h = mxGetPr(prhs[0]);         /* N x 1 */
     double *J = mxGetPr(prhs[1]);         /* N x N */
     double *x_init = mxGetPr(prhs[2]);    /* N x n_particles */
-    int n_steps = (int) *mxGetPr(prhs[3]);
+    long n_steps = (long) *mxGetPr(prhs[3]);
 
     /* Determine dimensions of system */
     int N = mxGetDimensions(prhs[0])[0];
@@ -45,23 +33,15 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     /* Output */
     plhs[0] = mxCreateDoubleMatrix(N, n_particles, mxREAL);
     double *x = (double *) mxGetPr(plhs[0]);
-    
-    /* Copy initialization of spins */
-    for (int i = 0; i < n_particles * N; i++) x[i] = x_init[i];
-    
+
+    /* Fresh random streams on every call */
+    static uint64_t n_calls = 0;
+    uint64_t seed = ((uint64_t) time(0) << 20) + n_calls++;
+
     /* Advance chains */
-    for (int i = 0; i < n_particles; i++)
-        for (int s = 0; s < n_steps; s++) { 
-            /* Select a random site */
-            int ix = rand_lim(N - 1);
-            
-            /* Compute conditional distribution */
-            double H = h[ix];
-            for (int j = 0; j < N; j++)
-                H += J[j + ix * N] * x[j + i * N];
-            double P = exp(2 * H) / ( 1 + exp(2 * H));
-            
-            /* Flip spin accordingly */
-            x[ix + i * N] = (randu() < P) * 2.0 - 1.0;
-        }
+    ising_chains_t *chains = ising_create(N, n_particles, seed);
+    ising_set_spins(chains, x_init);
+    ising_sample(chains, h, J, n_steps);
+    ising_get_spins(chains, x);
+    ising_free(chains);
 }
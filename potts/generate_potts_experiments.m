@@ -55,13 +55,14 @@
 % axis tight
 % 
 % %%
-% mex -lm CFLAGS='-O3 -fPIC -std=c99 -msse4.2' gibbs_potts.c
-% 
-% %%
-% % Full Gibbs sampling of potts model with hi & eij
+% % Full Gibbs sampling of potts model with hi & eij (pvi/bin/gibbs_potts,
+% % built with make all-openmp in pvi/), storing every q sweeps
 % % 1E4, 5E4
 % N_full = 5E4;
-% [sample_full, energies] = gibbs_potts(hi, eij, 1E4, N_full);
+% write_eij('results/potts.eij', hi, eij);
+% system(['pvi/bin/gibbs_potts -b -c 1 -bi 200 -t ' num2str(q, '%d') ...
+%     ' -s ' num2str(N_full, '%d') ' -o results/potts.samples results/potts.eij']);
+% [sample_full, energies] = read_samples('results/potts.samples');
 % 
 % %%
 % % Reduce autocorrelation to every kth sample
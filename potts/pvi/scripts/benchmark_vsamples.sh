@@ -0,0 +1,29 @@
+#!/bin/bash
+# Throughput of the variational (-v) estimator versus the number of samples
+# per KL gradient (-vs) and threads, with the samples evaluated one after
+# another and concurrently (-vp). Reports ELBO samples per second over the
+# pairwise stage. Requires bin/pvi built with make all-openmp.
+#
+# usage: scripts/benchmark_vsamples.sh [alignmentfile [focus [maxiter]]]
+
+ALIGNMENT=${1:-example/IF1/IF1_10.a2m}
+FOCUS=${2:-IF1_ECOLI}
+MAXITER=${3:-10}
+SAMPLES="1 2 4 8"
+THREADS=${THREADS:-"1 2 4 $(nproc)"}
+
+printf "k\tthreads\tserial\tconcurrent\t(samples/s)\n"
+for K in $SAMPLES; do
+    for T in $(echo $THREADS | tr ' ' '\n' | sort -nu); do
+        RATES=""
+        for MODE in "" "-vp"; do
+            # Time of the last iteration of the second (pairwise) stage
+            TIME=$(OMP_NUM_THREADS=$T bin/pvi -v $MODE -vs $K -m $MAXITER \
+                -f $FOCUS $ALIGNMENT 2>&1 \
+                | awk -v m=$MAXITER '$1 == m {t = $2} END {print t}')
+            RATES="$RATES\t$(awk -v k=$K -v m=$MAXITER -v t=$TIME \
+                'BEGIN {printf "%.1f", k * m / t}')"
+        done
+        printf "$K\t$T$RATES\n"
+    done
+done
@@ -6,8 +6,14 @@
 #include <assert.h>
 #include <string.h>
 
+/* Optionally include OpenMP with the -fopenmp flag */
+#if defined(_OPENMP)
+    #include <omp.h>
+#endif
+
 #include "include/pvi.h"
 #include "include/twister.h"
+#include "include/rng.h"
 #include "include/bayes.h"
 
 #define PI 3.14159265358979323846
@@ -15,15 +21,42 @@
 /* Internal prototypes */
 numeric_t ElapsedTime(struct timeval *start);
 
+/* Internal to the Adam optimizers: one fused step over a parameter vector */
+typedef struct {
+    numeric_t beta1;
+    numeric_t beta2;
+    numeric_t alpha;            /* Bias-corrected learning rate */
+    numeric_t gScale;           /* Gradients are read as g * gScale + gShift */
+    numeric_t gShift;
+    numeric_t normEps;          /* Added to v in the norm sum m^2 / v */
+} adam_step_t;
+void AdamStep(numeric_t *x, const numeric_t *g, void *m, void *v,
+    int floatMoments, int n, const adam_step_t *step, numeric_t *sums);
+void *AdamAllocMoments(int n, int floatMoments);
+void AdamCheckpoint(FILE *fp, int restore, int *t, numeric_t *x, void *m,
+    void *v, int floatMoments, int n);
+
+/* Internal to EstimateGaussianVariationalApproximation: gradient of one unit
+   of draws (an antithetic pair or a single draw) */
+numeric_t SVIAddUnit(numeric_t *gradMu, numeric_t *gradLogSig,
+    const numeric_t *gradP, const numeric_t *z, int size,
+    const numeric_t *logSig, numeric_t *cvMean, numeric_t *cvSlope,
+    int reduce, int n);
+void SVICheckpointReduce(FILE *fp, int restore, int reduce,
+    numeric_t *cvMean, numeric_t *cvSlope, int n);
+
 numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
-    void *data, numeric_t *mu, numeric_t *sigma, int n, int k,
-    numeric_t eps, int maxIter, numeric_t crit) {
+    void *data, void **drawData, numeric_t *mu, numeric_t *sigma, int n,
+    int k, numeric_t eps, int maxIter, numeric_t crit, int floatMoments,
+    int reduce, checkpoint_t *checkpoint) {
     /* Estimate a diagonal Gaussian variational approximation Q of a
        distribution P by stochastically minimizing KL(Q||P)
        (maximizing the ELBO)
        Arguments:
             neglogp         value and gradient of -log(P(params|data)) 
             data            pointer to data
+            drawData        (optional) pointers to data for each of the k
+                            samples, which are then evaluated concurrently
             mu              estimated means (length n)
             sigma           estimated standard deviations (length n)
             n               number of parameters
@@ -31,10 +64,17 @@ numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
             eps             learning rate
             maxIter         maximum number of iterations
             crit            stop when ||grad|| / ||x|| < crit
+            floatMoments    store the Adam moments in single precision
+            reduce          variance reduction of the gradients (SVI_*)
+            checkpoint      (optional) periodic checkpoints and resume
      */
 
-    /* Use the Mersenne Twister for reproducible sampling results */
+    /* Use the Mersenne Twister for reproducible sampling results, and draw Z
+       from a counter-based stream keyed by it so that any draw is addressed
+       by its index */
     init_genrand(42);
+    uint64_t key = RandomKey();
+    uint64_t counter = 0;
 
     /* Parameterize variance parameters by their logarithms */
     numeric_t *logSig = (numeric_t *) malloc(n * sizeof(numeric_t));
@@ -49,10 +89,41 @@ numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
     numeric_t *gradMu = (numeric_t *) malloc(n * sizeof(numeric_t));
     numeric_t *gradLogSig = (numeric_t *) malloc(n * sizeof(numeric_t));    
 
-    /* Use a vector of standard normals Z to sample S from Q */
-    numeric_t *z = (numeric_t *) malloc(n * sizeof(numeric_t));
-    numeric_t *s = (numeric_t *) malloc(n * sizeof(numeric_t));
-    numeric_t *gradP = (numeric_t *) malloc(n * sizeof(numeric_t));
+    /* The k samples come in units of antithetic pairs Z, -Z or of single
+       draws, which are the independent terms of the gradient estimate */
+    int unitSize = (reduce & SVI_ANTITHETIC ? 2 : 1);
+    int nUnits = k / unitSize;
+
+    /* Running means of grad(-logP) and of grad(-logP) * Z for the control
+       variates, which the current draws do not enter until they are used */
+    numeric_t *cvMean = NULL;
+    numeric_t *cvSlope = NULL;
+    if (reduce & SVI_CONTROL) {
+        cvMean = (numeric_t *) calloc(n, sizeof(numeric_t));
+        cvSlope = (numeric_t *) calloc(n, sizeof(numeric_t));
+    }
+
+    /* Use a vector of standard normals Z to sample S from Q, with separate
+       buffers for each draw of a unit, or for each of the k samples when
+       they are evaluated together */
+    int nDraws = (drawData != NULL ? k : unitSize);
+    numeric_t *z = (numeric_t *) malloc(nDraws * n * sizeof(numeric_t));
+    numeric_t *s = (numeric_t *) malloc(nDraws * n * sizeof(numeric_t));
+    numeric_t *gradP = (numeric_t *) malloc(nDraws * n * sizeof(numeric_t));
+    numeric_t *negLogPs = (numeric_t *) malloc(nDraws * sizeof(numeric_t));
+
+    /* Split the threads between the samples and the objective's own loops */
+#if defined(_OPENMP)
+    int nOuter = 1;
+    int nInner = 1;
+    int maxLevels = omp_get_max_active_levels();
+    if (drawData != NULL) {
+        int nThreads = omp_get_max_threads();
+        nOuter = (k < nThreads ? k : nThreads);
+        nInner = nThreads / nOuter;
+        omp_set_max_active_levels(2);
+    }
+#endif
 
     /* Stopping criteria */
     numeric_t meanELBO = 0;
@@ -65,81 +136,134 @@ numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
 
     /* -------------- Stochastically maximize the ELBO by Adam -------------- */
     /* Initialize estimates of first and second moments of the gradient */
-    numeric_t *meanGradMu = (numeric_t *) malloc(n * sizeof(numeric_t));
-    numeric_t *meanGradLogSig = (numeric_t *) malloc(n * sizeof(numeric_t));
-    numeric_t *squareGradMu = (numeric_t *) malloc(n * sizeof(numeric_t));
-    numeric_t *squareGradLogSig = (numeric_t *) malloc(n * sizeof(numeric_t));
-    for (int i = 0; i < n; i++) meanGradMu[i] = 0;
-    for (int i = 0; i < n; i++) meanGradLogSig[i] = 0;
-    for (int i = 0; i < n; i++) squareGradMu[i] = 0;
-    for (int i = 0; i < n; i++) squareGradLogSig[i] = 0;
+    void *meanGradMu = AdamAllocMoments(n, floatMoments);
+    void *meanGradLogSig = AdamAllocMoments(n, floatMoments);
+    void *squareGradMu = AdamAllocMoments(n, floatMoments);
+    void *squareGradLogSig = AdamAllocMoments(n, floatMoments);
     int t = 1;
+
+    /* Continue from a checkpoint, which also restores the twister and the
+       objective's own state */
+    FILE *fpResume = CheckpointRestore(checkpoint, "svi", n);
+    if (fpResume != NULL) {
+        AdamCheckpoint(fpResume, 1, &t, mu, meanGradMu, squareGradMu,
+            floatMoments, n);
+        AdamCheckpoint(fpResume, 1, &t, logSig, meanGradLogSig,
+            squareGradLogSig, floatMoments, n);
+        CheckpointBlock(&counter, sizeof(uint64_t), 1, fpResume, 1);
+        CheckpointBlock(&meanELBO, sizeof(numeric_t), 1, fpResume, 1);
+        CheckpointBlock(&meanLogP, sizeof(numeric_t), 1, fpResume, 1);
+        SVICheckpointReduce(fpResume, 1, reduce, cvMean, cvSlope, n);
+        CheckpointRestoreEnd(fpResume, checkpoint);
+    }
     do {
         /* Estimate the ELBO and its gradient by averaging k samples from Q */
         numeric_t negLogP = 0;
+        numeric_t unitSquare = 0;
         for (int i = 0; i < n; i++) gradMu[i] = 0;
         for (int i = 0; i < n; i++) gradLogSig[i] = 0;
-        for (int i = 0; i < k; i++) {
-            /* Sample S from current Q */
-            for (int j = 0; j < n; j++) z[j] = RandomNormal();
-            for (int j = 0; j < n; j++)
-                s[j] = mu[j] + exp(logSig[j]) * z[j];
+        if (drawData == NULL) {
+            for (int u = 0; u < nUnits; u++) {
+                for (int d = 0; d < unitSize; d++) {
+                    /* Sample S from current Q */
+                    numeric_t *zd = &(z[d * n]);
+                    if (d == 0) {
+                        RandomNormals(zd, n, key, counter);
+                        counter += n;
+                    } else {
+                        for (int j = 0; j < n; j++) zd[j] = -z[j];
+                    }
+                    for (int j = 0; j < n; j++)
+                        s[j] = mu[j] + exp(logSig[j]) * zd[j];
+
+                    /* Cross-entropy term, logP(S|data) */
+                    negLogP += neglogp(data, s, &(gradP[d * n]), n);
+                }
 
-            /* Cross-entropy term, logP(S|data) */
-            negLogP += neglogp(data, s, gradP, n);
+                /* Contribute dlogP(S|data)/dMu & dlogP(S|data)/dLogSig */
+                unitSquare += SVIAddUnit(gradMu, gradLogSig, gradP, z,
+                    unitSize, logSig, cvMean, cvSlope, reduce, n);
+            }
+        } else {
+            /* Draw every Z from the counters of the serial order, so that
+               the samples are the same as above */
+            for (int i = 0; i < k; i++) {
+                if (i % unitSize == 0) {
+                    RandomNormals(&(z[i * n]), n, key, counter);
+                    counter += n;
+                } else {
+                    for (int j = 0; j < n; j++)
+                        z[i * n + j] = -z[(i - 1) * n + j];
+                }
+            }
 
-            /* Contribute dlogP(S|data)/dMu & dlogP(S|data)/dLogSig */
-            for (int j = 0; j < n; j++) gradMu[j] += gradP[j];
-            for (int j = 0; j < n; j++)
-                gradLogSig[j] += gradP[j] * z[j] * exp(logSig[j]);
+            /* Evaluate the samples concurrently, each on its own data */
+            #pragma omp parallel for num_threads(nOuter) schedule(dynamic)
+            for (int i = 0; i < k; i++) {
+#if defined(_OPENMP)
+                omp_set_num_threads(nInner);
+#endif
+                numeric_t *zi = &(z[i * n]);
+                numeric_t *si = &(s[i * n]);
+                for (int j = 0; j < n; j++)
+                    si[j] = mu[j] + exp(logSig[j]) * zi[j];
+                negLogPs[i] = neglogp(drawData[i], si, &(gradP[i * n]), n);
+            }
+
+            /* Reduce in sample order, as the serial sums */
+            for (int i = 0; i < k; i++) negLogP += negLogPs[i];
+            for (int u = 0; u < nUnits; u++)
+                unitSquare += SVIAddUnit(gradMu, gradLogSig,
+                    &(gradP[u * unitSize * n]), &(z[u * unitSize * n]),
+                    unitSize, logSig, cvMean, cvSlope, reduce, n);
         }
         numeric_t invK = 1.0 / ((numeric_t) k);
         negLogP *= invK;
-        for (int i = 0; i < n; i++) gradMu[i] *= invK;
-        for (int i = 0; i < n; i++) gradLogSig[i] *= invK;
 
-        /* Entropy term E[logQ(S)] is analytic */
-        numeric_t entropy = n * 0.5 * log(2 * PI * exp(1));
-        for (int i = 0; i < n; i++) entropy += logSig[i];
-        negELBO = negLogP - entropy;
-        for (int i = 0; i < n; i++) gradLogSig[i] -= 1.0;
+        /* Variance of the gradient estimate, Sum_j Var(g_j), from the spread
+           of the units around their mean */
+        numeric_t gradVar = -1.0;
+        if (nUnits > 1) {
+            numeric_t sumSquare = 0;
+            #pragma omp parallel for reduction(+:sumSquare)
+            for (int j = 0; j < n; j++)
+                sumSquare += gradMu[j] * gradMu[j]
+                           + gradLogSig[j] * gradLogSig[j];
+            gradVar = (unitSquare - sumSquare / nUnits)
+                / ((numeric_t) unitSize * unitSize * nUnits * (nUnits - 1));
+        }
 
-        /* Update estimates of moments */
+        /* Update estimates of moments and Q with Adam learning rates, in one
+           pass over each of mu and logSig that also scales the gradients
+           by 1/k, adds the entropy gradient -1 to those of logSig (unless
+           the draws already carry it) and accumulates the norms */
         numeric_t beta1 = 0.9;
         numeric_t beta2 = 0.999;
-        for (int i = 0; i < n; i++)
-            meanGradMu[i] = beta1 * meanGradMu[i] 
-                          + (1.0 - beta1) * gradMu[i];
-        for (int i = 0; i < n; i++)
-            meanGradLogSig[i] = beta1 * meanGradLogSig[i] 
-                              + (1.0 - beta1) * gradLogSig[i];
-        for (int i = 0; i < n; i++)
-            squareGradMu[i] = beta2 * squareGradMu[i] 
-                            + (1.0 - beta2) * gradMu[i] * gradMu[i];
-        for (int i = 0; i < n; i++)
-            squareGradLogSig[i] = beta2 * squareGradLogSig[i] 
-                                + (1.0 - beta2) * gradLogSig[i] * gradLogSig[i];
-
-        /* Update Q with Adam learning rates */
-        numeric_t alpha = eps * sqrt(1.0 - pow(beta2, (numeric_t) t)) 
-                              / (1.0 - pow(beta1, (numeric_t) t));
-        for (int i = 0; i < n; i++)
-            mu[i] -= meanGradMu[i] * alpha / (sqrt(squareGradMu[i]) + 1E-8); 
-        for (int i = 0; i < n; i++)
-            logSig[i] -= meanGradLogSig[i]
-                         *  alpha / (sqrt(squareGradLogSig[i]) + 1E-8);
+        adam_step_t step;
+        step.beta1 = beta1;
+        step.beta2 = beta2;
+        step.alpha = eps * sqrt(1.0 - pow(beta2, (numeric_t) t)) 
+                         / (1.0 - pow(beta1, (numeric_t) t));
+        step.gScale = invK;
+        step.gShift = 0;
+        /* Exactly zero gradients, as antithetic pairs can give, would be
+           0 / 0 in the norm; the offset is below any other v */
+        step.normEps = 1E-30;
+        numeric_t sumsMu[3];
+        numeric_t sumsLogSig[3];
+        AdamStep(mu, gradMu, meanGradMu, squareGradMu, floatMoments, n,
+            &step, sumsMu);
+        step.gShift = (reduce & SVI_STL ? 0 : -1.0);
+        AdamStep(logSig, gradLogSig, meanGradLogSig, squareGradLogSig,
+            floatMoments, n, &step, sumsLogSig);
+
+        /* Entropy term E[logQ(S)] is analytic, at Q before the step */
+        numeric_t entropy = n * 0.5 * log(2 * PI * exp(1)) + sumsLogSig[0];
+        negELBO = negLogP - entropy;
 
         /* Stopping criterion: ||grad(params)|| / ||params|| */
-        numeric_t paramNorm = 1E-6;
-        for (int i = 0; i < n; i++)
-            paramNorm += mu[i] * mu[i]; 
-        for (int i = 0; i < n; i++)
-            paramNorm += logSig[i] * logSig[i];
-        numeric_t gradNorm = 1E-6;
-        for (int i = 0; i < n; i++)
-            gradNorm += meanGradMu[i] * meanGradMu[i] / squareGradMu[i]; 
-        for (int i = 0; i < n; i++)
-            gradNorm += meanGradLogSig[i] * meanGradLogSig[i] / squareGradLogSig[i]; 
+        numeric_t paramNorm = 1E-6 + sumsMu[1] + sumsLogSig[1];
+        numeric_t gradNorm = 1E-6 + sumsMu[2] + sumsLogSig[2];
         paramNorm = sqrt(paramNorm);
         gradNorm = sqrt(gradNorm);
         criterion = gradNorm / paramNorm;
@@ -155,25 +279,55 @@ numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
         }
 
         if (t == 1)
-            fprintf(stderr, "iter\ttime\tELBO\t\tLogP\t\t||x||\t||g||\tcrit\n");
-        fprintf(stderr, "%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.3f\n",
+            fprintf(stderr, "iter\ttime\tELBO\t\tLogP\t\t||x||\t||g||\tcrit"
+                "\tVar(g)\n");
+        fprintf(stderr, "%d\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.3f\t",
             t, ElapsedTime(&start), meanELBO, meanLogP, paramNorm, gradNorm,
             criterion);
+        if (gradVar >= 0) {
+            fprintf(stderr, "%.3g\n", gradVar);
+        } else {
+            fprintf(stderr, "-\n");
+        }
 
         t++;
+
+        /* Checkpoint the state at the start of iteration t */
+        if (CheckpointDue(checkpoint, t - 1) && t <= maxIter
+            && criterion > crit) {
+            FILE *fp = CheckpointBegin(checkpoint, "svi", n);
+            if (fp != NULL) {
+                AdamCheckpoint(fp, 0, &t, mu, meanGradMu, squareGradMu,
+                    floatMoments, n);
+                AdamCheckpoint(fp, 0, &t, logSig, meanGradLogSig,
+                    squareGradLogSig, floatMoments, n);
+                CheckpointBlock(&counter, sizeof(uint64_t), 1, fp, 0);
+                CheckpointBlock(&meanELBO, sizeof(numeric_t), 1, fp, 0);
+                CheckpointBlock(&meanLogP, sizeof(numeric_t), 1, fp, 0);
+                SVICheckpointReduce(fp, 0, reduce, cvMean, cvSlope, n);
+                CheckpointCommit(fp, checkpoint);
+            }
+        }
     } while (t <= maxIter && criterion > crit);
     free(meanGradMu);
     free(meanGradLogSig);
     free(squareGradMu);
     free(squareGradLogSig);
+    free(cvMean);
+    free(cvSlope);
 
     /* Transform back to linear-space sigmas */
     for (int i = 0; i < n; i++) sigma[i] = exp(logSig[i]);
 
+#if defined(_OPENMP)
+    omp_set_max_active_levels(maxLevels);
+#endif
+
     free(logSig);
     free(s);
     free(z);
     free(gradP);
+    free(negLogPs);
     free(gradMu);
     free(gradLogSig);
 
@@ -181,7 +335,8 @@ numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
 }
 
 void EstimateMaximumAPosteriori(gradfun_t gradlogp, void *data,
-    numeric_t *x, int n, numeric_t eps, int maxIter, numeric_t crit) {
+    numeric_t *x, int n, numeric_t eps, int maxIter, numeric_t crit,
+    int floatMoments, checkpoint_t *checkpoint) {
     /* Compute a MAP (Maximum A Posteriori) estimate of the posterior
        distribution P(x|data) by Stochastic Gradient Descent (Adam)
        Arguments:
@@ -192,6 +347,8 @@ void EstimateMaximumAPosteriori(gradfun_t gradlogp, void *data,
             eps             learning rate
             maxIter         maximum number of iterations
             crit            stop when ||grad|| / ||x|| < crit
+            floatMoments    store the Adam moments in single precision
+            checkpoint      (optional) periodic checkpoints and resume
      */
     /* Use the Mersenne Twister for reproducible sampling results */
     init_genrand(42);
@@ -205,39 +362,41 @@ void EstimateMaximumAPosteriori(gradfun_t gradlogp, void *data,
 
     /* --------------- Stochastically minimize -logP by Adam ---------------- */
     /* Initialize estimates of first and second moments of the gradient */
-    numeric_t *meanG = (numeric_t *) malloc(n * sizeof(numeric_t));
-    numeric_t *squareG = (numeric_t *) malloc(n * sizeof(numeric_t));
-    for (int i = 0; i < n; i++) meanG[i] = 0;
-    for (int i = 0; i < n; i++) squareG[i] = 0;
+    void *meanG = AdamAllocMoments(n, floatMoments);
+    void *squareG = AdamAllocMoments(n, floatMoments);
     int t = 1;
+
+    /* Continue from a checkpoint */
+    FILE *fpResume = CheckpointRestore(checkpoint, "map", n);
+    if (fpResume != NULL) {
+        AdamCheckpoint(fpResume, 1, &t, x, meanG, squareG, floatMoments, n);
+        CheckpointRestoreEnd(fpResume, checkpoint);
+    }
     do {
         /* Estimate the gradient */
         for (int i = 0; i < n; i++) g[i] = 0;
         gradlogp(data, x, g, n);
 
-        /* Update estimates of moments */
+        /* Update estimates of moments and x with Adam learning rates */
         numeric_t beta1 = 0.99;
         numeric_t beta2 = 0.999;
-        for (int i = 0; i < n; i++)
-            meanG[i] = beta1 * meanG[i] + (1.0 - beta1) * g[i];
-        for (int i = 0; i < n; i++)
-            squareG[i] = beta2 * squareG[i] + (1.0 - beta2) * g[i] * g[i];
-
-        /* Update Q with Adam learning rates */
         numeric_t schedule = (1.0 - ((numeric_t) t) / ((numeric_t) maxIter));
         // numeric_t schedule = (1.0 / pow(t, 0.501));
-        numeric_t alpha = eps * schedule
-                              * sqrt(1.0 - pow(beta2, (numeric_t) t)) 
-                                  / (1.0 - pow(beta1, (numeric_t) t));
-        for (int i = 0; i < n; i++)
-            x[i] -= meanG[i] * alpha / (sqrt(squareG[i]) + 1E-8);
+        adam_step_t step;
+        step.beta1 = beta1;
+        step.beta2 = beta2;
+        step.alpha = eps * schedule
+                         * sqrt(1.0 - pow(beta2, (numeric_t) t)) 
+                             / (1.0 - pow(beta1, (numeric_t) t));
+        step.gScale = 1.0;
+        step.gShift = 0;
+        step.normEps = 1E-8;
+        numeric_t sums[3];
+        AdamStep(x, g, meanG, squareG, floatMoments, n, &step, sums);
 
         /* Stopping criterion: ||grad(params)|| / ||params|| */
-        numeric_t paramNorm = 1E-6;
-        for (int i = 0; i < n; i++) paramNorm += x[i] * x[i];
-        numeric_t gradNorm = 1E-6;
-        for (int i = 0; i < n; i++)
-            gradNorm += meanG[i] * meanG[i] / (squareG[i] + 1E-8);
+        numeric_t paramNorm = 1E-6 + sums[1];
+        numeric_t gradNorm = 1E-6 + sums[2];
         paramNorm = sqrt(paramNorm);
         gradNorm = sqrt(gradNorm);
         criterion = gradNorm / paramNorm;
@@ -247,12 +406,203 @@ void EstimateMaximumAPosteriori(gradfun_t gradlogp, void *data,
         fprintf(stderr, "%d\t%.1f\t%.1f\t%.1f\t%.1f\n",
             t, ElapsedTime(&start), paramNorm, gradNorm, criterion);
         t++;
+
+        /* Checkpoint the state at the start of iteration t */
+        if (CheckpointDue(checkpoint, t - 1) && t <= maxIter
+            && criterion > crit) {
+            FILE *fp = CheckpointBegin(checkpoint, "map", n);
+            if (fp != NULL) {
+                AdamCheckpoint(fp, 0, &t, x, meanG, squareG, floatMoments, n);
+                CheckpointCommit(fp, checkpoint);
+            }
+        }
     } while (t <= maxIter && criterion > crit);
     free(meanG);
     free(squareG);
     free(g);
 }
 
+/* Elements per block of AdamStep, whose partial sums are added in block
+   order so that the norms do not depend on the number of threads */
+#define ADAM_BLOCK 4096
+/* Independent partial sums per block, which lets the sums vectorize */
+#define ADAM_LANES 8
+
+/* Adam update of element j in lane l, with the moments stored as moment_t */
+#define ADAM_ELEMENT(moment_t, j, l)                                         \
+    {                                                                         \
+        numeric_t gj = g[j] * step->gScale + step->gShift;                    \
+        numeric_t mj = step->beta1 * ((moment_t *) m)[j]                      \
+                     + (1.0 - step->beta1) * gj;                              \
+        numeric_t vj = step->beta2 * ((moment_t *) v)[j]                      \
+                     + (1.0 - step->beta2) * gj * gj;                         \
+        ((moment_t *) m)[j] = (moment_t) mj;                                  \
+        ((moment_t *) v)[j] = (moment_t) vj;                                  \
+        xSum[l] += x[j];                                                      \
+        x[j] -= mj * step->alpha / (sqrt(vj) + 1E-8);                         \
+        xSquare[l] += x[j] * x[j];                                            \
+        gSquare[l] += mj * mj / (vj + step->normEps);                         \
+    }
+
+#define ADAM_BLOCK_BODY(moment_t)                                            \
+    {                                                                         \
+        int j = lo;                                                           \
+        for (; j + ADAM_LANES <= hi; j += ADAM_LANES)                         \
+            for (int l = 0; l < ADAM_LANES; l++)                              \
+                ADAM_ELEMENT(moment_t, j + l, l)                              \
+        for (; j < hi; j++)                                                   \
+            ADAM_ELEMENT(moment_t, j, 0)                                      \
+    }
+
+void AdamStep(numeric_t *x, const numeric_t *g, void *m, void *v,
+    int floatMoments, int n, const adam_step_t *step, numeric_t *sums) {
+    /* Updates the first and second moments m and v of the gradient g and
+       then x by Adam, streaming through every vector once. The moments are
+       float when floatMoments is set and numeric_t otherwise. Sets sums to
+       Sum x (before the step), Sum x^2 (after) and Sum m^2 / (v + normEps)
+       Arguments:
+            x               parameters (length n)
+            g               raw gradient (length n), read as
+                            g * gScale + gShift
+            m, v            first and second moments (length n)
+            floatMoments    element type of m and v
+            n               number of parameters
+            step            decay rates, learning rate and gradient map
+            sums            the three sums (length 3)
+     */
+    int nBlocks = (n + ADAM_BLOCK - 1) / ADAM_BLOCK;
+    numeric_t *partial =
+        (numeric_t *) malloc(3 * (nBlocks + 1) * sizeof(numeric_t));
+
+    #pragma omp parallel for schedule(static)
+    for (int b = 0; b < nBlocks; b++) {
+        int lo = b * ADAM_BLOCK;
+        int hi = (n - lo < ADAM_BLOCK ? n : lo + ADAM_BLOCK);
+        numeric_t xSum[ADAM_LANES];
+        numeric_t xSquare[ADAM_LANES];
+        numeric_t gSquare[ADAM_LANES];
+        for (int l = 0; l < ADAM_LANES; l++) xSum[l] = 0;
+        for (int l = 0; l < ADAM_LANES; l++) xSquare[l] = 0;
+        for (int l = 0; l < ADAM_LANES; l++) gSquare[l] = 0;
+        if (floatMoments) {
+            ADAM_BLOCK_BODY(float)
+        } else {
+            ADAM_BLOCK_BODY(numeric_t)
+        }
+        partial[3 * b] = 0;
+        partial[3 * b + 1] = 0;
+        partial[3 * b + 2] = 0;
+        for (int l = 0; l < ADAM_LANES; l++) partial[3 * b] += xSum[l];
+        for (int l = 0; l < ADAM_LANES; l++) partial[3 * b + 1] += xSquare[l];
+        for (int l = 0; l < ADAM_LANES; l++) partial[3 * b + 2] += gSquare[l];
+    }
+
+    sums[0] = 0;
+    sums[1] = 0;
+    sums[2] = 0;
+    for (int b = 0; b < nBlocks; b++) {
+        sums[0] += partial[3 * b];
+        sums[1] += partial[3 * b + 1];
+        sums[2] += partial[3 * b + 2];
+    }
+    free(partial);
+}
+
+void AdamCheckpoint(FILE *fp, int restore, int *t, numeric_t *x, void *m,
+    void *v, int floatMoments, int n) {
+    /* Writes or reads back the iteration, x and its moments for AdamStep.
+       The precision of the moments is recorded, and must match on resume */
+    int floatSaved = floatMoments;
+    CheckpointBlock(t, sizeof(int), 1, fp, restore);
+    CheckpointBlock(&floatSaved, sizeof(int), 1, fp, restore);
+    if (floatSaved != floatMoments) {
+        fprintf(stderr, "Checkpoint has Adam moments in %s precision, "
+            "resume %s -af\n", floatSaved ? "single" : "full",
+            floatSaved ? "with" : "without");
+        exit(1);
+    }
+    size_t momentSize = (floatMoments ? sizeof(float) : sizeof(numeric_t));
+    CheckpointBlock(x, sizeof(numeric_t), n, fp, restore);
+    CheckpointBlock(m, momentSize, n, fp, restore);
+    CheckpointBlock(v, momentSize, n, fp, restore);
+}
+
+numeric_t SVIAddUnit(numeric_t *gradMu, numeric_t *gradLogSig,
+    const numeric_t *gradP, const numeric_t *z, int size,
+    const numeric_t *logSig, numeric_t *cvMean, numeric_t *cvSlope,
+    int reduce, int n) {
+    /* Adds the gradients of a unit of size draws S = mu + sigma * Z to
+       gradMu and gradLogSig, with the variance reductions of reduce, and
+       returns the sum of their squares. Draw d has Z and grad(-logP(S)) at
+       z + d * n and gradP + d * n, and contributes h and h * Z * sigma for
+       the derivative h of the objective along S. This is grad(-logP(S)),
+       or with SVI_STL grad(logQ(S) - logP(S)) for fixed Q (sticking the
+       landing, Roeder et al. 2017), which adds -Z / sigma; its mean over Z
+       is the entropy gradient, and it cancels grad(-logP) as Q nears P.
+       With SVI_CONTROL, the first order expansion h ~ a + b Z, with a and b
+       the running means of h and h * Z, is subtracted through its zero
+       mean terms b Z and sigma (a Z + b (Z^2 - 1)), and a and b are then
+       updated with the unit */
+    numeric_t rate = 0.1;
+    numeric_t square = 0;
+    #pragma omp parallel for reduction(+:square)
+    for (int j = 0; j < n; j++) {
+        numeric_t sigma = exp(logSig[j]);
+        numeric_t gMu = 0;
+        numeric_t gLogSig = 0;
+        numeric_t meanH = 0;
+        numeric_t meanHZ = 0;
+        for (int d = 0; d < size; d++) {
+            numeric_t h = gradP[d * n + j];
+            numeric_t zd = z[d * n + j];
+            if (reduce & SVI_STL) h -= zd / sigma;
+            gMu += h;
+            gLogSig += h * zd * sigma;
+            if (reduce & SVI_CONTROL) {
+                gMu -= cvSlope[j] * zd;
+                gLogSig -= sigma
+                    * (cvMean[j] * zd + cvSlope[j] * (zd * zd - 1.0));
+                meanH += h / size;
+                meanHZ += h * zd / size;
+            }
+        }
+        if (reduce & SVI_CONTROL) {
+            cvMean[j] = (1.0 - rate) * cvMean[j] + rate * meanH;
+            cvSlope[j] = (1.0 - rate) * cvSlope[j] + rate * meanHZ;
+        }
+        gradMu[j] += gMu;
+        gradLogSig[j] += gLogSig;
+        square += gMu * gMu + gLogSig * gLogSig;
+    }
+    return square;
+}
+
+void SVICheckpointReduce(FILE *fp, int restore, int reduce,
+    numeric_t *cvMean, numeric_t *cvSlope, int n) {
+    /* Writes or reads back the variance reductions and the running means
+       of the control variates, which must match on resume */
+    int reduceSaved = reduce;
+    CheckpointBlock(&reduceSaved, sizeof(int), 1, fp, restore);
+    if (reduceSaved != reduce) {
+        fprintf(stderr, "Checkpoint has different SVI variance reductions "
+            "(-va/-vl/-vc) than this run\n");
+        exit(1);
+    }
+    if (reduce & SVI_CONTROL) {
+        CheckpointBlock(cvMean, sizeof(numeric_t), n, fp, restore);
+        CheckpointBlock(cvSlope, sizeof(numeric_t), n, fp, restore);
+    }
+}
+
+void *AdamAllocMoments(int n, int floatMoments) {
+    /* Zero-initialized moments for AdamStep */
+    if (floatMoments) {
+        return calloc(n, sizeof(float));
+    } else {
+        return calloc(n, sizeof(numeric_t));
+    }
+}
+
 numeric_t SampleHamiltonianMonteCarlo(hmc_hfun_t hfun, hmc_gradfun_t grad,
     void *data, numeric_t *X, int n, int s, int L, numeric_t *epsilon,
     int warmup) {
@@ -273,8 +623,11 @@ numeric_t SampleHamiltonianMonteCarlo(hmc_hfun_t hfun, hmc_gradfun_t grad,
     numeric_t U = hfun(data, x, n);
     grad(data, x, g, n);
 
-    /* Use the Mersenne Twister for reproducible sampling results */
+    /* Use the Mersenne Twister for reproducible sampling results, with the
+       momenta drawn in batches from a counter-based stream keyed by it */
     init_genrand(42);
+    uint64_t key = RandomKey();
+    uint64_t counter = 0;
 
     /* Step sizes are log-normally distribution with median EPS */
     numeric_t eps = *epsilon;
@@ -306,7 +659,9 @@ numeric_t SampleHamiltonianMonteCarlo(hmc_hfun_t hfun, hmc_gradfun_t grad,
     int windowCount = 0;
     do {
         /* Randomize momentum */
-        for (int i = 0; i < n; i++) p[i] = RandomNormal() * massStd[i];
+        RandomNormals(p, n, key, counter);
+        counter += n;
+        for (int i = 0; i < n; i++) p[i] *= massStd[i];
         numeric_t K = 0;
         for (int i = 0; i < n; i++) K += p[i] * p[i] * invMass[i];
         K *= 0.5;
@@ -383,7 +738,9 @@ numeric_t SampleHamiltonianMonteCarlo(hmc_hfun_t hfun, hmc_gradfun_t grad,
     int nsteps = 0;
     do {
         /* Randomize momentum */
-        for (int i = 0; i < n; i++) p[i] = RandomNormal() * massStd[i];
+        RandomNormals(p, n, key, counter);
+        counter += n;
+        for (int i = 0; i < n; i++) p[i] *= massStd[i];
         numeric_t K = 0;
         for (int i = 0; i < n; i++) K += p[i] * p[i] * invMass[i];
         K *= 0.5;
@@ -573,6 +930,20 @@ numeric_t RandomNormal() {
     return u * mul;
 }
 
+uint64_t RandomKey() {
+    /* Generates 64 random bits from the Mersenne Twister */
+    return ((uint64_t) genrand_int32() << 32) | (uint64_t) genrand_int32();
+}
+
+void RandomNormals(numeric_t *z, int n, uint64_t key, uint64_t counter) {
+    /* Generates n standard normals at once from a counter-based stream */
+#if defined(USE_FLOAT)
+    RNGNormalsFloat(z, n, key, counter);
+#else
+    RNGNormals(z, n, key, counter);
+#endif
+}
+
 numeric_t RandomGamma(numeric_t alpha) {
     /* Generates a standard gamma */
     if (alpha >= 1.0) {
@@ -0,0 +1,365 @@
+/*
+ *      Binary cache of processed alignments
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "include/pvi.h"
+#include "include/cache.h"
+
+/* Cache layout: a fixed header followed by 64-byte aligned sections */
+#define CACHE_MAGIC         "PVICACHE"
+#define CACHE_VERSION       4
+#define CACHE_ALIGN         64
+#define CACHE_TEXT          256
+#define CACHE_EXTENSION     ".pvic"
+
+enum {
+    SECTION_NAMES,
+    SECTION_OFFSETS,
+    SECTION_UNIQUEMAP,
+    SECTION_SEQUENCES,
+    SECTION_WEIGHTS,
+    SECTION_FI,
+    SECTION_FIJ,
+    SECTION_GAPI,
+    SECTION_UNGAPIJ,
+    CACHE_SECTIONS
+};
+
+typedef struct {
+    /* Format */
+    char magic[8];
+    int32_t version;
+    int32_t numericSize;
+    int32_t letterSize;
+    int32_t hasMarginals;
+
+    /* Key: the cache is only valid for identical inputs & processing */
+    uint64_t alignHash;
+    uint64_t alignSize;
+    double theta;
+    double scale;
+    int32_t gapReduce;
+    int32_t hasFocus;
+    int32_t reweight;
+    int32_t builtinAlphabet;    /* codesAA, which processes differently */
+    char alphabet[CACHE_TEXT];
+    char focus[CACHE_TEXT];
+
+    /* Processed alignment */
+    int32_t nSeqs;
+    int32_t nSites;
+    int32_t nCodes;
+    int32_t target;
+    int32_t nSeqsAll;
+    int32_t padding2;
+    double nEff;
+
+    /* Byte offsets and sizes of each section from the start of the file */
+    uint64_t sectionOffset[CACHE_SECTIONS];
+    uint64_t sectionSize[CACHE_SECTIONS];
+} cache_header_t;
+
+/* Internal functions to MSAReadCache & MSAWriteCache */
+char *CachePath(const char *alignFile);
+int CacheHashFile(const char *file, uint64_t *hash, uint64_t *size);
+int CacheSetKey(cache_header_t *header, char *alignFile, options_t *options);
+
+alignment_t *MSAReadCache(char *alignFile, options_t *options) {
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+
+    /* No cache yet is not an error */
+    char *cacheFile = CachePath(alignFile);
+    int fd = open(cacheFile, O_RDONLY);
+    if (fd < 0) {
+        free(cacheFile);
+        return NULL;
+    }
+    struct stat statCache;
+    if (fstat(fd, &statCache) != 0
+        || (size_t) statCache.st_size < sizeof(cache_header_t)) {
+        fprintf(stderr, "Alignment cache %s is unreadable, rebuilding\n",
+            cacheFile);
+        close(fd);
+        free(cacheFile);
+        return NULL;
+    }
+    size_t cacheSize = (size_t) statCache.st_size;
+
+    /* Private mapping: in-place edits of the alignment stay in memory */
+    char *buffer = (char *) mmap(NULL, cacheSize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        fprintf(stderr, "Alignment cache %s could not be mapped, rebuilding\n",
+            cacheFile);
+        free(cacheFile);
+        return NULL;
+    }
+    cache_header_t *header = (cache_header_t *) buffer;
+
+    /* Compare the stored key against the current inputs */
+    int valid = (memcmp(header->magic, CACHE_MAGIC, 8) == 0)
+                && (header->version == CACHE_VERSION)
+                && (header->numericSize == (int32_t) sizeof(numeric_t))
+                && (header->letterSize == (int32_t) sizeof(letter_t));
+    if (valid) {
+        cache_header_t key;
+        valid = CacheSetKey(&key, alignFile, options)
+                && key.alignHash == header->alignHash
+                && key.alignSize == header->alignSize
+                && key.theta == header->theta
+                && key.scale == header->scale
+                && key.gapReduce == header->gapReduce
+                && key.hasFocus == header->hasFocus
+                && key.reweight == header->reweight
+                && key.builtinAlphabet == header->builtinAlphabet
+                && strcmp(key.alphabet, header->alphabet) == 0
+                && strcmp(key.focus, header->focus) == 0;
+    }
+    if (valid && options->cache == CACHE_MARGINALS)
+        valid = header->hasMarginals;
+    for (int k = 0; valid && k < CACHE_SECTIONS; k++)
+        if (header->sectionOffset[k] + header->sectionSize[k] > cacheSize)
+            valid = 0;
+    if (!valid) {
+        fprintf(stderr, "Alignment cache %s is stale, rebuilding\n",
+            cacheFile);
+        munmap(buffer, cacheSize);
+        free(cacheFile);
+        return NULL;
+    }
+
+    /* Point the alignment into the mapped sections */
+    alignment_t *ali = (alignment_t *) malloc(sizeof(alignment_t));
+    ali->nSeqs = header->nSeqs;
+    ali->nSites = header->nSites;
+    ali->nCodes = header->nCodes;
+    ali->alphabet = options->alphabet;
+    ali->target = header->target;
+    ali->nSeqsAll = header->nSeqsAll;
+    ali->nEff = (numeric_t) header->nEff;
+    ali->nParams = 0;
+    ali->samples = NULL;
+    ali->sampleStreams = NULL;
+    ali->swapStats = NULL;
+    ali->aisStreams = NULL;
+    ali->aisStats = NULL;
+    ali->sequences = (letter_t *)
+        (buffer + header->sectionOffset[SECTION_SEQUENCES]);
+    ali->weights = (numeric_t *)
+        (buffer + header->sectionOffset[SECTION_WEIGHTS]);
+    ali->offsets = NULL;
+    if (header->sectionSize[SECTION_OFFSETS] > 0)
+        ali->offsets = (int *)
+            (buffer + header->sectionOffset[SECTION_OFFSETS]);
+    ali->uniqueMap = NULL;
+    if (header->sectionSize[SECTION_UNIQUEMAP] > 0)
+        ali->uniqueMap = (int *)
+            (buffer + header->sectionOffset[SECTION_UNIQUEMAP]);
+    ali->fi = ali->fij = ali->gapi = ali->ungapij = NULL;
+    if (header->hasMarginals) {
+        ali->fi = (numeric_t *) (buffer + header->sectionOffset[SECTION_FI]);
+        ali->fij = (numeric_t *) (buffer + header->sectionOffset[SECTION_FIJ]);
+        if (header->sectionSize[SECTION_GAPI] > 0) {
+            ali->gapi = (numeric_t *)
+                (buffer + header->sectionOffset[SECTION_GAPI]);
+            ali->ungapij = (numeric_t *)
+                (buffer + header->sectionOffset[SECTION_UNGAPIJ]);
+        }
+    }
+
+    /* Names are stored back-to-back as null-terminated strings */
+    ali->names = (char **) malloc(ali->nSeqsAll * sizeof(char *));
+    char *name = buffer + header->sectionOffset[SECTION_NAMES];
+    for (int s = 0; s < ali->nSeqsAll; s++) {
+        ali->names[s] = name;
+        name += strlen(name) + 1;
+    }
+
+    gettimeofday(&stop, NULL);
+    numeric_t loadTime = (numeric_t) (stop.tv_sec - start.tv_sec)
+        + ((numeric_t) (stop.tv_usec - start.tv_usec)) / 1E6;
+    fprintf(stderr, "Loaded alignment cache %s in %.3f s\n", cacheFile,
+        loadTime);
+    fprintf(stderr, "%d unique sequences out of %d, %d sites, "
+        "effective sample size: %.1f\n", ali->nSeqs, ali->nSeqsAll,
+        ali->nSites, ali->nEff);
+    free(cacheFile);
+    return ali;
+}
+
+void MSAWriteCache(char *alignFile, alignment_t *ali, options_t *options) {
+    cache_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, 8);
+    header.version = CACHE_VERSION;
+    header.numericSize = (int32_t) sizeof(numeric_t);
+    header.letterSize = (int32_t) sizeof(letter_t);
+    if (!CacheSetKey(&header, alignFile, options)) {
+        fprintf(stderr, "Alignment cache not written: alphabet or focus "
+            "identifier longer than %d characters\n", CACHE_TEXT - 1);
+        return;
+    }
+    header.nSeqs = ali->nSeqs;
+    header.nSites = ali->nSites;
+    header.nCodes = ali->nCodes;
+    header.target = ali->target;
+    header.nSeqsAll = ali->nSeqsAll;
+    header.nEff = (double) ali->nEff;
+    header.hasMarginals = (options->cache == CACHE_MARGINALS);
+
+    /* Section sizes */
+    size_t nPairs = (size_t) ali->nSites * (ali->nSites - 1) / 2;
+    size_t nCodesSq = (size_t) ali->nCodes * ali->nCodes;
+    uint64_t namesSize = 0;
+    for (int s = 0; s < ali->nSeqsAll; s++)
+        namesSize += strlen(ali->names[s]) + 1;
+    header.sectionSize[SECTION_NAMES] = namesSize;
+    if (ali->offsets != NULL)
+        header.sectionSize[SECTION_OFFSETS] = ali->nSites * sizeof(int);
+    if (ali->uniqueMap != NULL)
+        header.sectionSize[SECTION_UNIQUEMAP] = ali->nSeqsAll * sizeof(int);
+    header.sectionSize[SECTION_SEQUENCES] =
+        (size_t) ali->nSeqs * ali->nSites * sizeof(letter_t);
+    header.sectionSize[SECTION_WEIGHTS] = ali->nSeqs * sizeof(numeric_t);
+    if (header.hasMarginals) {
+        header.sectionSize[SECTION_FI] =
+            (size_t) ali->nSites * ali->nCodes * sizeof(numeric_t);
+        header.sectionSize[SECTION_FIJ] =
+            nPairs * nCodesSq * sizeof(numeric_t);
+        if (ali->gapi != NULL) {
+            header.sectionSize[SECTION_GAPI] = ali->nSites * sizeof(numeric_t);
+            header.sectionSize[SECTION_UNGAPIJ] = nPairs * sizeof(numeric_t);
+        }
+    }
+
+    /* Section offsets */
+    uint64_t offset = sizeof(cache_header_t);
+    for (int k = 0; k < CACHE_SECTIONS; k++) {
+        offset = (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+        header.sectionOffset[k] = offset;
+        offset += header.sectionSize[k];
+    }
+    const void *sectionData[CACHE_SECTIONS] = {
+        NULL, ali->offsets, ali->uniqueMap, ali->sequences, ali->weights,
+        ali->fi, ali->fij, ali->gapi, ali->ungapij
+    };
+
+    /* Write to a temporary file and rename, so readers never see a partial
+       cache */
+    char *cacheFile = CachePath(alignFile);
+    char *tempFile = (char *) malloc(strlen(cacheFile) + 32);
+    sprintf(tempFile, "%s.%d.tmp", cacheFile, (int) getpid());
+    FILE *fpCache = fopen(tempFile, "wb");
+    if (fpCache == NULL) {
+        fprintf(stderr, "Alignment cache not written: cannot open %s\n",
+            tempFile);
+        free(tempFile);
+        free(cacheFile);
+        return;
+    }
+    char padding[CACHE_ALIGN];
+    memset(padding, 0, CACHE_ALIGN);
+    int ok = (fwrite(&header, sizeof(header), 1, fpCache) == 1);
+    uint64_t position = sizeof(cache_header_t);
+    for (int k = 0; ok && k < CACHE_SECTIONS; k++) {
+        uint64_t gap = header.sectionOffset[k] - position;
+        if (gap > 0) ok = (fwrite(padding, 1, gap, fpCache) == gap);
+        if (k == SECTION_NAMES) {
+            for (int s = 0; ok && s < ali->nSeqsAll; s++)
+                ok = (fputs(ali->names[s], fpCache) >= 0)
+                     && (fputc('\0', fpCache) != EOF);
+        } else if (header.sectionSize[k] > 0) {
+            ok = ok && (fwrite(sectionData[k], 1, header.sectionSize[k],
+                fpCache) == header.sectionSize[k]);
+        }
+        position = header.sectionOffset[k] + header.sectionSize[k];
+    }
+    ok = (fclose(fpCache) == 0) && ok;
+    if (ok) ok = (rename(tempFile, cacheFile) == 0);
+    if (ok) {
+        fprintf(stderr, "Wrote alignment cache %s (%.1f MB)\n", cacheFile,
+            ((numeric_t) position) / (1024.0 * 1024.0));
+    } else {
+        fprintf(stderr, "Alignment cache not written: error writing %s\n",
+            tempFile);
+        remove(tempFile);
+    }
+    free(tempFile);
+    free(cacheFile);
+}
+
+char *CachePath(const char *alignFile) {
+    /* The cache lives next to the alignment */
+    char *cacheFile = (char *)
+        malloc(strlen(alignFile) + strlen(CACHE_EXTENSION) + 1);
+    strcpy(cacheFile, alignFile);
+    strcat(cacheFile, CACHE_EXTENSION);
+    return cacheFile;
+}
+
+int CacheHashFile(const char *file, uint64_t *hash, uint64_t *size) {
+    /* 64-bit FNV-1a over 8-byte words of the file, then the trailing bytes */
+    int fd = open(file, O_RDONLY);
+    struct stat statFile;
+    if (fd < 0 || fstat(fd, &statFile) != 0) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    *size = (uint64_t) statFile.st_size;
+    *hash = 14695981039346656037ULL;
+    if (*size == 0) {
+        close(fd);
+        return 1;
+    }
+    const unsigned char *buffer = (const unsigned char *)
+        mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) return 0;
+    #if defined(MADV_SEQUENTIAL)
+    madvise((void *) buffer, *size, MADV_SEQUENTIAL);
+    #endif
+    uint64_t h = *hash;
+    uint64_t nWords = *size / 8;
+    for (uint64_t w = 0; w < nWords; w++) {
+        uint64_t word;
+        memcpy(&word, buffer + 8 * w, 8);
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (uint64_t b = 8 * nWords; b < *size; b++)
+        h = (h ^ buffer[b]) * 1099511628211ULL;
+    *hash = h;
+    munmap((void *) buffer, *size);
+    return 1;
+}
+
+int CacheSetKey(cache_header_t *header, char *alignFile, options_t *options) {
+    /* Fill in everything the processed alignment depends on */
+    if (strlen(options->alphabet) >= CACHE_TEXT
+        || (options->target != NULL && strlen(options->target) >= CACHE_TEXT))
+        return 0;
+    if (!CacheHashFile(alignFile, &(header->alignHash), &(header->alignSize)))
+        return 0;
+    header->theta = (double) options->theta;
+    header->scale = (double) options->scale;
+    header->gapReduce = (options->estimatorMAP == INFER_MAP_PLM_GAPREDUCE);
+    header->hasFocus = (options->target != NULL);
+    header->reweight = options->reweight;
+    header->builtinAlphabet = (options->alphabet == codesAA);
+    memset(header->alphabet, 0, CACHE_TEXT);
+    memset(header->focus, 0, CACHE_TEXT);
+    strcpy(header->alphabet, options->alphabet);
+    if (options->target != NULL) strcpy(header->focus, options->target);
+    return 1;
+}
@@ -0,0 +1,191 @@
+/*
+ *      Checkpoints of the iterative optimizers
+ */
+
+/* fileno and fsync */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "include/pvi.h"
+#include "include/twister.h"
+#include "include/checkpoint.h"
+
+/* Checkpoint layout: a fixed header, the state of the optimizer, the state
+   of the twister and then that of the objective */
+#define CHECKPOINT_MAGIC    "PVICKPT"
+#define CHECKPOINT_VERSION  2
+#define CHECKPOINT_METHOD   16
+
+typedef struct {
+    char magic[8];
+    int32_t version;
+    int32_t numericSize;
+    char method[CHECKPOINT_METHOD];
+    int32_t stage;
+    int32_t n;
+} checkpoint_header_t;
+
+/* Internal to CheckpointBegin & CheckpointRestore */
+char *CheckpointTempPath(const char *file);
+FILE *CheckpointOpenHeader(const checkpoint_t *checkpoint,
+    checkpoint_header_t *header);
+
+checkpoint_t *CheckpointCreate(char *file, int interval, int resume) {
+    if (file == NULL) return NULL;
+    checkpoint_t *checkpoint = (checkpoint_t *) malloc(sizeof(checkpoint_t));
+    checkpoint->file = file;
+    checkpoint->interval = interval;
+    checkpoint->resume = resume;
+    checkpoint->stage = 0;
+    checkpoint->state = NULL;
+    checkpoint->data = NULL;
+    return checkpoint;
+}
+
+void CheckpointFree(checkpoint_t *checkpoint) {
+    free(checkpoint);
+}
+
+int CheckpointSkip(checkpoint_t *checkpoint, int stage) {
+    if (checkpoint == NULL) return 0;
+    checkpoint->stage = stage;
+    if (!checkpoint->resume) return 0;
+    checkpoint_header_t header;
+    FILE *fp = CheckpointOpenHeader(checkpoint, &header);
+    fclose(fp);
+    if (header.stage < stage) {
+        fprintf(stderr, "Checkpoint %s is of stage %d, which has passed\n",
+            checkpoint->file, header.stage);
+        exit(1);
+    }
+    return (header.stage > stage);
+}
+
+int CheckpointDue(const checkpoint_t *checkpoint, int t) {
+    return (checkpoint != NULL && checkpoint->interval > 0
+        && t % checkpoint->interval == 0);
+}
+
+FILE *CheckpointBegin(const checkpoint_t *checkpoint, const char *method,
+    int n) {
+    if (checkpoint == NULL) return NULL;
+    checkpoint_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+    header.version = CHECKPOINT_VERSION;
+    header.numericSize = (int32_t) sizeof(numeric_t);
+    strncpy(header.method, method, CHECKPOINT_METHOD - 1);
+    header.stage = checkpoint->stage;
+    header.n = n;
+
+    char *tempFile = CheckpointTempPath(checkpoint->file);
+    FILE *fp = fopen(tempFile, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "Checkpoint not written: cannot open %s\n", tempFile);
+    } else {
+        fwrite(&header, sizeof(header), 1, fp);
+    }
+    free(tempFile);
+    return fp;
+}
+
+void CheckpointCommit(FILE *fp, const checkpoint_t *checkpoint) {
+    unsigned long twister[GENRAND_STATE_WORDS];
+    get_genrand_state(twister);
+    fwrite(twister, sizeof(unsigned long), GENRAND_STATE_WORDS, fp);
+    if (checkpoint->state != NULL) checkpoint->state(checkpoint->data, fp, 0);
+
+    /* The data must be on disk before the rename makes it the checkpoint */
+    int ok = (ferror(fp) == 0) && (fflush(fp) == 0)
+             && (fsync(fileno(fp)) == 0);
+    ok = (fclose(fp) == 0) && ok;
+    char *tempFile = CheckpointTempPath(checkpoint->file);
+    if (ok) ok = (rename(tempFile, checkpoint->file) == 0);
+    if (!ok) {
+        fprintf(stderr, "Checkpoint not written: error writing %s\n",
+            tempFile);
+        remove(tempFile);
+    }
+    free(tempFile);
+}
+
+FILE *CheckpointRestore(checkpoint_t *checkpoint, const char *method,
+    int n) {
+    if (checkpoint == NULL || !checkpoint->resume) return NULL;
+    checkpoint_header_t header;
+    FILE *fp = CheckpointOpenHeader(checkpoint, &header);
+    if (strncmp(header.method, method, CHECKPOINT_METHOD) != 0
+        || header.stage != checkpoint->stage || header.n != n) {
+        fprintf(stderr, "Checkpoint %s is of %s (stage %d, %d parameters) "
+            "and cannot resume %s (stage %d, %d parameters)\n",
+            checkpoint->file, header.method, header.stage, header.n, method,
+            checkpoint->stage, n);
+        exit(1);
+    }
+    return fp;
+}
+
+void CheckpointRestoreEnd(FILE *fp, checkpoint_t *checkpoint) {
+    unsigned long twister[GENRAND_STATE_WORDS];
+    CheckpointRead(twister, sizeof(unsigned long), GENRAND_STATE_WORDS, fp);
+    set_genrand_state(twister);
+    if (checkpoint->state != NULL) checkpoint->state(checkpoint->data, fp, 1);
+    if (fgetc(fp) != EOF) {
+        fprintf(stderr, "Checkpoint %s has trailing data\n", checkpoint->file);
+        exit(1);
+    }
+    fclose(fp);
+    checkpoint->resume = 0;
+    fprintf(stderr, "Resumed from checkpoint %s\n", checkpoint->file);
+}
+
+void CheckpointRead(void *buffer, size_t size, size_t count, FILE *fp) {
+    if (fread(buffer, size, count, fp) != count) {
+        fprintf(stderr, "Checkpoint is truncated\n");
+        exit(1);
+    }
+}
+
+void CheckpointBlock(void *buffer, size_t size, size_t count, FILE *fp,
+    int restore) {
+    if (restore) {
+        CheckpointRead(buffer, size, count, fp);
+    } else {
+        fwrite(buffer, size, count, fp);
+    }
+}
+
+char *CheckpointTempPath(const char *file) {
+    /* Unique to the process, next to the checkpoint so that the rename stays
+       within one file system */
+    char *tempFile = (char *) malloc(strlen(file) + 32);
+    sprintf(tempFile, "%s.%d.tmp", file, (int) getpid());
+    return tempFile;
+}
+
+FILE *CheckpointOpenHeader(const checkpoint_t *checkpoint,
+    checkpoint_header_t *header) {
+    /* Opens the checkpoint and reads its header, which must be of this
+       format and precision */
+    FILE *fp = fopen(checkpoint->file, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening checkpoint %s\n", checkpoint->file);
+        exit(1);
+    }
+    CheckpointRead(header, sizeof(checkpoint_header_t), 1, fp);
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, 8) != 0
+        || header->version != CHECKPOINT_VERSION
+        || header->numericSize != (int32_t) sizeof(numeric_t)) {
+        fprintf(stderr, "Checkpoint %s is not a checkpoint of this version "
+            "and precision of pvi\n", checkpoint->file);
+        exit(1);
+    }
+    header->method[CHECKPOINT_METHOD - 1] = '\0';
+    return fp;
+}
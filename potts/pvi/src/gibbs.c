@@ -0,0 +1,1016 @@
+/*
+ *      Gibbs sampling of persistent Markov chains for stochastic gradients
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+/* Optionally include OpenMP with the -fopenmp flag */
+#if defined(_OPENMP)
+    #include <omp.h>
+#endif
+
+#include "include/pvi.h"
+#include "include/softmax.h"
+#include "include/gibbs.h"
+#include "include/rng.h"
+
+/* Pair counts are accumulated over tiles of GIBBS_BLOCK x GIBBS_BLOCK sites,
+   sized so that a tile's integer counts stay in L2 */
+#define GIBBS_BLOCK 8
+
+/* Until the Hogwild bias warning is issued, the total influence, which costs
+   as much as a sweep of every chain, is rechecked once per this many calls */
+#define GIBBS_INFLUENCE_INTERVAL 100
+
+/* Candidate pair of sites for blocked updates */
+typedef struct {
+    numeric_t norm;
+    int i;
+    int j;
+} gibbs_pair_t;
+
+/* Internal to Gibbs samplers: cached local fields */
+void GibbsInitFields(numeric_t *H, const letter_t *chain,
+    const gibbs_model_t *model, alignment_t *ali);
+void GibbsUpdateFields(numeric_t *H, int i, int aOld, int aNew,
+    const gibbs_model_t *model, alignment_t *ali);
+/* Internal to GibbsSampleChains: sweeps of single chains and replicas */
+void GibbsSweep(letter_t *chain, numeric_t *H, int *perm, numeric_t *Pij,
+    numeric_t beta, int order, const int *partner, uint64_t *rng,
+    const gibbs_model_t *model, alignment_t *ali);
+void GibbsUpdateSite(letter_t *chain, numeric_t *H, int i, numeric_t beta,
+    double u, const gibbs_model_t *model, alignment_t *ali);
+void GibbsUpdatePair(letter_t *chain, numeric_t *H, numeric_t *P, int i,
+    int j, numeric_t beta, double u, const gibbs_model_t *model,
+    alignment_t *ali);
+numeric_t GibbsEnergy(const letter_t *chain, const numeric_t *H,
+    const gibbs_model_t *model, alignment_t *ali);
+int GibbsPairSites(int *partner, const gibbs_model_t *model,
+    numeric_t threshold, alignment_t *ali);
+int GibbsComparePairs(const void *a, const void *b);
+/* Internal to GibbsSampleChains: parallel updates within each chain */
+void GibbsSampleWithinChains(letter_t *sample, const gibbs_model_t *model,
+    alignment_t *ali, options_t *options);
+int GibbsColorSites(int *sites, int *colorStart, const gibbs_model_t *model,
+    numeric_t threshold, alignment_t *ali);
+void GibbsUpdateColored(letter_t *next, int i, uint64_t key,
+    const letter_t *chain, const gibbs_model_t *model, alignment_t *ali);
+numeric_t GibbsTotalInfluence(const gibbs_model_t *model, alignment_t *ali);
+void GibbsConditional(numeric_t *P, int i, const letter_t *chain,
+    const gibbs_model_t *model, alignment_t *ali);
+int GibbsDraw(numeric_t *P, double u, int nCodes);
+/* Internal to GibbsReportAutocorrelation */
+numeric_t GibbsIntegratedAutocorrelation(const numeric_t *energy,
+    int nChains, int nSweeps);
+numeric_t ElapsedTime(struct timeval *start);
+
+gibbs_model_t *GibbsCreateModel(const numeric_t *x, const numeric_t *lambdas,
+    alignment_t *ali, options_t *options) {
+    gibbs_model_t *model = (gibbs_model_t *) malloc(sizeof(gibbs_model_t));
+    model->x = x;
+    model->W = NULL;
+    model->Wf = NULL;
+    int nScales = ali->nSites + ali->nSites * (ali->nSites - 1) / 2;
+    model->scales = (numeric_t *) malloc(nScales * sizeof(numeric_t));
+    numeric_t *scales = model->scales;
+    for (int k = 0; k < nScales; k++) scales[k] = exp(lambdas[k]);
+
+    /* Materialize the scaled couplings with one row of blocks per site */
+    int q = ali->nCodes;
+    size_t nW = (size_t) ali->nSites * ali->nSites * q * q;
+    if (options->gTensor == GIBBS_TENSOR_NUMERIC) {
+        model->W = (numeric_t *) malloc(nW * sizeof(numeric_t));
+        if (model->W == NULL) {
+            fprintf(stderr, "ERROR: Could not allocate %.0f MB for the "
+                "coupling tensor\n", nW * sizeof(numeric_t) / 1E6);
+            exit(1);
+        }
+    } else if (options->gTensor == GIBBS_TENSOR_FLOAT) {
+        model->Wf = (float *) malloc(nW * sizeof(float));
+        if (model->Wf == NULL) {
+            fprintf(stderr, "ERROR: Could not allocate %.0f MB for the "
+                "coupling tensor\n", nW * sizeof(float) / 1E6);
+            exit(1);
+        }
+    }
+    if (model->W != NULL || model->Wf != NULL) {
+        #pragma omp parallel for
+        for (int i = 0; i < ali->nSites; i++)
+            for (int j = 0; j < ali->nSites; j++) {
+                if (j == i) continue;
+                numeric_t scale = wLambdaEij(scales, i, j);
+                size_t block = ((size_t) i * ali->nSites + j) * q * q;
+                for (int b = 0; b < q; b++)
+                    for (int a = 0; a < q; a++) {
+                        numeric_t w = scale * xEij(i, j, a, b);
+                        if (model->W != NULL) {
+                            model->W[block + b * q + a] = w;
+                        } else {
+                            model->Wf[block + b * q + a] = (float) w;
+                        }
+                    }
+            }
+    }
+    return model;
+}
+
+void GibbsFreeModel(gibbs_model_t *model) {
+    free(model->scales);
+    if (model->W != NULL) free(model->W);
+    if (model->Wf != NULL) free(model->Wf);
+    free(model);
+}
+
+void GibbsSampleChains(letter_t *sample, const gibbs_model_t *model,
+    alignment_t *ali, options_t *options) {
+    int gSweeps = options->gSweeps;
+    int gChains = options->gChains;
+    if (options->gOrder == GIBBS_ORDER_COLORED
+        || options->gOrder == GIBBS_ORDER_HOGWILD) {
+        GibbsSampleWithinChains(sample, model, ali, options);
+        return;
+    }
+
+    /* Blocked sweeps pair up strongly coupled sites */
+    int *partner = NULL;
+    if (options->gOrder == GIBBS_ORDER_BLOCKED) {
+        static int reported = 0;
+        partner = (int *) malloc(ali->nSites * sizeof(int));
+        int nPairs = GibbsPairSites(partner, model, options->gThreshold,
+            ali);
+        /* Concurrent variational draws share the report */
+        #pragma omp critical (gibbs_report)
+        {
+            if (!reported)
+                fprintf(stderr, "Blocked Gibbs sweeps over %d pairs of %d "
+                    "sites\n", nPairs, ali->nSites);
+            reported = 1;
+        }
+    }
+
+    /* Each chain runs gTemps replicas on the ladder beta_k = gBetaMin^(k /
+       (gTemps - 1)), all advanced in parallel. Replica slot r = c * gTemps + k
+       holds temperature k of chain c at the start of the call and keeps
+       stream r, while the ladder position of each slot moves with swaps */
+    int nTemps = options->gTemps;
+    int nReplicas = gChains * nTemps;
+    numeric_t *betas = (numeric_t *) malloc(nTemps * sizeof(numeric_t));
+    betas[0] = 1.0;
+    for (int k = 1; k < nTemps; k++)
+        betas[k] = pow(options->gBetaMin,
+            ((numeric_t) k) / ((numeric_t) (nTemps - 1)));
+    int *slot = (int *) malloc(nReplicas * sizeof(int));
+    for (int r = 0; r < nReplicas; r++) slot[r] = r;
+    numeric_t *energy = (numeric_t *) malloc(nReplicas * sizeof(numeric_t));
+    numeric_t *fields = NULL;
+    int *perms = NULL;
+    if (options->gOrder == GIBBS_ORDER_PERMUTED
+        || options->gOrder == GIBBS_ORDER_BLOCKED)
+        perms = (int *) malloc((size_t) nReplicas * ali->nSites
+            * sizeof(int));
+    numeric_t *pairs = NULL;
+    size_t nPairStates = (size_t) ali->nCodes * ali->nCodes;
+    if (partner != NULL)
+        pairs = (numeric_t *) malloc(nReplicas * nPairStates
+            * sizeof(numeric_t));
+    if (options->gibbs == GIBBS_FIELDS)
+        fields = (numeric_t *) malloc((size_t) nReplicas * ali->nSites
+            * ali->nCodes * sizeof(numeric_t));
+    if (nTemps > 1 && !ali->swapStats) {
+        ali->swapStats = (int *) calloc(2 * (nTemps - 1), sizeof(int));
+        fprintf(stderr, "Replica exchange every %d sweeps at beta",
+            options->gExchange);
+        for (int k = 0; k < nTemps; k++) fprintf(stderr, " %.3f", betas[k]);
+        fprintf(stderr, "\n");
+    }
+
+    /* Sweeps run in segments between exchanges */
+    int segment = nTemps > 1 ? options->gExchange : gSweeps;
+    for (int sStart = 0; sStart < gSweeps; sStart += segment) {
+        int sStop = sStart + segment < gSweeps ? sStart + segment : gSweeps;
+
+        /* Parallelize across the chains and their replicas */
+        #pragma omp parallel for
+        for (int r = 0; r < nReplicas; r++) {
+            int c = r / nTemps;
+            int k = r % nTemps;
+            int sr = slot[r];
+            letter_t *chain = &(ali->samples[sr * ali->nSites]);
+            numeric_t *H = NULL;
+            if (fields != NULL) {
+                H = &(fields[(size_t) sr * ali->nSites * ali->nCodes]);
+                if (sStart == 0) GibbsInitFields(H, chain, model, ali);
+            }
+            int *perm = perms != NULL ?
+                &(perms[(size_t) r * ali->nSites]) : NULL;
+            numeric_t *Pij = pairs != NULL ? &(pairs[r * nPairStates]) : NULL;
+            /* The stream is advanced locally to keep it out of shared lines */
+            uint64_t rng[RNG_STATE_WORDS];
+            for (int w = 0; w < RNG_STATE_WORDS; w++)
+                rng[w] = ali->sampleStreams[sr * RNG_STATE_WORDS + w];
+
+            for (int s = sStart; s < sStop; s++) {
+                GibbsSweep(chain, H, perm, Pij, betas[k], options->gOrder,
+                    partner, rng, model, ali);
+
+                /* Copy the beta = 1 sequence into the global sample */
+                if (k == 0)
+                    for (int i = 0; i < ali->nSites; i++)
+                        sample[c * gSweeps * ali->nSites + s * ali->nSites
+                               + i] = chain[i];
+            }
+            if (nTemps > 1) energy[sr] = GibbsEnergy(chain, H, model, ali);
+            for (int w = 0; w < RNG_STATE_WORDS; w++)
+                ali->sampleStreams[sr * RNG_STATE_WORDS + w] = rng[w];
+        }
+
+        /* Swap neighboring rungs, alternating between even and odd rungs,
+           with uniforms from the stream of each chain's first slot */
+        if (nTemps > 1) {
+            int parity = (sStart / segment) % 2;
+            for (int c = 0; c < gChains; c++) {
+                uint64_t *rng = &(ali->sampleStreams[c * nTemps
+                                                     * RNG_STATE_WORDS]);
+                for (int k = parity; k < nTemps - 1; k += 2) {
+                    int *pair = &(slot[c * nTemps + k]);
+                    numeric_t logR = (betas[k] - betas[k + 1])
+                        * (energy[pair[1]] - energy[pair[0]]);
+                    ali->swapStats[k]++;
+                    if (logR >= 0 || log(RNGUniform(rng)) < logR) {
+                        int swap = pair[0];
+                        pair[0] = pair[1];
+                        pair[1] = swap;
+                        ali->swapStats[nTemps - 1 + k]++;
+                    }
+                }
+            }
+        }
+    }
+
+    /* Store each chain's replicas in ladder order for the next call */
+    if (nTemps > 1) {
+        letter_t *ladder = (letter_t *)
+            malloc(nReplicas * ali->nSites * sizeof(letter_t));
+        for (int r = 0; r < nReplicas; r++)
+            for (int i = 0; i < ali->nSites; i++)
+                ladder[r * ali->nSites + i] =
+                    ali->samples[slot[r] * ali->nSites + i];
+        for (int i = 0; i < nReplicas * ali->nSites; i++)
+            ali->samples[i] = ladder[i];
+        free(ladder);
+    }
+    free(betas);
+    free(slot);
+    free(energy);
+    if (fields != NULL) free(fields);
+    if (perms != NULL) free(perms);
+    if (pairs != NULL) free(pairs);
+    if (partner != NULL) free(partner);
+}
+
+void GibbsSweep(letter_t *chain, numeric_t *H, int *perm, numeric_t *Pij,
+    numeric_t beta, int order, const int *partner, uint64_t *rng,
+    const gibbs_model_t *model, alignment_t *ali) {
+    /* One sweep of site updates at inverse temperature beta, from the cached
+       fields H if given. Random sweeps make nSites draws with replacement,
+       the others visit every site (or pair, when blocked) once. Permuted and
+       blocked sweeps shuffle the nSites scratch perm, and pair draws use the
+       q x q scratch Pij, both owned by the chain */
+    int shuffled = (order == GIBBS_ORDER_PERMUTED
+                    || order == GIBBS_ORDER_BLOCKED);
+    if (shuffled) {
+        /* Fisher-Yates shuffle */
+        for (int ix = 0; ix < ali->nSites; ix++) perm[ix] = ix;
+        for (int ix = ali->nSites - 1; ix > 0; ix--) {
+            int jx = RNGIndex(rng, ix + 1);
+            int swap = perm[ix];
+            perm[ix] = perm[jx];
+            perm[jx] = swap;
+        }
+    }
+    for (int sx = 0; sx < ali->nSites; sx++) {
+        int i = sx;
+        if (order == GIBBS_ORDER_RANDOM) i = RNGIndex(rng, ali->nSites);
+        if (shuffled) i = perm[sx];
+        if (partner != NULL && partner[i] >= 0) {
+            /* Each pair is drawn jointly when its first site comes up */
+            if (partner[i] < i) continue;
+            GibbsUpdatePair(chain, H, Pij, i, partner[i], beta,
+                RNGUniform(rng), model, ali);
+        } else {
+            GibbsUpdateSite(chain, H, i, beta, RNGUniform(rng), model, ali);
+        }
+    }
+}
+
+void GibbsUpdateSite(letter_t *chain, numeric_t *H, int i, numeric_t beta,
+    double u, const gibbs_model_t *model, alignment_t *ali) {
+    /* Draws site i from its conditional at inverse temperature beta */
+    numeric_t P[SOFTMAX_MAX_STATES];
+    if (H != NULL) {
+        /* Copied whole so the compiler sees P set before the draw */
+        memcpy(P, &(Hp(i, 0)), ali->nCodes * sizeof(numeric_t));
+    } else {
+        GibbsConditional(P, i, chain, model, ali);
+    }
+    if (beta != 1.0)
+        for (int a = 0; a < ali->nCodes; a++) P[a] *= beta;
+    int aNew = GibbsDraw(P, u, ali->nCodes);
+    if (H != NULL && aNew != chain[i])
+        GibbsUpdateFields(H, i, chain[i], aNew, model, ali);
+    chain[i] = aNew;
+}
+
+void GibbsUpdatePair(letter_t *chain, numeric_t *H, numeric_t *P, int i,
+    int j, numeric_t beta, double u, const gibbs_model_t *model,
+    alignment_t *ali) {
+    /* Draws sites i and j jointly from their q x q conditional, built in P,
+       at inverse temperature beta, taking the pair's own coupling out of
+       their fields */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    int q = ali->nCodes;
+    numeric_t Hi[SOFTMAX_MAX_STATES];
+    numeric_t Hj[SOFTMAX_MAX_STATES];
+    if (H != NULL) {
+        memcpy(Hi, &(Hp(i, 0)), q * sizeof(numeric_t));
+        memcpy(Hj, &(Hp(j, 0)), q * sizeof(numeric_t));
+    } else {
+        GibbsConditional(Hi, i, chain, model, ali);
+        GibbsConditional(Hj, j, chain, model, ali);
+    }
+    numeric_t scale = wLambdaEij(scales, i, j);
+    for (int a = 0; a < q; a++) Hi[a] -= scale * xEij(i, j, a, chain[j]);
+    for (int b = 0; b < q; b++) Hj[b] -= scale * xEij(i, j, chain[i], b);
+    for (int a = 0; a < q; a++)
+        for (int b = 0; b < q; b++)
+            P[a * q + b] = beta * (Hi[a] + Hj[b] + scale * xEij(i, j, a, b));
+    int ab = GibbsDraw(P, u, q * q);
+
+    int aNew = ab / q;
+    int bNew = ab % q;
+    if (H != NULL && aNew != chain[i])
+        GibbsUpdateFields(H, i, chain[i], aNew, model, ali);
+    chain[i] = aNew;
+    if (H != NULL && bNew != chain[j])
+        GibbsUpdateFields(H, j, chain[j], bNew, model, ali);
+    chain[j] = bNew;
+}
+
+int GibbsPairSites(int *partner, const gibbs_model_t *model,
+    numeric_t threshold, alignment_t *ali) {
+    /* Greedily matches sites in order of decreasing Frobenius norm of their
+       scaled coupling block, leaving out pairs at or below threshold.
+       partner[i] is the site matched to i or -1, and the number of pairs is
+       returned */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    int L = ali->nSites;
+    int nPairs = L * (L - 1) / 2;
+    gibbs_pair_t *pairs = (gibbs_pair_t *)
+        malloc(nPairs * sizeof(gibbs_pair_t));
+    int k = 0;
+    for (int i = 0; i < L - 1; i++)
+        for (int j = i + 1; j < L; j++) {
+            numeric_t scale = wLambdaEij(scales, i, j);
+            numeric_t norm = 0;
+            for (int ai = 0; ai < ali->nCodes; ai++)
+                for (int aj = 0; aj < ali->nCodes; aj++)
+                    norm += scale * xEij(i, j, ai, aj)
+                          * scale * xEij(i, j, ai, aj);
+            pairs[k].norm = sqrt(norm);
+            pairs[k].i = i;
+            pairs[k].j = j;
+            k++;
+        }
+    qsort(pairs, nPairs, sizeof(gibbs_pair_t), GibbsComparePairs);
+
+    for (int i = 0; i < L; i++) partner[i] = -1;
+    int nMatched = 0;
+    for (k = 0; k < nPairs && pairs[k].norm > threshold; k++) {
+        int i = pairs[k].i;
+        int j = pairs[k].j;
+        if (partner[i] < 0 && partner[j] < 0) {
+            partner[i] = j;
+            partner[j] = i;
+            nMatched++;
+        }
+    }
+    free(pairs);
+    return nMatched;
+}
+
+int GibbsComparePairs(const void *a, const void *b) {
+    /* Decreasing norm, then increasing sites */
+    const gibbs_pair_t *pa = (const gibbs_pair_t *) a;
+    const gibbs_pair_t *pb = (const gibbs_pair_t *) b;
+    if (pa->norm != pb->norm) return pa->norm < pb->norm ? 1 : -1;
+    if (pa->i != pb->i) return pa->i - pb->i;
+    return pa->j - pb->j;
+}
+
+numeric_t GibbsEnergy(const letter_t *chain, const numeric_t *H,
+    const gibbs_model_t *model, alignment_t *ali) {
+    /* Log potential sum_i h_i + sum_i<j e_ij of the chain. With cached
+       fields, every coupling is counted twice in sum_i H_i */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    numeric_t U = 0;
+    if (H != NULL) {
+        for (int i = 0; i < ali->nSites; i++)
+            U += Hp(i, chain[i]) + wLambdaHi(scales, i) * xHi(i, chain[i]);
+        return 0.5 * U;
+    }
+    for (int i = 0; i < ali->nSites; i++)
+        U += wLambdaHi(scales, i) * xHi(i, chain[i]);
+    for (int i = 0; i < ali->nSites - 1; i++)
+        for (int j = i + 1; j < ali->nSites; j++)
+            U += wLambdaEij(scales, i, j) * xEij(i, j, chain[i], chain[j]);
+    return U;
+}
+
+void GibbsReportExchange(alignment_t *ali, options_t *options) {
+    if (options->gTemps < 2 || ali->swapStats == NULL) return;
+    int nRungs = options->gTemps - 1;
+    fprintf(stderr, "Replica exchange acceptance by rung:");
+    for (int k = 0; k < nRungs; k++)
+        fprintf(stderr, " %.3f", ali->swapStats[k] > 0 ?
+            ((numeric_t) ali->swapStats[nRungs + k]) / ali->swapStats[k] : 0);
+    fprintf(stderr, "\n");
+}
+
+void GibbsReportAutocorrelation(const numeric_t *x, const numeric_t *lambdas,
+    alignment_t *ali, options_t *options) {
+    int nSweeps = options->gAutocorr;
+    int gChains = options->gChains;
+    if (nSweeps < 2) return;
+    gibbs_model_t *model = GibbsCreateModel(x, lambdas, ali, options);
+    int *partner = (int *) malloc(ali->nSites * sizeof(int));
+    int nPairs = GibbsPairSites(partner, model, options->gThreshold, ali);
+    numeric_t *energy = (numeric_t *)
+        malloc(gChains * nSweeps * sizeof(numeric_t));
+
+    const int orders[4] = {GIBBS_ORDER_RANDOM, GIBBS_ORDER_PERMUTED,
+                           GIBBS_ORDER_SYSTEMATIC, GIBBS_ORDER_BLOCKED};
+    const char *names[4] = {"random", "permuted", "systematic", "blocked"};
+    fprintf(stderr, "Gibbs energy autocorrelation over %d sweeps of %d chains"
+        " (%d blocked pairs)\n", nSweeps, gChains, nPairs);
+    fprintf(stderr, "order\t\tms/sweep\ttau\tESS/s\n");
+    for (int o = 0; o < 4; o++) {
+        /* Every order starts from copies of the beta = 1 chains and their
+           streams, leaving the persistent state untouched */
+        struct timeval start;
+        gettimeofday(&start, NULL);
+        #pragma omp parallel for
+        for (int c = 0; c < gChains; c++) {
+            int sr = c * options->gTemps;
+            letter_t *chain = (letter_t *)
+                malloc(ali->nSites * sizeof(letter_t));
+            for (int i = 0; i < ali->nSites; i++)
+                chain[i] = ali->samples[sr * ali->nSites + i];
+            uint64_t rng[RNG_STATE_WORDS];
+            for (int w = 0; w < RNG_STATE_WORDS; w++)
+                rng[w] = ali->sampleStreams[sr * RNG_STATE_WORDS + w];
+            numeric_t *H = NULL;
+            if (options->gibbs == GIBBS_FIELDS) {
+                H = (numeric_t *)
+                    malloc(ali->nSites * ali->nCodes * sizeof(numeric_t));
+                GibbsInitFields(H, chain, model, ali);
+            }
+            int *perm = (int *) malloc(ali->nSites * sizeof(int));
+            numeric_t *Pij = NULL;
+            if (orders[o] == GIBBS_ORDER_BLOCKED)
+                Pij = (numeric_t *)
+                    malloc(ali->nCodes * ali->nCodes * sizeof(numeric_t));
+            for (int s = 0; s < nSweeps; s++) {
+                GibbsSweep(chain, H, perm, Pij, 1.0, orders[o],
+                    orders[o] == GIBBS_ORDER_BLOCKED ? partner : NULL, rng,
+                    model, ali);
+                energy[c * nSweeps + s] = GibbsEnergy(chain, H, model, ali);
+            }
+            free(chain);
+            if (H != NULL) free(H);
+            free(perm);
+            if (Pij != NULL) free(Pij);
+        }
+        numeric_t elapsed = ElapsedTime(&start);
+        numeric_t tau = GibbsIntegratedAutocorrelation(energy, gChains,
+            nSweeps);
+
+        /* Effective samples per second over all chains */
+        numeric_t perSweep = elapsed / ((numeric_t) nSweeps);
+        fprintf(stderr, "%s\t%s%.2f\t\t%.2f\t%.1f\n", names[o],
+            strlen(names[o]) < 8 ? "\t" : "", 1E3 * perSweep, tau,
+            gChains / (tau * perSweep));
+    }
+    free(energy);
+    free(partner);
+    GibbsFreeModel(model);
+}
+
+numeric_t GibbsIntegratedAutocorrelation(const numeric_t *energy,
+    int nChains, int nSweeps) {
+    /* tau = 1 + 2 sum_t rho(t), with the autocorrelation rho pooled over
+       chains around their grand mean and the sum cut at the first lag
+       M >= 5 tau(M) (Sokal's window) */
+    numeric_t mean = 0;
+    for (int k = 0; k < nChains * nSweeps; k++) mean += energy[k];
+    mean /= (numeric_t) (nChains * nSweeps);
+    numeric_t var = 0;
+    for (int k = 0; k < nChains * nSweeps; k++)
+        var += (energy[k] - mean) * (energy[k] - mean);
+    var /= (numeric_t) (nChains * nSweeps);
+    if (var <= 0) return 1.0;
+
+    numeric_t tau = 1.0;
+    for (int t = 1; t < nSweeps; t++) {
+        numeric_t cov = 0;
+        for (int c = 0; c < nChains; c++) {
+            const numeric_t *E = &(energy[c * nSweeps]);
+            for (int s = 0; s + t < nSweeps; s++)
+                cov += (E[s] - mean) * (E[s + t] - mean);
+        }
+        cov /= (numeric_t) (nChains * (nSweeps - t));
+        tau += 2.0 * cov / var;
+        if (t >= 5.0 * tau) break;
+    }
+    return tau;
+}
+
+void GibbsInitFields(numeric_t *H, const letter_t *chain,
+    const gibbs_model_t *model, alignment_t *ali) {
+    /* Computes the local fields Hp(i, a) of every site given the rest of the
+       chain */
+    if (model->W != NULL || model->Wf != NULL) {
+        for (int i = 0; i < ali->nSites; i++)
+            GibbsConditional(&(Hp(i, 0)), i, chain, model, ali);
+        return;
+    }
+
+    /* Without materialized couplings, each block is visited once */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    for (int i = 0; i < ali->nSites; i++)
+        for (int a = 0; a < ali->nCodes; a++)
+            Hp(i, a) = wLambdaHi(scales, i) * xHi(i, a);
+    for (int i = 0; i < ali->nSites - 1; i++)
+        for (int j = i + 1; j < ali->nSites; j++) {
+            numeric_t scale = wLambdaEij(scales, i, j);
+            for (int a = 0; a < ali->nCodes; a++)
+                Hp(i, a) += scale * xEij(i, j, a, chain[j]);
+            for (int b = 0; b < ali->nCodes; b++)
+                Hp(j, b) += scale * xEij(j, i, b, chain[i]);
+        }
+}
+
+void GibbsUpdateFields(numeric_t *H, int i, int aOld, int aNew,
+    const gibbs_model_t *model, alignment_t *ali) {
+    /* Moves the fields at every other site from site i in state aOld to
+       site i in state aNew */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    int q = ali->nCodes;
+    for (int j = 0; j < ali->nSites; j++) {
+        if (j == i) continue;
+        size_t block = ((size_t) j * ali->nSites + i) * q;
+        if (model->W != NULL) {
+            const numeric_t *WNew = &(model->W[(block + aNew) * q]);
+            const numeric_t *WOld = &(model->W[(block + aOld) * q]);
+            for (int b = 0; b < q; b++) Hp(j, b) += WNew[b] - WOld[b];
+        } else if (model->Wf != NULL) {
+            const float *WNew = &(model->Wf[(block + aNew) * q]);
+            const float *WOld = &(model->Wf[(block + aOld) * q]);
+            for (int b = 0; b < q; b++) Hp(j, b) += WNew[b] - WOld[b];
+        } else {
+            numeric_t scale = wLambdaEij(scales, i, j);
+            for (int b = 0; b < q; b++)
+                Hp(j, b) += scale
+                    * (xEij(j, i, b, aNew) - xEij(j, i, b, aOld));
+        }
+    }
+}
+
+void GibbsSampleWithinChains(letter_t *sample, const gibbs_model_t *model,
+    alignment_t *ali, options_t *options) {
+    /* Chains run one after another, each spreading its site updates over all
+       threads. Uniforms are counter-based draws keyed once per sweep from
+       the chain's stream */
+    static int reported = 0;
+    static int warned = 0;
+    static int calls = 0;
+    int gSweeps = options->gSweeps;
+    int gChains = options->gChains;
+    int *sites = (int *) malloc(ali->nSites * sizeof(int));
+    int *colorStart = (int *) malloc((ali->nSites + 1) * sizeof(int));
+    letter_t *next = (letter_t *) malloc(ali->nSites * sizeof(letter_t));
+
+    int nColors = 0;
+    if (options->gOrder == GIBBS_ORDER_COLORED)
+        nColors = GibbsColorSites(sites, colorStart, model,
+            options->gThreshold, ali);
+
+    /* Concurrent variational draws share the report and the bias check */
+    #pragma omp critical (gibbs_report)
+    {
+        if (options->gOrder == GIBBS_ORDER_COLORED) {
+            if (!reported)
+                fprintf(stderr, "Gibbs sweeps over %d colors of %d sites\n",
+                    nColors, ali->nSites);
+        } else {
+            /* Bias check for asynchronous updates */
+            int nThreads = 1;
+            #if defined(_OPENMP)
+            nThreads = omp_get_max_threads();
+            #endif
+            int check = nThreads > 1 && !warned
+                        && calls % GIBBS_INFLUENCE_INTERVAL == 0;
+            if (!reported || check) {
+                numeric_t alpha = GibbsTotalInfluence(model, ali);
+                if (!reported)
+                    fprintf(stderr, "Hogwild Gibbs sweeps with %d threads, "
+                        "total influence %.3f\n", nThreads, alpha);
+                if (alpha >= 1.0 && check) {
+                    fprintf(stderr, "Warning: total influence %.3f >= 1, "
+                        "asynchronous Gibbs samples may be biased\n", alpha);
+                    warned = 1;
+                }
+            }
+            calls++;
+        }
+        reported = 1;
+    }
+
+    for (int c = 0; c < gChains; c++) {
+        letter_t *chain = &(ali->samples[c * ali->nSites]);
+        uint64_t *rng = &(ali->sampleStreams[c * RNG_STATE_WORDS]);
+        for (int s = 0; s < gSweeps; s++) {
+            uint64_t key = RNGNext(rng);
+            if (options->gOrder == GIBBS_ORDER_COLORED) {
+                /* Sites of one color read the states at the start of the
+                   color and write theirs to next. One team runs the whole
+                   sweep, with the implicit barriers of the worksharing
+                   loops separating the colors. Colors with fewer sites
+                   than threads are drawn by one thread */
+                #pragma omp parallel
+                {
+                    int nTeam = 1;
+                    #if defined(_OPENMP)
+                    nTeam = omp_get_num_threads();
+                    #endif
+                    for (int k = 0; k < nColors; k++) {
+                        int start = colorStart[k];
+                        int stop = colorStart[k + 1];
+                        if (stop - start < nTeam) {
+                            #pragma omp single
+                            {
+                                for (int ix = start; ix < stop; ix++)
+                                    GibbsUpdateColored(next, sites[ix], key,
+                                        chain, model, ali);
+                                for (int ix = start; ix < stop; ix++)
+                                    chain[sites[ix]] = next[sites[ix]];
+                            }
+                        } else {
+                            #pragma omp for
+                            for (int ix = start; ix < stop; ix++)
+                                GibbsUpdateColored(next, sites[ix], key,
+                                    chain, model, ali);
+                            #pragma omp for
+                            for (int ix = start; ix < stop; ix++)
+                                chain[sites[ix]] = next[sites[ix]];
+                        }
+                    }
+                }
+            } else {
+                /* Random sites in place, without synchronization */
+                #pragma omp parallel for
+                for (int sx = 0; sx < ali->nSites; sx++) {
+                    int i = RNGIndexBits(RNGHash(key, 2 * sx), ali->nSites);
+                    numeric_t P[SOFTMAX_MAX_STATES];
+                    GibbsConditional(P, i, chain, model, ali);
+                    chain[i] = GibbsDraw(P,
+                        RNGUniformBits(RNGHash(key, 2 * sx + 1)), ali->nCodes);
+                }
+            }
+
+            /* Copy sequence into the global sample */
+            for (int i = 0; i < ali->nSites; i++)
+                sample[c * gSweeps * ali->nSites + s * ali->nSites + i] =
+                    chain[i];
+        }
+    }
+    free(sites);
+    free(colorStart);
+    free(next);
+}
+
+void GibbsUpdateColored(letter_t *next, int i, uint64_t key,
+    const letter_t *chain, const gibbs_model_t *model, alignment_t *ali) {
+    /* Draws site i into next with the uniform keyed to the sweep and site,
+       so that the draw does not depend on the thread that makes it */
+    numeric_t P[SOFTMAX_MAX_STATES];
+    GibbsConditional(P, i, chain, model, ali);
+    next[i] = GibbsDraw(P, RNGUniformBits(RNGHash(key, i)), ali->nCodes);
+}
+
+int GibbsColorSites(int *sites, int *colorStart, const gibbs_model_t *model,
+    numeric_t threshold, alignment_t *ali) {
+    /* Greedily colors, largest degree first, the graph linking the sites
+       whose scaled coupling block has a Frobenius norm above threshold.
+       Sites are listed by color in sites, with color k on
+       [colorStart[k], colorStart[k + 1]), and the number of colors returned */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    int L = ali->nSites;
+    char *linked = (char *) calloc((size_t) L * L, sizeof(char));
+    int *degree = (int *) calloc(L, sizeof(int));
+    for (int i = 0; i < L - 1; i++)
+        for (int j = i + 1; j < L; j++) {
+            numeric_t scale = wLambdaEij(scales, i, j);
+            numeric_t norm = 0;
+            for (int ai = 0; ai < ali->nCodes; ai++)
+                for (int aj = 0; aj < ali->nCodes; aj++)
+                    norm += scale * xEij(i, j, ai, aj)
+                          * scale * xEij(i, j, ai, aj);
+            if (norm > threshold * threshold) {
+                linked[(size_t) i * L + j] = linked[(size_t) j * L + i] = 1;
+                degree[i]++;
+                degree[j]++;
+            }
+        }
+
+    /* Visit sites by decreasing degree (stable insertion sort) */
+    int *order = (int *) malloc(L * sizeof(int));
+    for (int ix = 0; ix < L; ix++) {
+        int jx = ix;
+        while (jx > 0 && degree[order[jx - 1]] < degree[ix]) {
+            order[jx] = order[jx - 1];
+            jx--;
+        }
+        order[jx] = ix;
+    }
+
+    /* Each site takes the smallest color that none of its neighbors has */
+    int *color = (int *) malloc(L * sizeof(int));
+    int *taken = (int *) calloc(L + 1, sizeof(int));
+    for (int i = 0; i < L; i++) color[i] = -1;
+    int nColors = 0;
+    for (int ix = 0; ix < L; ix++) {
+        int i = order[ix];
+        for (int j = 0; j < L; j++)
+            if (linked[(size_t) i * L + j] && color[j] >= 0)
+                taken[color[j]] = ix + 1;
+        int k = 0;
+        while (taken[k] == ix + 1) k++;
+        color[i] = k;
+        if (k + 1 > nColors) nColors = k + 1;
+    }
+
+    /* List the sites by color */
+    for (int k = 0; k <= nColors; k++) colorStart[k] = 0;
+    for (int i = 0; i < L; i++) colorStart[color[i] + 1]++;
+    for (int k = 0; k < nColors; k++) colorStart[k + 1] += colorStart[k];
+    for (int k = 0; k < nColors; k++) taken[k] = colorStart[k];
+    for (int i = 0; i < L; i++) sites[taken[color[i]]++] = i;
+
+    free(linked);
+    free(degree);
+    free(order);
+    free(color);
+    free(taken);
+    return nColors;
+}
+
+numeric_t GibbsTotalInfluence(const gibbs_model_t *model, alignment_t *ali) {
+    /* Dobrushin's total influence alpha = max_i sum_j C_ij, bounding the
+       influence of site j on the conditional at site i by
+       C_ij <= tanh(max |e_ij|), since changing the state of j moves the
+       conditional energies at i over a range of at most 4 max |e_ij| */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    numeric_t *influence = (numeric_t *) calloc(ali->nSites, sizeof(numeric_t));
+    for (int i = 0; i < ali->nSites - 1; i++)
+        for (int j = i + 1; j < ali->nSites; j++) {
+            numeric_t maxE = 0;
+            for (int ai = 0; ai < ali->nCodes; ai++)
+                for (int aj = 0; aj < ali->nCodes; aj++)
+                    maxE = fmax(maxE, fabs(xEij(i, j, ai, aj)));
+            numeric_t Cij = tanh(wLambdaEij(scales, i, j) * maxE);
+            influence[i] += Cij;
+            influence[j] += Cij;
+        }
+    numeric_t alpha = 0;
+    for (int i = 0; i < ali->nSites; i++) alpha = fmax(alpha, influence[i]);
+    free(influence);
+    return alpha;
+}
+
+void GibbsConditional(numeric_t *P, int i, const letter_t *chain,
+    const gibbs_model_t *model, alignment_t *ali) {
+    /* Conditional energies at site i given the rest of the chain */
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+    int q = ali->nCodes;
+    for (int a = 0; a < q; a++)
+        P[a] = wLambdaHi(scales, i) * xHi(i, a);
+    if (model->W != NULL) {
+        const numeric_t *Wi = &(model->W[(size_t) i * ali->nSites * q * q]);
+        for (int j = 0; j < ali->nSites; j++) {
+            if (j == i) continue;
+            const numeric_t *Wij = &(Wi[((size_t) j * q + chain[j]) * q]);
+            for (int a = 0; a < q; a++) P[a] += Wij[a];
+        }
+    } else if (model->Wf != NULL) {
+        const float *Wi = &(model->Wf[(size_t) i * ali->nSites * q * q]);
+        for (int j = 0; j < ali->nSites; j++) {
+            if (j == i) continue;
+            const float *Wij = &(Wi[((size_t) j * q + chain[j]) * q]);
+            for (int a = 0; a < q; a++) P[a] += Wij[a];
+        }
+    } else {
+        for (int j = 0; j < i; j++) {
+            numeric_t scale = wLambdaEij(scales, i, j);
+            for (int a = 0; a < q; a++)
+                P[a] += scale * xEij(i, j, a, chain[j]);
+        }
+        for (int j = i + 1; j < ali->nSites; j++) {
+            numeric_t scale = wLambdaEij(scales, i, j);
+            for (int a = 0; a < q; a++)
+                P[a] += scale * xEij(i, j, a, chain[j]);
+        }
+    }
+}
+
+int GibbsDraw(numeric_t *P, double u, int nCodes) {
+    /* Draws a state from conditional energies P (overwritten) given a
+       uniform u on (0, 1) */
+    ExpShifted(P, P, nCodes);
+    for (int a = 1; a < nCodes; a++) P[a] += P[a - 1];
+    u *= P[nCodes - 1];
+    int a = 0;
+    while (a < nCodes - 1 && u > P[a]) a++;
+    return a;
+}
+
+numeric_t GibbsLogPartition(numeric_t *ess, numeric_t *logZVar,
+    const gibbs_model_t *model, alignment_t *ali, options_t *options) {
+    int nParticles = options->aisParticles;
+    int nSteps = options->aisSweeps * ali->nSites;
+    const numeric_t *x = model->x;
+    const numeric_t *scales = model->scales;
+
+    /* The starting distribution (fields only) factorizes over sites */
+    numeric_t logZ0 = 0;
+    for (int i = 0; i < ali->nSites; i++) {
+        numeric_t P[SOFTMAX_MAX_STATES];
+        for (int a = 0; a < ali->nCodes; a++)
+            P[a] = wLambdaHi(scales, i) * xHi(i, a);
+        logZ0 += Softmax(P, P, ali->nCodes);
+    }
+
+    /* Particles anneal the couplings in from beta = 0 to 1 over nSteps
+       random-site Gibbs moves, with log weights sum_t dBeta * E(x_t) */
+    numeric_t *logW = (numeric_t *) malloc(nParticles * sizeof(numeric_t));
+    #pragma omp parallel for
+    for (int p = 0; p < nParticles; p++) {
+        uint64_t rng[RNG_STATE_WORDS];
+        for (int w = 0; w < RNG_STATE_WORDS; w++)
+            rng[w] = ali->aisStreams[p * RNG_STATE_WORDS + w];
+        letter_t *chain = (letter_t *) malloc(ali->nSites * sizeof(letter_t));
+        numeric_t *H = (numeric_t *)
+            malloc(ali->nSites * ali->nCodes * sizeof(numeric_t));
+        numeric_t P[SOFTMAX_MAX_STATES];
+
+        /* Exact draw from the starting distribution */
+        for (int i = 0; i < ali->nSites; i++) {
+            for (int a = 0; a < ali->nCodes; a++)
+                P[a] = wLambdaHi(scales, i) * xHi(i, a);
+            chain[i] = GibbsDraw(P, RNGUniform(rng), ali->nCodes);
+        }
+
+        /* The cached fields Hp(i, a) hold the field and the couplings to the
+           other sites, so the coupling energy is half the sum of the
+           coupling parts and moves by the coupling part at the site */
+        GibbsInitFields(H, chain, model, ali);
+        numeric_t E = 0;
+        for (int i = 0; i < ali->nSites; i++)
+            E += Hp(i, chain[i]) - wLambdaHi(scales, i) * xHi(i, chain[i]);
+        E *= 0.5;
+
+        numeric_t dBeta = 1.0 / ((numeric_t) nSteps);
+        numeric_t logWp = 0;
+        for (int t = 1; t <= nSteps; t++) {
+            numeric_t beta = t * dBeta;
+            logWp += dBeta * E;
+
+            /* Gibbs move at beta: fields plus beta times the couplings */
+            int i = RNGIndex(rng, ali->nSites);
+            for (int a = 0; a < ali->nCodes; a++)
+                P[a] = (1.0 - beta) * wLambdaHi(scales, i) * xHi(i, a)
+                     + beta * Hp(i, a);
+            int aOld = chain[i];
+            int aNew = GibbsDraw(P, RNGUniform(rng), ali->nCodes);
+            if (aNew != aOld) {
+                E += (Hp(i, aNew) - wLambdaHi(scales, i) * xHi(i, aNew))
+                   - (Hp(i, aOld) - wLambdaHi(scales, i) * xHi(i, aOld));
+                GibbsUpdateFields(H, i, aOld, aNew, model, ali);
+                chain[i] = aNew;
+            }
+        }
+        logW[p] = logWp;
+
+        for (int w = 0; w < RNG_STATE_WORDS; w++)
+            ali->aisStreams[p * RNG_STATE_WORDS + w] = rng[w];
+        free(chain);
+        free(H);
+    }
+
+    /* log Z = log Z0 + log mean(w), with the normalized weights giving the
+       effective sample size and, by the delta method, the variance of the
+       estimate: Var(log Z) ~ Var(w) / (N mean(w)^2) = (N / ESS - 1) / (N - 1) */
+    numeric_t maxLogW = logW[0];
+    for (int p = 1; p < nParticles; p++)
+        maxLogW = (maxLogW >= logW[p] ? maxLogW : logW[p]);
+    numeric_t sumW = 0;
+    numeric_t sumW2 = 0;
+    for (int p = 0; p < nParticles; p++) {
+        numeric_t w = exp(logW[p] - maxLogW);
+        sumW += w;
+        sumW2 += w * w;
+    }
+    *ess = sumW * sumW / sumW2;
+    *logZVar = nParticles > 1 ?
+        (nParticles / *ess - 1.0) / ((numeric_t) (nParticles - 1)) : 0;
+    free(logW);
+    return logZ0 + maxLogW + log(sumW / ((numeric_t) nParticles));
+}
+
+void GibbsMarginalGradient(numeric_t *g, const letter_t *sample,
+    int nSamples, alignment_t *ali) {
+    numeric_t nRatio = ali->nEff / ((numeric_t) nSamples);
+    int q = ali->nCodes;
+
+    /* Fields */
+    #pragma omp parallel for
+    for (int i = 0; i < ali->nSites; i++) {
+        for (int ai = 0; ai < q; ai++)
+            dHi(i, ai) = -ali->nEff * fi(i, ai);
+        for (int s = 0; s < nSamples; s++)
+            dHi(i, sample[(size_t) s * ali->nSites + i]) += nRatio;
+    }
+
+    /* Couplings. Each tile of site blocks I <= J owns a disjoint slice of g
+       and counts co-occurrences in a private table, which is then written
+       out once together with the data marginals */
+    int nBlocks = (ali->nSites + GIBBS_BLOCK - 1) / GIBBS_BLOCK;
+    int nTiles = nBlocks * (nBlocks + 1) / 2;
+    #pragma omp parallel
+    {
+        int *counts = (int *)
+            calloc(GIBBS_BLOCK * GIBBS_BLOCK * q * q, sizeof(int));
+        #pragma omp for schedule(dynamic, 1)
+        for (int t = 0; t < nTiles; t++) {
+            int J = 0;
+            while ((J + 1) * (J + 2) / 2 <= t) J++;
+            int I = t - J * (J + 1) / 2;
+            int iStart = I * GIBBS_BLOCK;
+            int jStart = J * GIBBS_BLOCK;
+            int jStop = jStart + GIBBS_BLOCK < ali->nSites ?
+                        jStart + GIBBS_BLOCK : ali->nSites;
+
+            /* counts[pair][aj][ai] for the pair of i and j in the tile */
+            for (int s = 0; s < nSamples; s++) {
+                const letter_t *seqS = &(sample[(size_t) s * ali->nSites]);
+                for (int j = jStart; j < jStop; j++) {
+                    int iStop = iStart + GIBBS_BLOCK < j ?
+                                iStart + GIBBS_BLOCK : j;
+                    int *countsJ = &(counts[((j - jStart) * GIBBS_BLOCK
+                                             * q + seqS[j]) * q]);
+                    for (int i = iStart; i < iStop; i++)
+                        countsJ[(i - iStart) * q * q + seqS[i]]++;
+                }
+            }
+
+            /* Gradient, with the counts reset for the next tile */
+            for (int j = jStart; j < jStop; j++) {
+                int iStop = iStart + GIBBS_BLOCK < j ?
+                            iStart + GIBBS_BLOCK : j;
+                for (int i = iStart; i < iStop; i++) {
+                    int *countsIJ = &(counts[((j - jStart) * GIBBS_BLOCK
+                                              + (i - iStart)) * q * q]);
+                    for (int aj = 0; aj < q; aj++)
+                        for (int ai = 0; ai < q; ai++) {
+                            dEij(i, j, ai, aj) = nRatio * countsIJ[aj * q + ai]
+                                - ali->nEff * fij(i, j, ai, aj);
+                            countsIJ[aj * q + ai] = 0;
+                        }
+                }
+            }
+        }
+        free(counts);
+    }
+}
@@ -3,6 +3,7 @@
 
 /* Defines numeric_t */
 #include "pvi.h"
+#include "checkpoint.h"
 
 /* Hamiltonian Monte Carlo */
 typedef numeric_t (*hmc_hfun_t) (void *data, const numeric_t *x, const int n);
@@ -12,18 +13,35 @@ numeric_t SampleHamiltonianMonteCarlo(hmc_hfun_t hfun, hmc_gradfun_t grad,
     void *data, numeric_t *X, int n, int s, int L, numeric_t *epsilon,
     int warmup);
 
-/* Gaussian stochastic variational inference */
+/* Gaussian stochastic variational inference. Without drawData, the k samples
+   for each gradient are evaluated one after another on data. With drawData,
+   sample i is evaluated on drawData[i], concurrently with the others and
+   with the threads split between the samples and the objective's own loops.
+   The gradients are then summed in sample order, so that results do not
+   depend on the number of threads. With floatMoments, the moment estimates of
+   Adam are stored in single precision, which halves their memory traffic.
+   reduce combines the variance reductions SVI_* below, with an even k for
+   SVI_ANTITHETIC, and the progress shows the variance of the gradient
+   estimate between its independent draws (for k > 1, pairs with
+   SVI_ANTITHETIC). With checkpoint (or NULL), the state is checkpointed every interval
+   iterations as method "svi", and restored first when resuming */
+#define SVI_ANTITHETIC  1       /* Draws in antithetic pairs Z, -Z */
+#define SVI_STL         2       /* Entropy by its path derivative at Z */
+#define SVI_CONTROL     4       /* Running linear control variates */
 typedef numeric_t (*neglogp_t) (void *data, const numeric_t *x,
 	numeric_t *g, const int n);
 numeric_t EstimateGaussianVariationalApproximation(neglogp_t neglogp,
-    void *data, numeric_t *mu, numeric_t *sigma, int n, int k, numeric_t eps,
-    int maxIter, numeric_t crit);
+    void *data, void **drawData, numeric_t *mu, numeric_t *sigma, int n,
+    int k, numeric_t eps, int maxIter, numeric_t crit, int floatMoments,
+    int reduce, checkpoint_t *checkpoint);
 
-/* MAP estimation by SGD (Adam) */
+/* MAP estimation by SGD (Adam), with floatMoments and checkpoint (as method
+   "map") as above */
 typedef void (*gradfun_t) (void *data, const numeric_t *x, numeric_t *g,
     const int n);
 void EstimateMaximumAPosteriori(gradfun_t gradlogp, void *data,
-    numeric_t *x, int n, numeric_t eps, int maxIter, numeric_t crit);
+    numeric_t *x, int n, numeric_t eps, int maxIter, numeric_t crit,
+    int floatMoments, checkpoint_t *checkpoint);
 
 /* Bayesian approaches to categorical distributions */
 void EstimateCategoricalDistribution(const numeric_t *C, numeric_t *P, int n);
@@ -35,6 +53,10 @@ void InitRNG(int seed);
 int RandomInt(int N);
 numeric_t RandomUniform();
 numeric_t RandomNormal();
+/* Batched standard normals z[i] for the draws counter + i of the stream key,
+   as RNGNormals in rng.h, with keys taken from the Mersenne Twister */
+uint64_t RandomKey();
+void RandomNormals(numeric_t *z, int n, uint64_t key, uint64_t counter);
 numeric_t RandomGamma(numeric_t alpha);
 
 numeric_t QuickSelect(numeric_t *A, int len, int k);
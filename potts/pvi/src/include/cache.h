@@ -0,0 +1,29 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/* Defines alignment_t, options_t */
+#include "pvi.h"
+
+/* Levels of alignment caching */
+enum {
+    /* No cache */
+    CACHE_NONE,
+    /* Encoded alignment, focus mapping, weights and sample size */
+    CACHE_ALIGNMENT,
+    /* All of the above plus the marginals fi, fij (and gapi, ungapij) */
+    CACHE_MARGINALS
+};
+
+/* Reloads a processed alignment from the binary cache next to alignFile.
+   The cache is memory-mapped copy-on-write, so downstream in-place edits
+   never reach the file. Returns NULL if the cache is missing or was built
+   from a different alignment, alphabet, theta, scale, focus or precision.
+   If the cache holds no marginals, ali->fi and ali->fij are left NULL.
+ */
+alignment_t *MSAReadCache(char *alignFile, options_t *options);
+
+/* Writes a processed alignment (after reweighting, marginal counting and
+   sample size estimation) to the binary cache next to alignFile */
+void MSAWriteCache(char *alignFile, alignment_t *ali, options_t *options);
+
+#endif /* CACHE_H */
@@ -0,0 +1,68 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <stdio.h>
+
+/* Checkpoints of the iterative optimizers (bayes.c and L-BFGS). Every
+   interval iterations an optimizer writes its complete state, then the
+   state of the Mersenne Twister and of its objective (such as persistent
+   Markov chains), to a temporary file that is renamed over the checkpoint,
+   so that the checkpoint on disk is always whole. With resume, the next run
+   reads it back and continues bit-for-bit as if it had never stopped.
+
+   A run may go through several optimizations (stages) in a fixed order, as
+   the site-independent and then pairwise SVI of pvi -v. The checkpoint
+   records the stage that wrote it, and on resume earlier stages are skipped
+   (see CheckpointSkip) */
+
+/* Writes (restore = 0) or reads back (restore = 1) the state of the
+   objective after that of the optimizer, reading with CheckpointRead */
+typedef void (*checkpoint_state_t) (void *data, FILE *fp, int restore);
+
+typedef struct {
+    char *file;
+    int interval;               /* Iterations between checkpoints */
+    int resume;                 /* Cleared once the state is restored */
+    int stage;                  /* Stage of the running optimization */
+    checkpoint_state_t state;   /* Optional */
+    void *data;
+} checkpoint_t;
+
+/* Returns checkpoints to file every interval iterations, resuming from it
+   first if resume is set, or NULL (no checkpointing) if file is NULL. The
+   functions below accept NULL and then do nothing */
+checkpoint_t *CheckpointCreate(char *file, int interval, int resume);
+void CheckpointFree(checkpoint_t *checkpoint);
+
+/* Enters the given stage and returns 1 if it is to be skipped, because the
+   run resumes from a checkpoint of a later stage */
+int CheckpointSkip(checkpoint_t *checkpoint, int stage);
+
+/* Whether the state after iteration t should be checkpointed */
+int CheckpointDue(const checkpoint_t *checkpoint, int t);
+
+/* Opens a checkpoint of the optimizer method (a short tag such as "svi")
+   with n parameters, in which the optimizer then writes its state with
+   fwrite. CheckpointCommit appends the states of the twister and of the
+   objective and moves the checkpoint into place. Write errors are reported
+   without stopping the run, which keeps the previous checkpoint */
+FILE *CheckpointBegin(const checkpoint_t *checkpoint, const char *method,
+    int n);
+void CheckpointCommit(FILE *fp, const checkpoint_t *checkpoint);
+
+/* When resuming, opens the checkpoint and checks that it was written by the
+   same method, stage and n, so that the optimizer can then read its state
+   with CheckpointRead; returns NULL otherwise. CheckpointRestoreEnd reads
+   the states of the twister and of the objective and ends the resume */
+FILE *CheckpointRestore(checkpoint_t *checkpoint, const char *method, int n);
+void CheckpointRestoreEnd(FILE *fp, checkpoint_t *checkpoint);
+
+/* fread that stops the program if the checkpoint is truncated */
+void CheckpointRead(void *buffer, size_t size, size_t count, FILE *fp);
+
+/* fwrite (restore = 0) or CheckpointRead (restore = 1), so that one function
+   can list the state in both directions */
+void CheckpointBlock(void *buffer, size_t size, size_t count, FILE *fp,
+    int restore);
+
+#endif /* CHECKPOINT_H */
@@ -0,0 +1,119 @@
+#ifndef GIBBS_H
+#define GIBBS_H
+
+/* Defines alignment_t, numeric_t, options_t */
+#include "pvi.h"
+
+/* Samplers for the persistent Markov chains */
+enum {
+    /* Conditional fields recomputed from the parameters at every update */
+    GIBBS_DIRECT,
+    /* Local fields of every site cached per chain and updated in O(L q)
+       only when a site changes state, so unchanged draws cost O(q). Not
+       available to the colored and Hogwild orders, which update concurrently
+       within a chain */
+    GIBBS_FIELDS
+};
+
+/* Site update orders. The colored and Hogwild orders parallelize within
+   each chain (chains then run one after another), the others across chains */
+enum {
+    /* Random sites with replacement, so that a sweep of nSites draws misses
+       about 1/e of the sites */
+    GIBBS_ORDER_RANDOM,
+    /* Every site once per sweep, in a fresh random permutation */
+    GIBBS_ORDER_PERMUTED,
+    /* Every site once per sweep, in site order */
+    GIBBS_ORDER_SYSTEMATIC,
+    /* Permuted sweeps in which the sites of greedily matched pairs, by
+       decreasing Frobenius norm of their coupling block above
+       options->gThreshold, are drawn jointly from their q x q conditional */
+    GIBBS_ORDER_BLOCKED,
+    /* Systematic sweeps over a greedy coloring of the coupling graph, with
+       the sites of each color updated concurrently from the states at the
+       start of the color. Pairs whose coupling block has a Frobenius norm
+       of at most options->gThreshold are left out of the graph, so the
+       sweep is exact for a threshold of zero. The coloring is recomputed
+       from the current couplings on every call */
+    GIBBS_ORDER_COLORED,
+    /* Random sites updated asynchronously by all threads (Hogwild), reading
+       whatever states the neighbors have. The bias grows with the number of
+       threads times the total influence alpha (max_i sum_j tanh max|e_ij|),
+       which is reported; alpha >= 1 draws a warning, checked periodically
+       until it is issued */
+    GIBBS_ORDER_HOGWILD
+};
+
+/* Storage of the scaled couplings exp(lambda_ij) e_ij used by the samplers */
+enum {
+    /* Scaled from the parameters block by block */
+    GIBBS_TENSOR_NONE,
+    /* Materialized once per gradient step, site-major so that conditionals
+       read the couplings of each state of each other site contiguously, in
+       L^2 q^2 numeric_t (twice the coupling parameters) */
+    GIBBS_TENSOR_NUMERIC,
+    /* As above in float, halving the memory and its bandwidth */
+    GIBBS_TENSOR_FLOAT
+};
+
+/* Model of one gradient step, shared read-only by all chains: the
+   parameters x with every block scaled by exp(lambda), and optionally the
+   scaled couplings materialized site-major as
+   W[((i * nSites + j) * nCodes + b) * nCodes + a] = exp(lambda_ij) e_ij(a, b)
+   in numeric_t (W) or float (Wf), so that the couplings of site i to the
+   state b of site j are contiguous over the states a of i */
+typedef struct {
+    const numeric_t *x;
+    numeric_t *scales;
+    numeric_t *W;
+    float *Wf;
+} gibbs_model_t;
+
+/* Builds the model of parameters x, each block scaled by exp(lambdas), with
+   the coupling tensor chosen by options->gTensor. x must outlive the model,
+   which is built once per gradient step and shared by the samplers below */
+gibbs_model_t *GibbsCreateModel(const numeric_t *x, const numeric_t *lambdas,
+    alignment_t *ali, options_t *options);
+void GibbsFreeModel(gibbs_model_t *model);
+
+/* Advances the persistent chains in ali->samples by options->gSweeps sweeps
+   of random-site Gibbs updates under model and stores the state of every chain after each
+   sweep in sample (gChains x gSweeps x nSites). Chain c draws only from
+   stream c of ali->sampleStreams, so samples do not depend on threading.
+
+   With options->gTemps > 1, each chain is a ladder of gTemps replicas at
+   inverse temperatures from 1 down to options->gBetaMin (geometric), stored
+   in ali->samples as gChains x gTemps x nSites with one stream per replica.
+   Neighboring rungs attempt a swap every options->gExchange sweeps and only
+   the beta = 1 replicas are stored in sample */
+void GibbsSampleChains(letter_t *sample, const gibbs_model_t *model,
+    alignment_t *ali, options_t *options);
+
+/* Reports the swap acceptance rate of every rung of the ladder accumulated
+   in ali->swapStats (attempts for each rung, then acceptances) */
+void GibbsReportExchange(alignment_t *ali, options_t *options);
+
+/* With options->gAutocorr > 1, runs copies of the beta = 1 chains for that
+   many sweeps in each of the random, permuted, systematic and blocked orders
+   and reports the time per sweep, the integrated autocorrelation time tau
+   of the chain energies (in sweeps) and the effective samples per second */
+void GibbsReportAutocorrelation(const numeric_t *x, const numeric_t *lambdas,
+    alignment_t *ali, options_t *options);
+
+/* Estimates log Z of model by annealed importance sampling from the site-independent
+   model of the fields. options->aisParticles independent particles of
+   options->aisSweeps sweeps of random-site Gibbs moves run in parallel,
+   particle p drawing only from stream p of ali->aisStreams. Sets ess to the
+   effective sample size of the particle weights and logZVar to the
+   (delta method) variance of the returned estimate */
+numeric_t GibbsLogPartition(numeric_t *ess, numeric_t *logZVar,
+    const gibbs_model_t *model, alignment_t *ali, options_t *options);
+
+/* Sets the field and coupling blocks of g to the gradient of the negative
+   log likelihood, nEff * (model marginals - data marginals), with the model
+   marginals counted over the nSamples sequences in sample (nSamples x nSites).
+   Pairs are counted as integers over tiles of sites, in parallel */
+void GibbsMarginalGradient(numeric_t *g, const letter_t *sample,
+    int nSamples, alignment_t *ali);
+
+#endif /* GIBBS_H */
@@ -417,6 +417,59 @@ typedef int (*lbfgs_progress_t)(
     int ls
     );
 
+/**
+ * The state of the optimization between two iterations.
+ *
+ *  Together with the parameters and the evaluation callback, this determines
+ *  every later iteration, so that an optimization can be checkpointed and
+ *  resumed. The arrays belong to lbfgs_checkpoint().
+ */
+typedef struct {
+    /** The number of variables. */
+    int n;
+    /** The number of corrections (lbfgs_parameter_t::m). */
+    int m;
+    /** The length of pf (lbfgs_parameter_t::past). */
+    int past;
+    /** The iteration count of the next iteration. */
+    int k;
+    /** The slot of the next correction pair. */
+    int end;
+    /** The value of the objective function at x. */
+    lbfgsfloatval_t fx;
+    /** The initial step of the next line search. */
+    lbfgsfloatval_t step;
+    /** The variables, gradient and search direction [n]. */
+    lbfgsfloatval_t *x;
+    lbfgsfloatval_t *g;
+    lbfgsfloatval_t *d;
+    /** The correction pairs [m][n] and their products y^t s [m]. */
+    lbfgsfloatval_t **s;
+    lbfgsfloatval_t **y;
+    lbfgsfloatval_t *ys;
+    /** The previous values of the objective function [past], or NULL. */
+    lbfgsfloatval_t *pf;
+} lbfgs_state_t;
+
+/**
+ * Callback interface to checkpoint and restore the optimization.
+ *
+ *  The lbfgs_checkpoint() function calls this function once with restore
+ *  set before the first evaluation, and then at the end of every iteration.
+ *
+ *  @param  instance    The user data sent for lbfgs() function by the client.
+ *  @param  state       The state of the optimization.
+ *  @param  restore     Non-zero to fill state (all of its arrays) in order to
+ *                      resume, zero to store it.
+ *  @retval int         On restore, non-zero if state was filled. Otherwise
+ *                      zero to continue the optimization process.
+ */
+typedef int (*lbfgs_checkpoint_t)(
+    void *instance,
+    lbfgs_state_t *state,
+    int restore
+    );
+
 /*
 A user must implement a function compatible with ::lbfgs_evaluate_t (evaluation
 callback) and pass the pointer to the callback function to lbfgs() arguments.
@@ -485,6 +538,25 @@ int lbfgs(
     lbfgs_parameter_t *param
     );
 
+/**
+ * Start or resume a L-BFGS optimization with checkpoints.
+ *
+ *  As lbfgs(), with a callback compatible with ::lbfgs_checkpoint_t that
+ *  can restore the state of a previous optimization and that receives the
+ *  state at the end of every iteration. A resumed optimization continues
+ *  exactly as the original one would have.
+ */
+int lbfgs_checkpoint(
+    int n,
+    lbfgsfloatval_t *x,
+    lbfgsfloatval_t *ptr_fx,
+    lbfgs_evaluate_t proc_evaluate,
+    lbfgs_progress_t proc_progress,
+    lbfgs_checkpoint_t proc_checkpoint,
+    void *instance,
+    lbfgs_parameter_t *param
+    );
+
 /**
  * Initialize L-BFGS parameters to the default values.
  *
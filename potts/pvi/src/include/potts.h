@@ -0,0 +1,48 @@
+#ifndef POTTS_H
+#define POTTS_H
+
+#include <stdint.h>
+
+/* Potts model of nSites sites with nCodes states each, with probability
+   P(x) ~ exp(-E(x)) under the energy (Hamiltonian)
+        E(x_1, ..., x_L) = -Sum_i h_i(x_i) - Sum_i<j e_ij(x_i, x_j)
+   The sampler is independent of pvi and its options so that it can be
+   linked on its own */
+typedef struct {
+    int nSites;
+    int nCodes;
+    /* Focus sequence and its numbering, as written by pvi */
+    char *target;
+    int *offsets;
+    /* Fields, h[i * nCodes + a] = h_i(a) */
+    double *h;
+    /* Couplings in both orientations, site-major so that the couplings of
+       every state of site i to state b of site j are contiguous,
+       e[((i * nSites + j) * nCodes + b) * nCodes + a] = e_ij(a, b),
+       with zero blocks on the diagonal */
+    double *e;
+} potts_model_t;
+
+/* Reads a model from a parameter file written by pvi -o (the full,
+   non-Bayesian format of OutputParametersFull) */
+potts_model_t *PottsRead(const char *paramFile);
+
+void PottsFree(potts_model_t *model);
+
+/* Energy E(x) of the states x (nSites) */
+double PottsEnergy(const potts_model_t *model, const uint8_t *x);
+
+/* Runs nChains independent chains of random-site heat-bath updates from
+   uniformly random states. Each chain discards burnin sweeps (of nSites
+   updates) and then stores its state and energy every thin sweeps, nSamples
+   times, in samples (nChains x nSamples x nSites) and energies (nChains x
+   nSamples). Chains run in parallel and chain c draws only from stream c of
+   RNGSeedStreams(seed), so results do not depend on the number of threads.
+   Every chain caches the conditional log-potentials of all of its sites,
+   which are updated in O(L q) only when a site changes state, so that the
+   energy difference of a move is read off in O(1) */
+void PottsSample(uint8_t *samples, double *energies,
+    const potts_model_t *model, int nChains, int nSamples, int burnin,
+    int thin, uint64_t seed);
+
+#endif /* POTTS_H */
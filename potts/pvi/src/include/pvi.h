@@ -1,6 +1,8 @@
 #ifndef PVI_H
 #define PVI_H
 
+#include <stdint.h>
+
 #include "lbfgs.h"
 
 #ifdef USE_FLOAT
@@ -8,7 +10,10 @@ typedef float numeric_t;
 #else
 typedef double numeric_t;
 #endif
-typedef int letter_t;
+/* Encoded letters, on [-nCodes, nCodes] while reading (see MSAReadCode) and
+   on [-1, nCodes - 1] in gap-reduced inference, so they must stay signed */
+typedef int8_t letter_t;
+#define LETTER_MAX_CODES 127
 
 /** 
  * Modes of inference
@@ -67,6 +72,8 @@ typedef struct {
     /* Alignment processing */
     char *target;
     char *alphabet;
+    int cache;               /* Binary alignment cache level (cache.h) */
+    int reweight;            /* Neighborhood counting method (reweight.h) */
 
     /* Method for inference */
     int usePairs;
@@ -78,7 +85,23 @@ typedef struct {
     int maxIter;
     int gChains;
     int gSweeps;
+    int gibbs;               /* Sampler for persistent chains (gibbs.h) */
+    int gOrder;              /* Site update order for Gibbs sampling */
+    numeric_t gThreshold;    /* Coupling norm linking colored/blocked sites */
+    int gTemps;              /* Replicas per chain for replica exchange */
+    numeric_t gBetaMin;      /* Lowest inverse temperature of the ladder */
+    int gExchange;           /* Sweeps between replica exchanges */
+    int gTensor;             /* Storage of the scaled couplings (gibbs.h) */
+    int gAutocorr;           /* Sweeps per scan order for autocorrelation */
+    int aisParticles;        /* Annealed importance sampling particles */
+    int aisSweeps;           /* Annealing sweeps per particle */
     int vSamples;            /* Number of samples for KL stochastic gradients */
+    int vParallel;           /* Evaluate the vSamples samples concurrently */
+    int vReduce;             /* Gradient variance reduction (bayes.h) */
+    int adamFloat;           /* Single precision Adam moments (SVI, MAP) */
+    char *checkpointFile;    /* Periodic checkpoints (checkpoint.h) */
+    int checkpointInterval;  /* Iterations between checkpoints */
+    int resume;              /* Resume from checkpointFile */
 
     /* Regularization */
     numeric_t theta;
@@ -112,6 +135,12 @@ typedef struct {
     int target;
     int *offsets;
 
+    /* Identical sequences share a row: names[s] for s < nSeqsAll is the
+       sequence in row uniqueMap[s]. Only the focus remapping uses this, as
+       no output names sequences; the cache keeps it for outputs that will */
+    int nSeqsAll;
+    int *uniqueMap;
+
     /* Sequence weights and statistics */
     numeric_t nEff;
     numeric_t *weights;
@@ -125,8 +154,17 @@ typedef struct {
     numeric_t negLogLk;
     struct timeval start;
     letter_t *samples;
+    uint64_t *sampleStreams;    /* Random streams of the chains (rng.h) */
+    int *swapStats;             /* Replica exchange counts (gibbs.h) */
+    uint64_t *aisStreams;       /* Random streams of the AIS particles */
+    numeric_t *aisStats;        /* Evaluations, summed ESS and Var(log Z) */
 } alignment_t;
 
+/* Default protein alphabet. Gap mapping of '.' and protein-specific
+   filtering apply only when the alphabet is this built-in one (by pointer,
+   not by content) */
+extern const char *codesAA;
+
 /* Loads a multiple sequence alignment and encodes it into a specified alphabet.
    Any sequences containing characters outside of the alphabet are discarded.
    By default, these routines are case-insenstive but columns containing
@@ -136,7 +174,11 @@ typedef struct {
 alignment_t *MSARead(char *alignFile, options_t *options);
 
 /* Reweights sequences by their inverse neighborhood size */
-void MSAReweightSequences(alignment_t *ali, numeric_t theta, numeric_t scale);
+void MSAReweightSequences(alignment_t *ali, numeric_t theta, numeric_t scale,
+    int method);
+
+/* Merges identical sequences into unique rows carrying their summed weight */
+void MSACollapseDuplicates(alignment_t *ali);
 
 /* Counts empirical sitewise(fi) and pairwise(fij) marginals of the alignment */
 void MSACountMarginals(alignment_t *ali, options_t *options);
@@ -159,13 +201,6 @@ void OutputCouplingScores(char *couplingsFile, const numeric_t *x,
     alignment_t *ali, options_t *options);
 
 
-/* File I/O */
-#define BUFFER_SIZE 4096
-#define fgetstr(str, fp)   {char *endPos;                              \
-                            fgets(str, BUFFER_SIZE, fp);               \
-                            if ((endPos = strchr(str, '\n')) != NULL)  \
-                            *endPos = '\0';}
-
 /* Memory schemes for model parameters and gradients */
 #define xHi(i, Ai)             x[i + ali->nSites * (Ai)]
 #define xEij(i, j, Ai, Aj)     x[ali->nSites * ali->nCodes + (i < j ? (((j) * (j - 1)/2 + i) * ali->nCodes * ali->nCodes + (Aj) * ali->nCodes + Ai) : (((i)*(i - 1)/2 + j) * ali->nCodes * ali->nCodes + (Ai) * ali->nCodes + Aj))]
@@ -0,0 +1,33 @@
+#ifndef REWEIGHT_H
+#define REWEIGHT_H
+
+/* Defines alignment_t, numeric_t */
+#include "pvi.h"
+
+/* Methods for counting sequence neighborhoods */
+enum {
+    /* All pairs, exact */
+    REWEIGHT_EXACT,
+    /* Candidate pairs from locality-sensitive hashing, verified exactly */
+    REWEIGHT_LSH
+};
+
+/* Adds to counts[s] the number of other sequences t in the alignment with at
+   least (1 - theta) * nSites identical sites to s. Sequences are packed into
+   bytes and compared over cache-sized tiles of the upper triangle of the
+   N x N identity matrix, with AVX2 or SSE4.2 kernels chosen at runtime.
+   Comparisons stop as soon as a pair can no longer reach the threshold.
+ */
+void MSACountNeighbors(const alignment_t *ali, numeric_t theta,
+    numeric_t *counts);
+
+/* Approximates MSACountNeighbors in sub-quadratic time for deep alignments.
+   Only pairs that agree on every site of at least one random band of sites
+   are compared, so counts can only be underestimated. The neighbor recall
+   and the resulting weight and sample size errors are estimated against
+   exact counts for a subsample of sequences and reported.
+ */
+void MSACountNeighborsApprox(const alignment_t *ali, numeric_t theta,
+    numeric_t *counts);
+
+#endif /* REWEIGHT_H */
@@ -0,0 +1,70 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Independent random streams for parallel samplers, by xoshiro256**
+   (Blackman & Vigna). Each stream has RNG_STATE_WORDS words of state and
+   consecutive streams from RNGSeedStreams start 2^128 draws apart, so that
+   stream k can be advanced by whichever thread owns it and results do not
+   depend on the number of threads */
+#define RNG_STATE_WORDS 4
+
+/* Seeds nStreams consecutive streams in states (nStreams * RNG_STATE_WORDS)
+   from a single seed */
+void RNGSeedStreams(uint64_t *states, int nStreams, uint64_t seed);
+
+static inline uint64_t RNGRotate(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/* Next 64 random bits of the stream with state s */
+static inline uint64_t RNGNext(uint64_t *s) {
+    uint64_t result = RNGRotate(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = RNGRotate(s[3], 45);
+    return result;
+}
+
+/* Random bits number counter under key, by the splitmix64 finalizer. Such
+   counter-based draws can be made by any thread in any order, as when the
+   sites of one chain are updated in parallel */
+static inline uint64_t RNGHash(uint64_t key, uint64_t counter) {
+    uint64_t z = key + (counter + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Random bits to uniform on the open interval (0, 1), as genrand_real3 */
+static inline double RNGUniformBits(uint64_t bits) {
+    return ((double) (bits >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+/* Random bits to uniform on [0, n) for 0 < n < 2^32 */
+static inline int RNGIndexBits(uint64_t bits, int n) {
+    return (int) (((bits >> 32) * (uint64_t) n) >> 32);
+}
+
+/* Fills z (n) with standard normals by the ziggurat method (Marsaglia & Tsang
+   2000) on counter-based draws, where z[i] depends only on key and on
+   counter + i. The vector is filled in parallel chunks, with the same
+   values for any number of threads, and consecutive fills that advance the
+   counter by n continue a single sequence */
+void RNGNormals(double *z, int n, uint64_t key, uint64_t counter);
+void RNGNormalsFloat(float *z, int n, uint64_t key, uint64_t counter);
+
+static inline double RNGUniform(uint64_t *s) {
+    return RNGUniformBits(RNGNext(s));
+}
+
+static inline int RNGIndex(uint64_t *s, int n) {
+    return RNGIndexBits(RNGNext(s), n);
+}
+
+#endif /* RNG_H */
@@ -0,0 +1,23 @@
+#ifndef SOFTMAX_H
+#define SOFTMAX_H
+
+/* Defines numeric_t */
+#include "pvi.h"
+
+/* Bound on the states of any alphabet, for local state vectors */
+#define SOFTMAX_MAX_STATES (LETTER_MAX_CODES + 1)
+
+/* Picks the widest exponential kernel (AVX-512, AVX2 or SSE4.2) supported
+   by the CPU and returns its name. Until this is called, the functions
+   below use libm */
+const char *SelectSoftmaxKernel(void);
+
+/* Sets P[a] = exp(H[a] - max(H)) for a on [0, n) and returns the sum of P.
+   H and P may be the same array */
+numeric_t ExpShifted(const numeric_t *H, numeric_t *P, int n);
+
+/* Sets P to the normalized softmax of H and returns log sum_a exp(H[a]).
+   H and P may be the same array */
+numeric_t Softmax(const numeric_t *H, numeric_t *P, int n);
+
+#endif /* SOFTMAX_H */
@@ -46,6 +46,12 @@
 /* initializes mt[N] with a seed */
 void init_genrand(unsigned long s);
 
+/* copies the state to or from state[GENRAND_STATE_WORDS], */
+/* mt[N] followed by mti, to checkpoint the generator */
+#define GENRAND_STATE_WORDS 625
+void get_genrand_state(unsigned long state[]);
+void set_genrand_state(const unsigned long state[]);
+
 /* initialize by an array with array-length */
 /* init_key is the array for initializing keys */
 /* key_length is its length */
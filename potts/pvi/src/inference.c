@@ -18,6 +18,10 @@
 
 #include "include/pvi.h"
 #include "include/inference.h"
+#include "include/softmax.h"
+#include "include/gibbs.h"
+#include "include/rng.h"
+#include "include/checkpoint.h"
 
 #define PI 3.14159265358979323846
 
@@ -26,6 +30,33 @@
 #define LAMBDA_J_MAX 1E4
 #define REGULARIZATION_GROUP_EPS 1E-6
 
+/* Workspace buffers start on cache line boundaries */
+#define WORKSPACE_ALIGN 64
+
+/* Scratch memory for the pseudolikelihood objectives, created once by
+   EstimatePairModelPLM so that evaluations do not allocate. Only the buffers
+   of the selected objective are laid out in the arena */
+typedef struct {
+    int nThreads;
+    void *arena;
+    /* Per thread: potentials, conditional probabilities (serial objectives
+       only) and the local parameter and gradient blocks of a site
+       (nSites * nCodes^2) */
+    numeric_t **H;
+    numeric_t **P;
+    numeric_t **Xi;
+    numeric_t **Di;
+    /* Second halves of the coupling gradient (see AddSiteGradient) */
+    numeric_t *gHalf;
+    /* Block objective: dense fields and couplings with their gradients */
+    numeric_t *hi;
+    numeric_t *gHi;
+    numeric_t *eij;
+    numeric_t *gEij;
+    /* Dropout objective: random mask over parameters */
+    int *dropMask;
+} plm_workspace_t;
+
 /* Internal to InferPairModel: 
    Bayesian estimation of hyperparameters for sites by MCMC (HMC) */
 void EstimateSiteLambdasBayes(numeric_t *lambdas, alignment_t *ali,
@@ -41,6 +72,13 @@ void HMCSiteHGradNonCenter(void *data, const numeric_t *x, numeric_t *g,
    Bayesian estimation of parameters by a gaussian variational approximation */
 void EstimatePairModelVBayes(numeric_t *x, numeric_t *lambdas, alignment_t *ali, 
     options_t *options);
+/* Internal to EstimatePairModelVBayes: concurrent samples */
+void **VBayesAllocDrawData(alignment_t *ali, options_t *options);
+void GibbsCheckpointState(void *data, FILE *fp, int restore);
+void GibbsCheckpointChains(alignment_t *ali, options_t *options, FILE *fp,
+    int restore);
+void VBayesFreeDrawData(void **drawData, alignment_t *ali,
+    options_t *options);
 /* Internal to EstimatePairModelBayes: Hierarchical model */
 numeric_t VBayesPairHierarchicalNonCentGibbs(void *data, const numeric_t *xB,
     numeric_t *gB, const int n);
@@ -86,6 +124,10 @@ static lbfgsfloatval_t PLMNegLogPosteriorBlock(void *instance,
 static lbfgsfloatval_t PLMNegLogPosteriorDO(void *instance,
     const lbfgsfloatval_t *x, lbfgsfloatval_t *g, const int n,
     const lbfgsfloatval_t step);
+/* Internal to EstimatePairModelPLM: checkpoints */
+static int CheckpointlBFGS(void *instance, lbfgs_state_t *state,
+    int restore);
+void PLMCheckpointState(void *data, FILE *fp, int restore);
 /* Internal to EstimatePairModelPLM: progress reporting */
 static int ReportProgresslBFGS(void *instance, const lbfgsfloatval_t *x,
     const lbfgsfloatval_t *g, const lbfgsfloatval_t fx,
@@ -102,6 +144,22 @@ numeric_t AddPriorsNoncentered(const numeric_t *x, numeric_t *g,
     numeric_t fx, alignment_t *ali, options_t *options);
 void ZeroAPCPriors(alignment_t *ali, options_t *options, numeric_t *lambdas,
     lbfgsfloatval_t *x);
+/* Internal to PLMNegLogPosterior(GapReduce): site objectives */
+static numeric_t PLMSiteNegLogLk(int i, const numeric_t *x,
+    const numeric_t *lambdas, alignment_t *ali, options_t *options,
+    numeric_t *restrict H, numeric_t *restrict Xi, numeric_t *restrict Di);
+static numeric_t PLMSiteNegLogLkGapReduce(int i, const numeric_t *x,
+    const numeric_t *lambdas, alignment_t *ali, options_t *options,
+    numeric_t *restrict H, numeric_t *restrict Xi, numeric_t *restrict Di);
+/* Internal to EstimatePairModelPLM: reusable objective workspace */
+plm_workspace_t *CreatePLMWorkspace(alignment_t *ali, options_t *options);
+void FreePLMWorkspace(plm_workspace_t *workspace);
+/* Internal to pseudolikelihood objectives: lock-free gradient reduction */
+numeric_t *AllocSiteGradientHalves(alignment_t *ali);
+void AddSiteGradient(int i, const numeric_t *Di, numeric_t *g,
+    numeric_t *gHalf, alignment_t *ali);
+void MergeSiteGradients(numeric_t *g, const numeric_t *gHalf,
+    alignment_t *ali);
 /* Internal to EstimatePairModelPLM: utility functions to L-BFGS */
 const char *LBFGSErrorString(int ret);
 
@@ -110,6 +168,10 @@ numeric_t *InferPairModel(alignment_t *ali, options_t *options) {
     /* Estimate the parameters of a maximum entropy model for a
        multiple sequence alignment */
 
+    /* Conditional distributions use the widest supported exp kernel */
+    fprintf(stderr, "Conditional distributions with %s exp kernel\n",
+        SelectSoftmaxKernel());
+
     /* Initialize the regularization parameters */
     numeric_t *lambdas =
     (numeric_t *) malloc((ali->nSites + ali->nSites * (ali->nSites - 1) / 2)
@@ -241,13 +303,40 @@ void EstimatePairModelVBayes(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
     numeric_t eps = 0.01;           /* Learning rate for SVI (Adam) */
     numeric_t crit = 1E-3;          /* Stopping criterion for ||g||/||x|| */
 
-    /* Initialize Gibbs sampling with a random unconstrained sequences */
+    /* Initialize Gibbs sampling with a random unconstrained sequences, one
+       for every tempered replica of every chain */
+    int nReplicas = options->gChains * options->gTemps;
     init_genrand(42);
     ali->samples = (letter_t *)
-        malloc(ali->nSites * options->gChains * sizeof(letter_t));
-    for (int i = 0; i < ali->nSites * options->gChains; i++)
+        malloc(ali->nSites * nReplicas * sizeof(letter_t));
+    for (int i = 0; i < ali->nSites * nReplicas; i++)
         ali->samples[i] = (genrand_int31() % ali->nCodes);
 
+    /* Each replica draws from its own random stream */
+    ali->sampleStreams = (uint64_t *)
+        malloc(nReplicas * RNG_STATE_WORDS * sizeof(uint64_t));
+    RNGSeedStreams(ali->sampleStreams, nReplicas, 42);
+
+    /* Annealed importance sampling particles for log Z draw from their own
+       streams, and their statistics are averaged over evaluations */
+    ali->aisStreams = (uint64_t *)
+        malloc(options->aisParticles * RNG_STATE_WORDS * sizeof(uint64_t));
+    RNGSeedStreams(ali->aisStreams, options->aisParticles, 43);
+    ali->aisStats = (numeric_t *) calloc(3, sizeof(numeric_t));
+
+    /* With -vp, every sample of the KL gradients is evaluated concurrently
+       on its own persistent chains */
+    void **drawData = VBayesAllocDrawData(ali, options);
+
+    /* Checkpoints carry the chains of every sample along with Q */
+    void *chains[3] = {(void *)ali, (void *)options, (void *)drawData};
+    checkpoint_t *checkpoint = CheckpointCreate(options->checkpointFile,
+        options->checkpointInterval, options->resume);
+    if (checkpoint != NULL) {
+        checkpoint->state = GibbsCheckpointState;
+        checkpoint->data = (void *)chains;
+    }
+
     /* Initialize with a site-independent model */
     int nInd = 1 + ali->nSites + ali->nSites * ali->nCodes;    
     numeric_t *muInd = (numeric_t *) malloc(nInd * sizeof(numeric_t));
@@ -257,11 +346,13 @@ void EstimatePairModelVBayes(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
     for (int i = 0; i < nInd; i++) muInd[i] = 0;
     for (int i = 0; i < nInd; i++) sigmaInd[i] = 0.1;
 
-    /* Stochastically optimize KL(Q||P(params|data)) for Gaussian Q */
-    numeric_t ELBOInd =
+    /* Stochastically optimize KL(Q||P(params|data)) for Gaussian Q,
+       unless resuming from a checkpoint of the pairwise model */
+    if (!CheckpointSkip(checkpoint, 0))
         EstimateGaussianVariationalApproximation(VBayesSiteHierarchicalNonCent,
-        data, muInd, sigmaInd, nInd, options->vSamples, eps, options->maxIter,
-        crit);
+            data, drawData, muInd, sigmaInd, nInd, options->vSamples, eps,
+            options->maxIter, crit, options->adamFloat, options->vReduce,
+            checkpoint);
 
     /* Infer a full pairwise model */
     numeric_t *mu = (numeric_t *) malloc(n * sizeof(numeric_t));
@@ -287,9 +378,21 @@ void EstimatePairModelVBayes(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
         sigma[shift + i] = sigmaInd[1 + ali->nSites + i];
 
     /* Stochastically optimize KL(Q||P(params|data)) for Gaussian Q */
-    numeric_t ELBO =
-        EstimateGaussianVariationalApproximation(VBayesPairHierarchicalNonCentGibbs,
-        data, mu, sigma, n, options->vSamples, eps, options->maxIter, crit);
+    CheckpointSkip(checkpoint, 1);
+    EstimateGaussianVariationalApproximation(VBayesPairHierarchicalNonCentGibbs,
+        data, drawData, mu, sigma, n, options->vSamples, eps,
+        options->maxIter, crit, options->adamFloat, options->vReduce,
+        checkpoint);
+    CheckpointFree(checkpoint);
+    VBayesFreeDrawData(drawData, ali, options);
+    GibbsReportExchange(ali, options);
+    GibbsReportAutocorrelation(&(mu[2 + ali->nSites
+        + ali->nSites * (ali->nSites - 1) / 2]), &(mu[2]), ali, options);
+    if (ali->aisStats[0] > 0)
+        fprintf(stderr, "Annealed importance sampling of log Z: mean ESS %.1f "
+            "of %d particles, mean sd %.3f\n",
+            ali->aisStats[1] / ali->aisStats[0], options->aisParticles,
+            sqrt(ali->aisStats[2] / ali->aisStats[0]));
 
     /* Copy means and variances into full parameter block */
     for (int i = 0; i < n; i++) x[i] = mu[i];
@@ -309,6 +412,121 @@ void EstimatePairModelVBayes(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
     /* --------------------------------^DEBUG^--------------------------------*/
 }
 
+void **VBayesAllocDrawData(alignment_t *ali, options_t *options) {
+    /* Each of the vSamples samples gets a copy of the alignment with its own
+       persistent chains, started from those of ali, and its own streams.
+       Sample 0 draws from the same streams as the serial estimator */
+    if (!options->vParallel || options->vSamples < 2) return NULL;
+    int k = options->vSamples;
+    int nReplicas = options->gChains * options->gTemps;
+    int nParticles = options->aisParticles;
+
+    alignment_t *alis = (alignment_t *) malloc(k * sizeof(alignment_t));
+    uint64_t *sampleStreams = (uint64_t *)
+        malloc(k * nReplicas * RNG_STATE_WORDS * sizeof(uint64_t));
+    uint64_t *aisStreams = (uint64_t *)
+        malloc(k * nParticles * RNG_STATE_WORDS * sizeof(uint64_t));
+    RNGSeedStreams(sampleStreams, k * nReplicas, 42);
+    RNGSeedStreams(aisStreams, k * nParticles, 43);
+
+    void **blocks = (void **) malloc(2 * k * sizeof(void *));
+    void **drawData = (void **) malloc(k * sizeof(void *));
+    for (int i = 0; i < k; i++) {
+        alis[i] = *ali;
+        alis[i].samples = (letter_t *)
+            malloc(ali->nSites * nReplicas * sizeof(letter_t));
+        for (int j = 0; j < ali->nSites * nReplicas; j++)
+            alis[i].samples[j] = ali->samples[j];
+        alis[i].sampleStreams =
+            &(sampleStreams[i * nReplicas * RNG_STATE_WORDS]);
+        alis[i].aisStreams = &(aisStreams[i * nParticles * RNG_STATE_WORDS]);
+        alis[i].aisStats = (numeric_t *) calloc(3, sizeof(numeric_t));
+        alis[i].swapStats = NULL;
+        blocks[2 * i] = (void *) &(alis[i]);
+        blocks[2 * i + 1] = (void *) options;
+        drawData[i] = (void *) &(blocks[2 * i]);
+    }
+    fprintf(stderr, "Evaluating %d samples per gradient concurrently\n", k);
+    return drawData;
+}
+
+void GibbsCheckpointState(void *data, FILE *fp, int restore) {
+    /* Checkpoints the persistent chains of ali and, with -vp, those of every
+       sample of the gradient (data holds ali, options and drawData) */
+    void **d = (void **)data;
+    alignment_t *ali = (alignment_t *) d[0];
+    options_t *options = (options_t *) d[1];
+    void **drawData = (void **) d[2];
+    GibbsCheckpointChains(ali, options, fp, restore);
+    if (drawData != NULL) {
+        alignment_t *alis = (alignment_t *) ((void **) drawData[0])[0];
+        for (int i = 0; i < options->vSamples; i++)
+            GibbsCheckpointChains(&(alis[i]), options, fp, restore);
+    }
+}
+
+void GibbsCheckpointChains(alignment_t *ali, options_t *options, FILE *fp,
+    int restore) {
+    /* Samples and random streams of the chains and of the AIS particles,
+       with the exchange and AIS statistics that are reported at the end */
+    int nReplicas = options->gChains * options->gTemps;
+    int nRungs = options->gTemps - 1;
+    CheckpointBlock(ali->samples, sizeof(letter_t), ali->nSites * nReplicas,
+        fp, restore);
+    CheckpointBlock(ali->sampleStreams, sizeof(uint64_t),
+        nReplicas * RNG_STATE_WORDS, fp, restore);
+    if (ali->aisStreams != NULL) {
+        CheckpointBlock(ali->aisStreams, sizeof(uint64_t),
+            options->aisParticles * RNG_STATE_WORDS, fp, restore);
+        CheckpointBlock(ali->aisStats, sizeof(numeric_t), 3, fp, restore);
+    }
+
+    /* Exchange statistics are allocated by the first exchange */
+    int hasSwaps = (ali->swapStats != NULL);
+    CheckpointBlock(&hasSwaps, sizeof(int), 1, fp, restore);
+    if (hasSwaps) {
+        if (ali->swapStats == NULL)
+            ali->swapStats = (int *) calloc(2 * nRungs, sizeof(int));
+        CheckpointBlock(ali->swapStats, sizeof(int), 2 * nRungs, fp, restore);
+    }
+}
+
+void VBayesFreeDrawData(void **drawData, alignment_t *ali,
+    options_t *options) {
+    /* Merges the statistics of the samples into ali and hands the chains of
+       sample 0 back to it */
+    if (drawData == NULL) return;
+    int k = options->vSamples;
+    int nReplicas = options->gChains * options->gTemps;
+    int nRungs = options->gTemps - 1;
+    alignment_t *alis = (alignment_t *) ((void **) drawData[0])[0];
+
+    for (int i = 0; i < k; i++) {
+        for (int j = 0; j < 3; j++) ali->aisStats[j] += alis[i].aisStats[j];
+        if (alis[i].swapStats != NULL) {
+            if (ali->swapStats == NULL)
+                ali->swapStats = (int *) calloc(2 * nRungs, sizeof(int));
+            for (int j = 0; j < 2 * nRungs; j++)
+                ali->swapStats[j] += alis[i].swapStats[j];
+        }
+    }
+    for (int j = 0; j < ali->nSites * nReplicas; j++)
+        ali->samples[j] = alis[0].samples[j];
+    for (int j = 0; j < nReplicas * RNG_STATE_WORDS; j++)
+        ali->sampleStreams[j] = alis[0].sampleStreams[j];
+
+    for (int i = 0; i < k; i++) {
+        free(alis[i].samples);
+        free(alis[i].aisStats);
+        free(alis[i].swapStats);
+    }
+    free(alis[0].sampleStreams);
+    free(alis[0].aisStreams);
+    free(alis);
+    free(drawData[0]);
+    free(drawData);
+}
+
 numeric_t VBayesPairHierarchicalNonCentGibbs(void *data, const numeric_t *xB, 
     numeric_t *gB, const int n) {
     /* Computes the gradient of the (unnormalized) negative log posterior of 
@@ -336,97 +554,19 @@ numeric_t VBayesPairHierarchicalNonCentGibbs(void *data, const numeric_t *xB,
     const numeric_t *x = &(xB[offset]);
     numeric_t *g = &(gB[offset]);
 
-    /* Gradient: sitewise marginals of the data */
-    for (int i = 0; i < ali->nSites; i++)
-        for (int ai = 0; ai < ali->nCodes; ai++)
-            dHi(i, ai) = -ali->nEff * fi(i, ai);
-
-    /* Gradient: pairwise marginals of the data */
-    for (int i = 0; i < ali->nSites-1; i++)
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int ai = 0; ai < ali->nCodes; ai++)
-                for (int aj = 0; aj < ali->nCodes; aj++)
-                    dEij(i, j, ai, aj) = -ali->nEff * fij(i, j, ai, aj);
-
-    /* Gradient: marginals of the model by parallel Gibbs samplers */
+    /* Sample the model by parallel Gibbs samplers, sharing the scaled model
+       with the estimate of log Z below */
+    gibbs_model_t *model = GibbsCreateModel(x, lambdas, ali, options);
     int gSweeps = options->gSweeps;
     int gChains = options->gChains;
     letter_t *sample = (letter_t *) malloc(gChains * gSweeps * ali->nSites
         * sizeof(letter_t));
+    GibbsSampleChains(sample, model, ali, options);
 
-    /* Presample from the pseudo-random number generator for thread safety */
-    int nSteps = gChains * gSweeps * ali->nSites;
-    int *siteI = (int *) malloc(nSteps * sizeof(int));
-    double *codeU = (double *) malloc(nSteps * sizeof(double));
-    for (int i = 0; i < nSteps; i++) siteI[i] = genrand_int31() % ali->nSites;
-    for (int i = 0; i < nSteps; i++) codeU[i] = genrand_real3();
-
-    /* Parallelize across the chains */
-    #pragma omp parallel for
-    for (int c = 0; c < gChains; c++) {
-        /* Samples gSweeps sequences in each chain */
-        numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-        for (int s = 0; s < gSweeps; s++) {
-            /* Sweep nSites positions */
-            for (int sx = 0; sx < ali->nSites; sx++) {
-                /* Pick a random site */
-                int i = siteI[c * gSweeps * ali->nSites + s * ali->nSites + sx];
-
-                /* Compute conditional CDF at the site */
-                for (int a = 0; a < ali->nCodes; a++)
-                    P[a] = exp(lambdaHi(i)) * xHi(i, a);
-                for (int j = 0; j < i; j++)
-                    for (int a = 0; a < ali->nCodes; a++)
-                        P[a] += exp(lambdaEij(i, j))
-                             * xEij(i, j, a, ali->samples[c * ali->nSites + j]);
-                for (int j = i + 1; j < ali->nSites; j++)
-                    for (int a = 0; a < ali->nCodes; a++)
-                        P[a] += exp(lambdaEij(i, j))
-                             * xEij(i, j, a, ali->samples[c * ali->nSites + j]);
-                numeric_t scale = P[0];
-                for (int a = 1; a < ali->nCodes; a++)
-                    scale = (scale >= P[a] ? scale : P[a]);
-                for (int a = 0; a < ali->nCodes; a++) P[a] = exp(P[a] - scale);
-                for (int a = 1; a < ali->nCodes; a++) P[a] += P[a - 1];
-
-                /* Choose a new code for the site */
-                double u = P[ali->nCodes - 1] *
-                    codeU[c * gSweeps * ali->nSites + s * ali->nSites + sx];
-                int aNew = 0;
-                while (u > P[aNew]) aNew++;
-                ali->samples[c * ali->nSites + i] = aNew;
-            }
-
-            /* Copy sequence into the global sample */
-            for (int i = 0; i < ali->nSites; i++)
-                sample[c * gSweeps * ali->nSites + s * ali->nSites + i] =
-                    ali->samples[c * ali->nSites + i];
-        }
-        free(P);
-    }
-
-    /* Contribute to global gradient for centered parameters */
-    numeric_t nRatio =
-        ((numeric_t) ali->nEff) / ((numeric_t) (gChains * gSweeps));
-    #pragma omp parallel for
-    for (int i = 0; i < ali->nSites; i++)
-        for (int c = 0; c < gChains; c++)
-            for (int s = 0; s < gSweeps; s++)
-                dHi(i, sample[c * gSweeps * ali->nSites + s * ali->nSites + i])
-                     += nRatio;
-    #pragma omp parallel for
-    for (int i = 0; i < ali->nSites - 1; i++)
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int c = 0; c < gChains; c++)
-                for (int s = 0; s < gSweeps; s++)
-                    dEij(i, j, 
-                        sample[c * gSweeps * ali->nSites + s * ali->nSites + i],
-                        sample[c * gSweeps * ali->nSites + s * ali->nSites + j])
-                        += nRatio;
+    /* Gradient: marginals of the model minus marginals of the data */
+    GibbsMarginalGradient(g, sample, gChains * gSweeps, ali);
 
     free(sample);
-    free(siteI);
-    free(codeU);
 
     /* Transform gradients for non-centered parameterization */
     for (int i = 0; i < ali->nSites; i++)
@@ -449,80 +589,13 @@ numeric_t VBayesPairHierarchicalNonCentGibbs(void *data, const numeric_t *xB,
 
 
     /* Estimate the log partition function by Annealed Importance Sampling */
-    numeric_t logZ = 0;
-    /* Initial distribution: fields only */
-    for (int i = 0; i < ali->nSites; i++) {
-        numeric_t Zi = 0;
-        for (int ai = 0; ai < ali->nCodes; ai++)
-            Zi += exp(exp(lambdaHi(i)) * xHi(i, ai));
-        logZ += log(Zi);
-    }
-
-    /* Draw an initial sequence from the starting distribution */
-    numeric_t H = 0;
-    letter_t *S = (letter_t *) malloc(ali->nSites * sizeof(letter_t));
-    numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-    for (int i = 0; i < ali->nSites; i++) {
-        /* Compute conditional CDF at the site */
-        for (int a = 0; a < ali->nCodes; a++)
-            P[a] = exp(lambdaHi(i)) * xHi(i, a);
-        numeric_t scale = P[0];
-        for (int a = 1; a < ali->nCodes; a++)
-            scale = (scale >= P[a] ? scale : P[a]);
-        for (int a = 0; a < ali->nCodes; a++) P[a] = exp(P[a] - scale);
-        for (int a = 1; a < ali->nCodes; a++) P[a] += P[a - 1];
-
-        /* Choose a new code for the site */
-        double u = genrand_real3() * P[ali->nCodes - 1];
-        int aNew = 0;
-        while (u > P[aNew]) aNew++;
-        S[i] = aNew;
-        H += exp(lambdaHi(i)) * xHi(i, S[i]);
-    }
-
-    /* Annealed Sampling */
-    int nAIS = 20 * ali->nSites;
-    for (int bx = 0; bx < nAIS; bx++) {
-        /* Pick a random site */
-        int i = genrand_int31() % ali->nSites;
-
-        /* Compute conditional CDF at the site at temperature BETA */
-        numeric_t beta = ((numeric_t) bx) / ((numeric_t) (nAIS - 1));
-        for (int a = 0; a < ali->nCodes; a++)
-            P[a] = exp(lambdaHi(i)) * xHi(i, a);
-        for (int j = 0; j < i; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                P[a] += beta * exp(lambdaEij(i, j))
-                        * xEij(i, j, a, S[j]);
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                P[a] += beta * exp(lambdaEij(i, j))
-                        * xEij(i, j, a, S[j]);
-
-        numeric_t scale = P[0];
-        for (int a = 1; a < ali->nCodes; a++)
-            scale = (scale >= P[a] ? scale : P[a]);
-        for (int a = 0; a < ali->nCodes; a++) P[a] = exp(P[a] - scale);
-        for (int a = 1; a < ali->nCodes; a++) P[a] += P[a - 1];
-
-        /* Choose a new code for the site */
-        double u = genrand_real3() * P[ali->nCodes - 1];
-        int aNew = 0;
-        while (u > P[aNew]) aNew++;
-        S[i] = aNew;
-
-        /* Contribute changes in Hamiltonian to partition function */
-        if (bx % ali->nSites == 0) {
-            numeric_t deltaB = ((numeric_t) ali->nSites)
-                               / ((numeric_t) (nAIS - 1));
-            for (int i = 0; i < ali->nSites - 1; i++)
-                for (int j = i + 1; j < ali->nSites; j++)
-                    logZ += deltaB * exp(lambdaEij(i, j))
-                            * xEij(i, j, S[i], S[j]);
-        }
-    }
-    free(S);
-    free(P);
+    numeric_t ess = 0;
+    numeric_t logZVar = 0;
+    numeric_t logZ = GibbsLogPartition(&ess, &logZVar, model, ali, options);
+    GibbsFreeModel(model);
+    ali->aisStats[0] += 1;
+    ali->aisStats[1] += ess;
+    ali->aisStats[2] += logZVar;
 
     /* Compute the negative log likelihood using estimated Log[Z] */
     #pragma omp parallel for reduction(+:negLogP)
@@ -684,7 +757,11 @@ numeric_t VBayesPairHierarchicalNonCentPL(void *data, const numeric_t *xB, numer
     numeric_t *g = &(gB[offset]);
 
     /* Negative log-pseudolikelihood */
-    #pragma omp parallel for
+    int nPairs = ali->nSites * (ali->nSites - 1) / 2;
+    numeric_t *gHalf = AllocSiteGradientHalves(ali);
+    numeric_t *gLambdaHalf =
+        (numeric_t *) malloc(nPairs * sizeof(numeric_t));
+    #pragma omp parallel for reduction(+:negLogP)
     for (int i = 0; i < ali->nSites; i++) {
         numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
         numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
@@ -781,34 +858,28 @@ numeric_t VBayesPairHierarchicalNonCentPL(void *data, const numeric_t *xB, numer
         }
 
         /* Contribute local loglk and gradient to global */
-        #pragma omp critical
-        {
         negLogP += siteFx;
-        for (int j = 0; j < i; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int a = 0; a < ali->nCodes; a++) dHi(i, a) += siteDH(i, a);
+        AddSiteGradient(i, Di, g, gHalf, ali);
 
-        /* Gradients over log sigma */
+        /* Gradients over log sigma, with the same ownership of pairs */
         gLambdaHi(i) += gSiteLambda[i];
         for (int j = 0; j < i; j++)
-            gLambdaEij(i,j) += gSiteLambda[j];
+            gLambdaHalf[i * (i - 1) / 2 + j] = gSiteLambda[j];
         for (int j = i + 1; j < ali->nSites; j++)
             gLambdaEij(i,j) += gSiteLambda[j];
 
         free(Xi);
         free(Di);
         free(gSiteLambda);
-        }
 
         free(H);
         free(P);
     }
+    MergeSiteGradients(g, gHalf, ali);
+    for (int k = 0; k < nPairs; k++)
+        gLambdas[ali->nSites + k] += gLambdaHalf[k];
+    free(gHalf);
+    free(gLambdaHalf);
 
     /* --------------------------------_DEBUG_--------------------------------*/
     /* Zero contributions from likelihood */
@@ -1090,7 +1161,8 @@ numeric_t VBayesPairHierarchical(void *data, const numeric_t *xB, numeric_t *gB,
 
     /* Negative log-pseudolikelihood */
     numeric_t negLogP = 0;
-    #pragma omp parallel for
+    numeric_t *gHalf = AllocSiteGradientHalves(ali);
+    #pragma omp parallel for reduction(+:negLogP)
     for (int i = 0; i < ali->nSites; i++) {
         numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
         numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
@@ -1160,25 +1232,16 @@ numeric_t VBayesPairHierarchical(void *data, const numeric_t *xB, numeric_t *gB,
         }
 
         /* Contribute local loglk and gradient to global */
-        #pragma omp critical
-        {
         negLogP += siteFx;
-        for (int j = 0; j < i; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int a = 0; a < ali->nCodes; a++) dHi(i, a) += siteDH(i, a);
+        AddSiteGradient(i, Di, g, gHalf, ali);
         free(Xi);
         free(Di);
-        }
 
         free(H);
         free(P);
     }
+    MergeSiteGradients(g, gHalf, ali);
+    free(gHalf);
 
     /* --------------------------------_DEBUG_--------------------------------*/
     /* Test function: multivariate standard normal */
@@ -1536,7 +1599,7 @@ numeric_t HMCPairHNonCenter(void *data, const numeric_t *xB, const int n) {
 
     /* Negative log-pseudolikelihood */
     numeric_t fx = 0;
-    #pragma omp parallel for
+    #pragma omp parallel for reduction(+:fx)
     for (int i = 0; i < ali->nSites; i++) {
         numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
         numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
@@ -1582,12 +1645,9 @@ numeric_t HMCPairHNonCenter(void *data, const numeric_t *xB, const int n) {
             siteFx -= w * log(P[seq(s, i)]);
         }
 
-        /* Contribute local loglk and gradient to global */
-        #pragma omp critical
-        {
+        /* Contribute local loglk to global */
         fx += siteFx;
         free(Xi);
-        }
 
         free(H);
         free(P);
@@ -1626,7 +1686,8 @@ void HMCPairHGradNonCenter(void *data, const numeric_t *xB, numeric_t *gB,
 
     /* Negative log-pseudolikelihood */
     numeric_t fx = 0;
-    #pragma omp parallel for
+    numeric_t *gHalf = AllocSiteGradientHalves(ali);
+    #pragma omp parallel for reduction(+:fx)
     for (int i = 0; i < ali->nSites; i++) {
         numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
         numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
@@ -1696,25 +1757,16 @@ void HMCPairHGradNonCenter(void *data, const numeric_t *xB, numeric_t *gB,
         }
 
         /* Contribute local loglk and gradient to global */
-        #pragma omp critical
-        {
         fx += siteFx;
-        for (int j = 0; j < i; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int a = 0; a < ali->nCodes; a++) dHi(i, a) += siteDH(i, a);
+        AddSiteGradient(i, Di, g, gHalf, ali);
         free(Xi);
         free(Di);
-        }
 
         free(H);
         free(P);
     }
+    MergeSiteGradients(g, gHalf, ali);
+    free(gHalf);
 
     /* --------------------------------_DEBUG_--------------------------------*/
     /* Test function: multivariate standard normal */
@@ -1752,13 +1804,20 @@ void EstimatePairModelMAP(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
     /* Start timer */
     gettimeofday(&ali->start, NULL);
 
-    /* Initialize Gibbs sampling with a random unconstrained sequences */
+    /* Initialize Gibbs sampling with a random unconstrained sequences, one
+       for every tempered replica of every chain */
+    int nReplicas = options->gChains * options->gTemps;
     init_genrand(42);
     ali->samples = (letter_t *)
-        malloc(ali->nSites * options->gChains * sizeof(letter_t));
-    for (int i = 0; i < ali->nSites * options->gChains; i++)
+        malloc(ali->nSites * nReplicas * sizeof(letter_t));
+    for (int i = 0; i < ali->nSites * nReplicas; i++)
         ali->samples[i] = (genrand_int31() % ali->nCodes);
 
+    /* Each replica draws from its own random stream */
+    ali->sampleStreams = (uint64_t *)
+        malloc(nReplicas * RNG_STATE_WORDS * sizeof(uint64_t));
+    RNGSeedStreams(ali->sampleStreams, nReplicas, 42);
+
     /* --------------------------------_DEBUG_--------------------------------*/
     /* Warm start */
     /* Initialize L-BFGS */
@@ -1827,8 +1886,20 @@ void EstimatePairModelMAP(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
     /* Array of void pointers provides relevant data structures */
     void *data[3] = {(void *)ali, (void *)options, (void *)lambdas};
 
+    /* Checkpoints carry the persistent chains along with x */
+    void *chains[3] = {(void *)ali, (void *)options, NULL};
+    checkpoint_t *checkpoint = CheckpointCreate(options->checkpointFile,
+        options->checkpointInterval, options->resume);
+    if (checkpoint != NULL) {
+        checkpoint->state = GibbsCheckpointState;
+        checkpoint->data = (void *)chains;
+    }
+
     EstimateMaximumAPosteriori(MAPPairGibbs, data, x, ali->nParams, eps,
-        options->maxIter, crit);
+        options->maxIter, crit, options->adamFloat, checkpoint);
+    CheckpointFree(checkpoint);
+    GibbsReportExchange(ali, options);
+    GibbsReportAutocorrelation(x, lambdas, ali, options);
 }
 
 void MAPPairGibbs(void *data, const numeric_t *x, numeric_t *g, const int n) {
@@ -1838,99 +1909,18 @@ void MAPPairGibbs(void *data, const numeric_t *x, numeric_t *g, const int n) {
     options_t *options = (options_t *) d[1];
     const numeric_t *lambdas = d[2];
 
-    /* Initialize gradient to zero */
-    for (int i = 0; i < n; i++) g[i] = 0;
-
-    /* Gradient: sitewise marginals of the data */
-    for (int i = 0; i < ali->nSites; i++)
-        for (int ai = 0; ai < ali->nCodes; ai++)
-            dHi(i, ai) = -ali->nEff * fi(i, ai);
-
-    /* Gradient: pairwise marginals of the data */
-    for (int i = 0; i < ali->nSites-1; i++)
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int ai = 0; ai < ali->nCodes; ai++)
-                for (int aj = 0; aj < ali->nCodes; aj++)
-                    dEij(i, j, ai, aj) = -ali->nEff * fij(i, j, ai, aj);
-
-    /* Gradient: marginals of the model by persistent Markov chains */
+    /* Sample the model by persistent Markov chains */
+    gibbs_model_t *model = GibbsCreateModel(x, lambdas, ali, options);
     int gSweeps = options->gSweeps;
     int gChains = options->gChains;
     letter_t *sample = (letter_t *) malloc(gChains * gSweeps * ali->nSites
         * sizeof(letter_t));
+    GibbsSampleChains(sample, model, ali, options);
+    GibbsFreeModel(model);
 
-    /* Presample from the pseudo-random number generator for thread safety */
-    int nSteps = gChains * gSweeps * ali->nSites;
-    int *siteI = (int *) malloc(nSteps * sizeof(int));
-    double *codeU = (double *) malloc(nSteps * sizeof(double));
-    for (int i = 0; i < nSteps; i++) siteI[i] = genrand_int31() % ali->nSites;
-    for (int i = 0; i < nSteps; i++) codeU[i] = genrand_real3();
-
-    /* Parallelize across the chains */
-    #pragma omp parallel for
-    for (int c = 0; c < gChains; c++) {
-        /* Samples gSweeps sequences in each chain */
-        numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-        for (int s = 0; s < gSweeps; s++) {
-            /* Sweep nSites positions */
-            for (int sx = 0; sx < ali->nSites; sx++) {
-                /* Pick a random site */
-                int i = siteI[c * gSweeps * ali->nSites + s * ali->nSites + sx];
-
-                /* Compute conditional CDF at the site */
-                for (int a = 0; a < ali->nCodes; a++)
-                    P[a] = exp(lambdaHi(i)) * xHi(i, a);
-                for (int j = 0; j < i; j++)
-                    for (int a = 0; a < ali->nCodes; a++)
-                        P[a] += exp(lambdaEij(i, j))
-                             * xEij(i, j, a, ali->samples[c * ali->nSites + j]);
-                for (int j = i + 1; j < ali->nSites; j++)
-                    for (int a = 0; a < ali->nCodes; a++)
-                        P[a] += exp(lambdaEij(i, j))
-                             * xEij(i, j, a, ali->samples[c * ali->nSites + j]);
-                numeric_t scale = P[0];
-                for (int a = 1; a < ali->nCodes; a++)
-                    scale = (scale >= P[a] ? scale : P[a]);
-                for (int a = 0; a < ali->nCodes; a++) P[a] = exp(P[a] - scale);
-                for (int a = 1; a < ali->nCodes; a++) P[a] += P[a - 1];
-
-                /* Choose a new code for the site */
-                double u = P[ali->nCodes - 1] *
-                    codeU[c * gSweeps * ali->nSites + s * ali->nSites + sx];
-                int aNew = 0;
-                while (u > P[aNew]) aNew++;
-                ali->samples[c * ali->nSites + i] = aNew;
-            }
-
-            /* Copy sequence into the global sample */
-            for (int i = 0; i < ali->nSites; i++)
-                sample[c * gSweeps * ali->nSites + s * ali->nSites + i] =
-                    ali->samples[c * ali->nSites + i];
-        }
-        free(P);
-    }
-
-    /* Contribute to global gradient for centered parameters */
-    numeric_t nRatio =
-        ((numeric_t) ali->nEff) / ((numeric_t) (gChains * gSweeps));
-    #pragma omp parallel for
-    for (int i = 0; i < ali->nSites; i++)
-        for (int c = 0; c < gChains; c++)
-            for (int s = 0; s < gSweeps; s++)
-                dHi(i, sample[c * gSweeps * ali->nSites + s * ali->nSites + i])
-                     += nRatio;
-    #pragma omp parallel for
-    for (int i = 0; i < ali->nSites - 1; i++)
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int c = 0; c < gChains; c++)
-                for (int s = 0; s < gSweeps; s++)
-                    dEij(i, j, 
-                        sample[c * gSweeps * ali->nSites + s * ali->nSites + i],
-                        sample[c * gSweeps * ali->nSites + s * ali->nSites + j])
-                        += nRatio;
+    /* Gradient: marginals of the model minus marginals of the data */
+    GibbsMarginalGradient(g, sample, gChains * gSweeps, ali);
     free(sample);
-    free(siteI);
-    free(codeU);
 
     numeric_t fx = 0;
     fx = AddPriorsCentered(x, g, lambdas, fx, ali, options);
@@ -1950,8 +1940,19 @@ void EstimatePairModelPLM(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
     param.epsilon = 1E-3;
     param.max_iterations = options->maxIter; /* 0 is unbounded */
 
+    /* Checkpoints carry the hyperparameters along with the optimizer */
+    void *state[2] = {(void *)ali, (void *)lambdas};
+    checkpoint_t *checkpoint = CheckpointCreate(options->checkpointFile,
+        options->checkpointInterval, options->resume);
+    if (checkpoint != NULL) {
+        checkpoint->state = PLMCheckpointState;
+        checkpoint->data = (void *)state;
+    }
+
     /* Array of void pointers provides relevant data structures */
-    void *d[3] = {(void *)ali, (void *)options, (void *)lambdas};
+    plm_workspace_t *workspace = CreatePLMWorkspace(ali, options);
+    void *d[5] = {(void *)ali, (void *)options, (void *)lambdas,
+        (void *)workspace, (void *)checkpoint};
 
     /* Estimate parameters by optimization */
     static lbfgs_evaluate_t algo;
@@ -1977,28 +1978,165 @@ void EstimatePairModelPLM(numeric_t *x, numeric_t *lambdas, alignment_t *ali,
 
     int ret = 0;
     lbfgsfloatval_t fx;
-    ret = lbfgs(ali->nParams, x, &fx, algo, ReportProgresslBFGS,
-        (void*)d, &param);
-    fprintf(stderr, "Gradient optimization: %s\n", LBFGSErrorString(ret));
+    int resumeAPC = (options->zeroAPC == 1 && CheckpointSkip(checkpoint, 0));
+    if (!resumeAPC) {
+        ret = lbfgs_checkpoint(ali->nParams, x, &fx, algo, ReportProgresslBFGS,
+            CheckpointlBFGS, (void*)d, &param);
+        fprintf(stderr, "Gradient optimization: %s\n", LBFGSErrorString(ret));
+    }
 
-    /* Optionally re-estimate parameters with adjusted hyperparameters */
+    /* Optionally re-estimate parameters with adjusted hyperparameters,
+       which a checkpoint of this stage restores along with x */
     if (options->zeroAPC == 1) {
-        /* Form new priors on the variances */
-        ZeroAPCPriors(ali, options, lambdas, x);
+        if (!resumeAPC) {
+            /* Form new priors on the variances */
+            ZeroAPCPriors(ali, options, lambdas, x);
 
-        /* Reinitialize coupling parameters */
-        for (int i = 0; i < ali->nSites - 1; i++)
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int ai = 0; ai < ali->nCodes; ai++)
-                    for (int aj = 0; aj < ali->nCodes; aj++)
-                        xEij(i, j, ai, aj) = 0.0;
+            /* Reinitialize coupling parameters */
+            for (int i = 0; i < ali->nSites - 1; i++)
+                for (int j = i + 1; j < ali->nSites; j++)
+                    for (int ai = 0; ai < ali->nCodes; ai++)
+                        for (int aj = 0; aj < ali->nCodes; aj++)
+                            xEij(i, j, ai, aj) = 0.0;
+        }
 
         /* Iterate estimation with new hyperparameter estimates */
+        CheckpointSkip(checkpoint, 1);
         options->zeroAPC = 2;
-        ret = lbfgs(ali->nParams, x, &fx, algo,
-            ReportProgresslBFGS, (void*)d, &param);
+        ret = lbfgs_checkpoint(ali->nParams, x, &fx, algo,
+            ReportProgresslBFGS, CheckpointlBFGS, (void*)d, &param);
         fprintf(stderr, "Gradient optimization: %s\n", LBFGSErrorString(ret));
     }
+    FreePLMWorkspace(workspace);
+    CheckpointFree(checkpoint);
+}
+
+static int CheckpointlBFGS(void *instance, lbfgs_state_t *state,
+    int restore) {
+    /* Writes the L-BFGS state every checkpoint interval or, on resume,
+       reads it back */
+    void **d = (void **)instance;
+    checkpoint_t *checkpoint = (checkpoint_t *) d[4];
+    FILE *fp = NULL;
+    if (restore) {
+        fp = CheckpointRestore(checkpoint, "lbfgs", state->n);
+    } else if (CheckpointDue(checkpoint, state->k - 1)) {
+        fp = CheckpointBegin(checkpoint, "lbfgs", state->n);
+    }
+    if (fp == NULL) return 0;
+
+    size_t size = sizeof(lbfgsfloatval_t);
+    CheckpointBlock(&(state->k), sizeof(int), 1, fp, restore);
+    CheckpointBlock(&(state->end), sizeof(int), 1, fp, restore);
+    CheckpointBlock(&(state->fx), size, 1, fp, restore);
+    CheckpointBlock(&(state->step), size, 1, fp, restore);
+    CheckpointBlock(state->x, size, state->n, fp, restore);
+    CheckpointBlock(state->g, size, state->n, fp, restore);
+    CheckpointBlock(state->d, size, state->n, fp, restore);
+    for (int i = 0; i < state->m; i++) {
+        CheckpointBlock(state->s[i], size, state->n, fp, restore);
+        CheckpointBlock(state->y[i], size, state->n, fp, restore);
+    }
+    CheckpointBlock(state->ys, size, state->m, fp, restore);
+    if (state->pf != NULL)
+        CheckpointBlock(state->pf, size, state->past, fp, restore);
+
+    if (restore) {
+        CheckpointRestoreEnd(fp, checkpoint);
+        return 1;
+    }
+    CheckpointCommit(fp, checkpoint);
+    return 0;
+}
+
+void PLMCheckpointState(void *data, FILE *fp, int restore) {
+    /* Hyperparameters, which ZeroAPCPriors sets between the two stages */
+    void **d = (void **)data;
+    alignment_t *ali = (alignment_t *) d[0];
+    numeric_t *lambdas = (numeric_t *) d[1];
+    CheckpointBlock(lambdas, sizeof(numeric_t),
+        ali->nSites + ali->nSites * (ali->nSites - 1) / 2, fp, restore);
+}
+
+static numeric_t PLMSiteNegLogLk(int i, const numeric_t *x,
+    const numeric_t *lambdas, alignment_t *ali, options_t *options,
+    numeric_t *restrict H, numeric_t *restrict Xi, numeric_t *restrict Di) {
+    /* Negative conditional log likelihood of site i and its gradient in Di.
+       Workspace buffers are passed as restrict parameters so that the
+       compiler knows they do not alias the alignment or the parameters.
+       The conditional distribution is kept in a local state vector instead,
+       since handing a restrict buffer to the exp kernel would forfeit that */
+    numeric_t P[SOFTMAX_MAX_STATES] __attribute__((aligned(64)));
+    numeric_t siteFx = 0.0;
+    /* Reshape site parameters and gradient into local blocks */
+    if (options->noncentered) {
+        /* Noncentered parameterization */
+        for (int j = 0; j < i; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = exp(lambdaEij(i, j))
+                                     * xEij(i, j, a, b);
+        for (int j = i + 1; j < ali->nSites; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = exp(lambdaEij(i, j))
+                                     * xEij(i, j, a, b);
+        for (int a = 0; a < ali->nCodes; a++)
+            siteH(i, a) = exp(lambdaHi(i)) * xHi(i, a);
+    } else {
+        /* Centered parameterization */
+        for (int j = 0; j < i; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = xEij(i, j, a, b);
+        for (int j = i + 1; j < ali->nSites; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = xEij(i, j, a, b);
+        for (int a = 0; a < ali->nCodes; a++) siteH(i, a) = xHi(i, a);
+    }
+    
+    for (int d = 0; d < ali->nCodes * ali->nCodes * ali->nSites; d++)
+        Di[d] = 0.0;
+
+    /* Site negative conditional log likelihoods */
+    for (int s = 0; s < ali->nSeqs; s++) {
+        /* Compute potentials */
+        for (int a = 0; a < ali->nCodes; a++) H[a] = siteH(i, a);
+        for (int j = 0; j < i; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                H[a] += siteE(j, a, seq(s, j));
+        for (int j = i + 1; j < ali->nSites; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                H[a] += siteE(j, a, seq(s, j));
+
+        /* Conditional distribution given sequence background */
+        for (int a = 0; a < ali->nCodes; a++) P[a] = H[a];
+        numeric_t logZ = Softmax(P, P, ali->nCodes);
+
+        /* Log-likelihood contributions are scaled by sequence weight */
+        numeric_t w = ali->weights[s];
+        siteFx -= w * (H[seq(s, i)] - logZ);
+
+        /* Field gradient */
+        siteDH(i, seq(s, i)) -= w;
+        for (int a = 0; a < ali->nCodes; a++)
+            siteDH(i, a) -= -w * P[a];
+
+        /* Couplings gradient */
+        int ix = seq(s, i);
+        for (int j = 0; j < i; j++)
+            siteDE(j, ix, seq(s, j)) -= w;
+        for (int j = i + 1; j < ali->nSites; j++)
+            siteDE(j, ix, seq(s, j)) -= w;
+        for (int j = 0; j < i; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                siteDE(j, a, seq(s, j)) -= -w * P[a];
+        for (int j = i + 1; j < ali->nSites; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                siteDE(j, a, seq(s, j)) -= -w * P[a];
+    }
+    return siteFx;
 }
 
 static lbfgsfloatval_t PLMNegLogPosterior(void *instance,
@@ -2011,6 +2149,7 @@ static lbfgsfloatval_t PLMNegLogPosterior(void *instance,
     alignment_t *ali = (alignment_t *) d[0];
     options_t *options = (options_t *) d[1];
     numeric_t *lambdas = (numeric_t *) d[2];
+    plm_workspace_t *workspace = (plm_workspace_t *) d[3];
 
     /* Initialize log-likelihood and gradient */
     lbfgsfloatval_t fx = 0.0;
@@ -2035,112 +2174,22 @@ static lbfgsfloatval_t PLMNegLogPosterior(void *instance,
     #endif
 
     /* Negative log-pseudolikelihood */
-    #pragma omp parallel for
+    numeric_t *gHalf = workspace->gHalf;
+    #pragma omp parallel for reduction(+:fx)
     for (int i = 0; i < ali->nSites; i++) {
-        numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-        numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-
-        numeric_t siteFx = 0.0;
-        /* Reshape site parameters and gradient into local blocks */
-        numeric_t *Xi = (numeric_t *) malloc(ali->nCodes * ali->nCodes
-            * ali->nSites * sizeof(numeric_t));
-        if (options->noncentered) {
-            /* Noncentered parameterization */
-            for (int j = 0; j < i; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = exp(lambdaEij(i, j))
-                                         * xEij(i, j, a, b);
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = exp(lambdaEij(i, j))
-                                         * xEij(i, j, a, b);
-            for (int a = 0; a < ali->nCodes; a++)
-                siteH(i, a) = exp(lambdaHi(i)) * xHi(i, a);
-        } else {
-            /* Centered parameterization */
-            for (int j = 0; j < i; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = xEij(i, j, a, b);
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = xEij(i, j, a, b);
-            for (int a = 0; a < ali->nCodes; a++) siteH(i, a) = xHi(i, a);
-        }
-        
-        numeric_t *Di = (numeric_t *) malloc(ali->nCodes * ali->nCodes
-        * ali->nSites * sizeof(numeric_t));
-        for (int d = 0; d < ali->nCodes * ali->nCodes * ali->nSites; d++)
-            Di[d] = 0.0;
-
-        /* Site negative conditional log likelihoods */
-        for (int s = 0; s < ali->nSeqs; s++) {
-            /* Compute potentials */
-            for (int a = 0; a < ali->nCodes; a++) H[a] = siteH(i, a);
-            for (int j = 0; j < i; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    H[a] += siteE(j, a, seq(s, j));
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    H[a] += siteE(j, a, seq(s, j));
-
-            /* Conditional distribution given sequence background */
-            numeric_t scale = H[0];
-            for (int a = 1; a < ali->nCodes; a++)
-                scale = (scale >= H[a] ? scale : H[a]);
-            for (int a = 0; a < ali->nCodes; a++) P[a] = exp(H[a] - scale);
-            numeric_t Z = 0;
-            for (int a = 0; a < ali->nCodes; a++) Z += P[a];
-            numeric_t Zinv = 1.0 / Z;
-            for (int a = 0; a < ali->nCodes; a++) P[a] *= Zinv;
-
-
-            /* Log-likelihood contributions are scaled by sequence weight */
-            numeric_t w = ali->weights[s];	
-            siteFx -= w * log(P[seq(s, i)]);
-
-            /* Field gradient */
-            siteDH(i, seq(s, i)) -= w;
-            for (int a = 0; a < ali->nCodes; a++)
-                siteDH(i, a) -= -w * P[a];
-
-            /* Couplings gradient */
-            int ix = seq(s, i);
-            for (int j = 0; j < i; j++)
-                siteDE(j, ix, seq(s, j)) -= w;
-            for (int j = i + 1; j < ali->nSites; j++)
-                siteDE(j, ix, seq(s, j)) -= w;
-            for (int j = 0; j < i; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    siteDE(j, a, seq(s, j)) -= -w * P[a];
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    siteDE(j, a, seq(s, j)) -= -w * P[a];
-        }
+        int threadID = 0;
+        #if defined(_OPENMP)
+        threadID = omp_get_thread_num();
+        #endif
+        numeric_t *Di = workspace->Di[threadID];
+        numeric_t siteFx = PLMSiteNegLogLk(i, x, lambdas, ali, options,
+            workspace->H[threadID], workspace->Xi[threadID], Di);
 
         /* Contribute local loglk and gradient to global */
-        #pragma omp critical
-        {
         fx += siteFx;
-        for (int j = 0; j < i; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int a = 0; a < ali->nCodes; a++) dHi(i, a) += siteDH(i, a);
-        free(Xi);
-        free(Di);
-        }
-
-        free(H);
-        free(P);
+        AddSiteGradient(i, Di, g, gHalf, ali);
     }
+    MergeSiteGradients(g, gHalf, ali);
 
     /* Transform gradients for noncentered parameterization */
     if (options->noncentered) {
@@ -2200,6 +2249,96 @@ static lbfgsfloatval_t PLMNegLogPosterior(void *instance,
     return fx;
 }
 
+static numeric_t PLMSiteNegLogLkGapReduce(int i, const numeric_t *x,
+    const numeric_t *lambdas, alignment_t *ali, options_t *options,
+    numeric_t *restrict H, numeric_t *restrict Xi, numeric_t *restrict Di) {
+    /* Negative conditional log likelihood of site i and its gradient in Di.
+       Workspace buffers are passed as restrict parameters so that the
+       compiler knows they do not alias the alignment or the parameters.
+       The conditional distribution is kept in a local state vector instead,
+       since handing a restrict buffer to the exp kernel would forfeit that */
+    numeric_t P[SOFTMAX_MAX_STATES] __attribute__((aligned(64)));
+    numeric_t siteFx = 0.0;
+    /* Reshape site parameters and gradient into local blocks */
+    if (options->noncentered) {
+        /* Noncentered parameterization */
+        for (int j = 0; j < i; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = exp(lambdaEij(i, j))
+                                     * xEij(i, j, a, b);
+        for (int j = i + 1; j < ali->nSites; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = exp(lambdaEij(i, j))
+                                     * xEij(i, j, a, b);
+        for (int a = 0; a < ali->nCodes; a++)
+            siteH(i, a) = exp(lambdaHi(i)) * xHi(i, a);
+    } else {
+        /* Centered parameterization */
+        for (int j = 0; j < i; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = xEij(i, j, a, b);
+        for (int j = i + 1; j < ali->nSites; j++)
+            for (int a = 0; a < ali->nCodes; a++)
+                for (int b = 0; b < ali->nCodes; b++)
+                    siteE(j, a, b) = xEij(i, j, a, b);
+        for (int a = 0; a < ali->nCodes; a++) siteH(i, a) = xHi(i, a);
+    }
+
+    for (int d = 0; d < ali->nCodes * ali->nCodes * ali->nSites; d++)
+        Di[d] = 0.0;
+
+    /* Site negative conditional log likelihoods */
+    for (int s = 0; s < ali->nSeqs; s++) {
+        /* Only ungapped sites are considered in the model */
+        if (seq(s, i) >= 0) {
+            /* Compute potentials */
+            for (int a = 0; a < ali->nCodes; a++) H[a] = siteH(i, a);
+            for (int j = 0; j < i; j++)
+                for (int a = 0; a < ali->nCodes; a++)
+                    if (seq(s, j) >= 0)
+                        H[a] += siteE(j, a, seq(s, j));
+            for (int j = i + 1; j < ali->nSites; j++)
+                for (int a = 0; a < ali->nCodes; a++)
+                    if (seq(s, j) >= 0)
+                        H[a] += siteE(j, a, seq(s, j));
+
+            /* Conditional distribution given sequence background */
+            for (int a = 0; a < ali->nCodes; a++) P[a] = H[a];
+            numeric_t logZ = Softmax(P, P, ali->nCodes);
+
+            /* Log-likelihood contributions are scaled by sequence weight */
+            numeric_t w = ali->weights[s];
+            siteFx -= w * (H[seq(s, i)] - logZ);
+
+            /* Field gradient */
+            siteDH(i, seq(s, i)) -= w;
+            for (int a = 0; a < ali->nCodes; a++)
+                siteDH(i, a) -= -w * P[a];
+
+            /* Couplings gradient */
+            int ix = seq(s, i);
+            for (int j = 0; j < i; j++)
+                if (seq(s, j) >= 0)
+                    siteDE(j, ix, seq(s, j)) -= w;
+            for (int j = i + 1; j < ali->nSites; j++)
+                if (seq(s, j) >= 0)
+                    siteDE(j, ix, seq(s, j)) -= w;
+            for (int j = 0; j < i; j++)
+                if (seq(s, j) >= 0)
+                    for (int a = 0; a < ali->nCodes; a++)
+                        siteDE(j, a, seq(s, j)) -= -w * P[a];
+            for (int j = i + 1; j < ali->nSites; j++)
+                if (seq(s, j) >= 0)
+                    for (int a = 0; a < ali->nCodes; a++)
+                        siteDE(j, a, seq(s, j)) -= -w * P[a];
+        }
+    }
+    return siteFx;
+}
+
 static lbfgsfloatval_t PLMNegLogPosteriorGapReduce(void *instance,
     const lbfgsfloatval_t *xB, lbfgsfloatval_t *gB, const int n,
     const lbfgsfloatval_t step) {
@@ -2210,6 +2349,7 @@ static lbfgsfloatval_t PLMNegLogPosteriorGapReduce(void *instance,
     alignment_t *ali = (alignment_t *) d[0];
     options_t *options = (options_t *) d[1];
     numeric_t *lambdas = (numeric_t *) d[2];
+    plm_workspace_t *workspace = (plm_workspace_t *) d[3];
 
     /* Initialize log-likelihood and gradient */
     lbfgsfloatval_t fx = 0.0;
@@ -2234,121 +2374,22 @@ static lbfgsfloatval_t PLMNegLogPosteriorGapReduce(void *instance,
     #endif
 
     /* Negative log-pseudolikelihood */
-    #pragma omp parallel for
+    numeric_t *gHalf = workspace->gHalf;
+    #pragma omp parallel for reduction(+:fx)
     for (int i = 0; i < ali->nSites; i++) {
-        numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-        numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-
-        numeric_t siteFx = 0.0;
-        /* Reshape site parameters and gradient into local blocks */
-        numeric_t *Xi = (numeric_t *) malloc(ali->nCodes * ali->nCodes
-            * ali->nSites * sizeof(numeric_t));
-        if (options->noncentered) {
-            /* Noncentered parameterization */
-            for (int j = 0; j < i; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = exp(lambdaEij(i, j))
-                                         * xEij(i, j, a, b);
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = exp(lambdaEij(i, j))
-                                         * xEij(i, j, a, b);
-            for (int a = 0; a < ali->nCodes; a++)
-                siteH(i, a) = exp(lambdaHi(i)) * xHi(i, a);
-        } else {
-            /* Centered parameterization */
-            for (int j = 0; j < i; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = xEij(i, j, a, b);
-            for (int j = i + 1; j < ali->nSites; j++)
-                for (int a = 0; a < ali->nCodes; a++)
-                    for (int b = 0; b < ali->nCodes; b++)
-                        siteE(j, a, b) = xEij(i, j, a, b);
-            for (int a = 0; a < ali->nCodes; a++) siteH(i, a) = xHi(i, a);
-        }
-
-        numeric_t *Di = (numeric_t *) malloc(ali->nCodes * ali->nCodes
-        * ali->nSites * sizeof(numeric_t));
-        for (int d = 0; d < ali->nCodes * ali->nCodes * ali->nSites; d++)
-            Di[d] = 0.0;
-
-        /* Site negative conditional log likelihoods */
-        for (int s = 0; s < ali->nSeqs; s++) {
-            /* Only ungapped sites are considered in the model */
-            if (seq(s, i) >= 0) {
-                /* Compute potentials */
-                for (int a = 0; a < ali->nCodes; a++) H[a] = siteH(i, a);
-                for (int j = 0; j < i; j++)
-                    for (int a = 0; a < ali->nCodes; a++)
-                        if (seq(s, j) >= 0)
-                            H[a] += siteE(j, a, seq(s, j));
-                for (int j = i + 1; j < ali->nSites; j++)
-                    for (int a = 0; a < ali->nCodes; a++)
-                        if (seq(s, j) >= 0)
-                            H[a] += siteE(j, a, seq(s, j));
-
-                /* Conditional distribution given sequence background */
-                numeric_t scale = H[0];
-                for (int a = 1; a < ali->nCodes; a++)
-                    scale = (scale >= H[a] ? scale : H[a]);
-                for (int a = 0; a < ali->nCodes; a++) P[a] = exp(H[a] - scale);
-                numeric_t Z = 0;
-                for (int a = 0; a < ali->nCodes; a++) Z += P[a];
-                numeric_t Zinv = 1.0 / Z;
-                for (int a = 0; a < ali->nCodes; a++) P[a] *= Zinv;
-
-
-                /* Log-likelihood contributions are scaled by sequence weight */
-                numeric_t w = ali->weights[s];  
-                siteFx -= w * log(P[seq(s, i)]);
-
-                /* Field gradient */
-                siteDH(i, seq(s, i)) -= w;
-                for (int a = 0; a < ali->nCodes; a++)
-                    siteDH(i, a) -= -w * P[a];
-
-                /* Couplings gradient */
-                int ix = seq(s, i);
-                for (int j = 0; j < i; j++)
-                    if (seq(s, j) >= 0)
-                        siteDE(j, ix, seq(s, j)) -= w;
-                for (int j = i + 1; j < ali->nSites; j++)
-                    if (seq(s, j) >= 0)
-                        siteDE(j, ix, seq(s, j)) -= w;
-                for (int j = 0; j < i; j++)
-                    if (seq(s, j) >= 0)
-                        for (int a = 0; a < ali->nCodes; a++)
-                            siteDE(j, a, seq(s, j)) -= -w * P[a];
-                for (int j = i + 1; j < ali->nSites; j++)
-                    if (seq(s, j) >= 0)
-                        for (int a = 0; a < ali->nCodes; a++)
-                            siteDE(j, a, seq(s, j)) -= -w * P[a];
-            }
-        }
+        int threadID = 0;
+        #if defined(_OPENMP)
+        threadID = omp_get_thread_num();
+        #endif
+        numeric_t *Di = workspace->Di[threadID];
+        numeric_t siteFx = PLMSiteNegLogLkGapReduce(i, x, lambdas, ali,
+            options, workspace->H[threadID], workspace->Xi[threadID], Di);
 
         /* Contribute local loglk and gradient to global */
-        #pragma omp critical
-        {
         fx += siteFx;
-        for (int j = 0; j < i; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int j = i + 1; j < ali->nSites; j++)
-            for (int a = 0; a < ali->nCodes; a++)
-                for (int b = 0; b < ali->nCodes; b++)
-                    dEij(i, j, a, b) += siteDE(j, a, b);
-        for (int a = 0; a < ali->nCodes; a++) dHi(i, a) += siteDH(i, a);
-        free(Xi);
-        free(Di);
-        }
-
-        free(H);
-        free(P);
+        AddSiteGradient(i, Di, g, gHalf, ali);
     }
+    MergeSiteGradients(g, gHalf, ali);
 
     /* Transform gradients for noncentered parameterization */
     if (options->noncentered) {
@@ -2412,6 +2453,7 @@ static lbfgsfloatval_t PLMNegLogPosteriorBlock(void *instance,
     alignment_t *ali = (alignment_t *) d[0];
     options_t *options = (options_t *) d[1];
     numeric_t *lambdas = (numeric_t *) d[2];
+    plm_workspace_t *workspace = (plm_workspace_t *) d[3];
 
     /* Initialize log-likelihood and gradient */
     lbfgsfloatval_t fx = 0.0;
@@ -2424,19 +2466,15 @@ static lbfgsfloatval_t PLMNegLogPosteriorBlock(void *instance,
     #endif
 
     /* Block fields hi */
-    numeric_t *hi = (numeric_t *)
-        malloc(ali->nSites * ali->nCodes * sizeof(numeric_t));
-    numeric_t *gHi = (numeric_t *)
-        malloc(ali->nSites * ali->nCodes * sizeof(numeric_t));
+    numeric_t *hi = workspace->hi;
+    numeric_t *gHi = workspace->gHi;
     for (int i = 0; i < ali->nSites; i++)
         for (int ai = 0; ai < ali->nCodes; ai++) Hi(i, ai) = xHi(i, ai);
     for (int i = 0; i < ali->nSites * ali->nCodes; i++) gHi[i] = 0;
 
     /* Block couplings eij */
-    numeric_t *eij = (numeric_t *) malloc(ali->nSites * ali->nSites
-        * ali->nCodes * ali->nCodes * sizeof(numeric_t));
-    numeric_t *gEij = (numeric_t *) malloc(ali->nSites * ali->nSites
-        * ali->nCodes * ali->nCodes * sizeof(numeric_t));
+    numeric_t *eij = workspace->eij;
+    numeric_t *gEij = workspace->gEij;
     for (int i = 0; i < ali->nSites * ali->nSites * ali->nCodes * ali->nCodes;
         i++) eij[i] = 0.0;
     for (int i = 0; i < ali->nSites * ali->nSites * ali->nCodes * ali->nCodes;
@@ -2451,9 +2489,8 @@ static lbfgsfloatval_t PLMNegLogPosteriorBlock(void *instance,
     /* Negative log-pseudolikelihood */
     for (int s = 0; s < ali->nSeqs; s++) {
         /* Form potential for conditional log likelihoods at every site */
-        numeric_t *H = (numeric_t *)
-            malloc(ali->nCodes * ali->nSites * sizeof(numeric_t));
-        numeric_t *Z = (numeric_t *) malloc(ali->nSites * sizeof(numeric_t));
+        numeric_t *H = workspace->H[0];
+        numeric_t *Z = workspace->P[0];
 
         /* Initialize potentials with fields */
         // memcpy(H, hi, ali->nSites * ali->nCodes * sizeof(numeric_t));
@@ -2497,8 +2534,6 @@ static lbfgsfloatval_t PLMNegLogPosteriorBlock(void *instance,
                 jgBlock[jx] -= H[jx];
         }
 
-        free(H);
-        free(Z);
         fx += seqFx;
     }
 
@@ -2511,10 +2546,6 @@ static lbfgsfloatval_t PLMNegLogPosteriorBlock(void *instance,
             for (int ai = 0; ai < ali->nCodes; ai++)
                 for (int aj = 0; aj < ali->nCodes; aj++)
                     dEij(i, j, ai, aj) += gEij(j, aj, i, ai) + gEij(i, ai, j, aj);
-    free(hi);
-    free(gHi);
-    free(eij);
-    free(gEij);
 
     /* Profiling code STOP */
     #if defined(PROFILE_TIMES)
@@ -2552,6 +2583,7 @@ static lbfgsfloatval_t PLMNegLogPosteriorDO(void *instance,
     alignment_t *ali = (alignment_t *) d[0];
     options_t *options = (options_t *) d[1];
     numeric_t *lambdas = (numeric_t *) d[2];
+    plm_workspace_t *workspace = (plm_workspace_t *) d[3];
 
     /* Initialize log-likelihood and gradient */
     lbfgsfloatval_t fx = 0.0;
@@ -2563,9 +2595,9 @@ static lbfgsfloatval_t PLMNegLogPosteriorDO(void *instance,
         gettimeofday(&tic, NULL);
     #endif
 
-    numeric_t *H = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-    numeric_t *P = (numeric_t *) malloc(ali->nCodes * sizeof(numeric_t));
-    int *drop_mask = (int *) malloc(ali->nParams * sizeof(int));
+    numeric_t *H = workspace->H[0];
+    numeric_t *P = workspace->P[0];
+    int *drop_mask = workspace->dropMask;
     for (int s = 0; s < ali->nSeqs; s++) {
         /* Generate random bit mask over parameters */
         for (int p = 0; p < ali->nParams; p ++)
@@ -2617,9 +2649,6 @@ static lbfgsfloatval_t PLMNegLogPosteriorDO(void *instance,
                         -bitEij(i, j, a, seq(s, j)) * ali->weights[s] * P[a];
         }
     }
-    free(H);
-    free(P);
-    free(drop_mask);
 
     /* Profiling code STOP */
     #if defined(PROFILE_TIMES)
@@ -2912,6 +2941,148 @@ void ZeroAPCPriors(alignment_t *ali, options_t *options, numeric_t *lambdas,
                     min, max, inbounds);
 }
 
+static size_t SiteGradientHalvesSize(alignment_t *ali) {
+    /* Fields and couplings, as in g */
+    return (size_t) ali->nSites * ali->nCodes
+        + (size_t) ali->nSites * (ali->nSites - 1) / 2
+        * ali->nCodes * ali->nCodes;
+}
+
+static void *WorkspaceSlice(char *base, size_t *offset, size_t bytes) {
+    /* Hands out the next aligned slice of an arena. With a NULL arena only the
+       offset advances, which measures the arena */
+    void *slice = (base != NULL) ? (void *) (base + *offset) : NULL;
+    *offset += (bytes + WORKSPACE_ALIGN - 1) / WORKSPACE_ALIGN
+               * WORKSPACE_ALIGN;
+    return slice;
+}
+
+static size_t LayoutPLMWorkspace(plm_workspace_t *w, char *base,
+    alignment_t *ali, options_t *options) {
+    /* Lays out the buffers of the selected objective and returns their size */
+    size_t offset = 0;
+    size_t L = ali->nSites;
+    size_t q = ali->nCodes;
+    switch(options->estimatorMAP) {
+        case INFER_MAP_PLM_BLOCK:
+            /* Serial over sequences: H holds potentials at every site and
+               P the partition functions */
+            w->hi = (numeric_t *)
+                WorkspaceSlice(base, &offset, L * q * sizeof(numeric_t));
+            w->gHi = (numeric_t *)
+                WorkspaceSlice(base, &offset, L * q * sizeof(numeric_t));
+            w->eij = (numeric_t *)
+                WorkspaceSlice(base, &offset, L * L * q * q * sizeof(numeric_t));
+            w->gEij = (numeric_t *)
+                WorkspaceSlice(base, &offset, L * L * q * q * sizeof(numeric_t));
+            w->H[0] = (numeric_t *)
+                WorkspaceSlice(base, &offset, L * q * sizeof(numeric_t));
+            w->P[0] = (numeric_t *)
+                WorkspaceSlice(base, &offset, L * sizeof(numeric_t));
+            break;
+        case INFER_MAP_PLM_DROPOUT:
+            /* Serial */
+            w->H[0] = (numeric_t *)
+                WorkspaceSlice(base, &offset, q * sizeof(numeric_t));
+            w->P[0] = (numeric_t *)
+                WorkspaceSlice(base, &offset, q * sizeof(numeric_t));
+            w->dropMask = (int *)
+                WorkspaceSlice(base, &offset, ali->nParams * sizeof(int));
+            break;
+        default:
+            /* Parallel over sites. Thread blocks are padded to cache lines
+               so that threads never share one */
+            for (int t = 0; t < w->nThreads; t++) {
+                w->H[t] = (numeric_t *)
+                    WorkspaceSlice(base, &offset, q * sizeof(numeric_t));
+                w->Xi[t] = (numeric_t *)
+                    WorkspaceSlice(base, &offset, L * q * q * sizeof(numeric_t));
+                w->Di[t] = (numeric_t *)
+                    WorkspaceSlice(base, &offset, L * q * q * sizeof(numeric_t));
+            }
+            w->gHalf = (numeric_t *) WorkspaceSlice(base, &offset,
+                SiteGradientHalvesSize(ali) * sizeof(numeric_t));
+    }
+    return offset;
+}
+
+plm_workspace_t *CreatePLMWorkspace(alignment_t *ali, options_t *options) {
+    plm_workspace_t *w = (plm_workspace_t *) malloc(sizeof(plm_workspace_t));
+    w->nThreads = 1;
+    #if defined(_OPENMP)
+    w->nThreads = omp_get_max_threads();
+    #endif
+    w->H = (numeric_t **) calloc(w->nThreads, sizeof(numeric_t *));
+    w->P = (numeric_t **) calloc(w->nThreads, sizeof(numeric_t *));
+    w->Xi = (numeric_t **) calloc(w->nThreads, sizeof(numeric_t *));
+    w->Di = (numeric_t **) calloc(w->nThreads, sizeof(numeric_t *));
+    w->gHalf = w->hi = w->gHi = w->eij = w->gEij = NULL;
+    w->dropMask = NULL;
+
+    /* Measure, allocate and align the arena, then lay it out */
+    size_t size = LayoutPLMWorkspace(w, NULL, ali, options);
+    w->arena = malloc(size + WORKSPACE_ALIGN);
+    if (w->arena == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate objective workspace\n");
+        exit(1);
+    }
+    char *base = (char *) (((uintptr_t) w->arena + WORKSPACE_ALIGN - 1)
+                           / WORKSPACE_ALIGN * WORKSPACE_ALIGN);
+    LayoutPLMWorkspace(w, base, ali, options);
+    return w;
+}
+
+void FreePLMWorkspace(plm_workspace_t *workspace) {
+    free(workspace->arena);
+    free(workspace->H);
+    free(workspace->P);
+    free(workspace->Xi);
+    free(workspace->Di);
+    free(workspace);
+}
+
+numeric_t *AllocSiteGradientHalves(alignment_t *ali) {
+    /* Coupling block (i, j) of the gradient receives one contribution from
+       each of its sites. The upper site parks its half in a buffer with the
+       layout of g until every site is done (see AddSiteGradient) */
+    numeric_t *gHalf = (numeric_t *)
+        malloc(SiteGradientHalvesSize(ali) * sizeof(numeric_t));
+    if (gHalf == NULL) {
+        fprintf(stderr, "Could not allocate pair gradient buffer\n");
+        exit(1);
+    }
+    return gHalf;
+}
+
+void AddSiteGradient(int i, const numeric_t *Di, numeric_t *g,
+    numeric_t *gHalf, alignment_t *ali) {
+    /* Contributes the local gradient block Di of site i. Site i owns the
+       fields at i and the coupling blocks (i, j > i) of g, and writes its
+       half of the blocks (j < i, i) to gHalf. Every slot therefore has a
+       single writer and sites may run concurrently without locks */
+    for (int j = 0; j < i; j++)
+        for (int a = 0; a < ali->nCodes; a++)
+            for (int b = 0; b < ali->nCodes; b++)
+                wEij(gHalf, i, j, a, b) = siteDE(j, a, b);
+    for (int j = i + 1; j < ali->nSites; j++)
+        for (int a = 0; a < ali->nCodes; a++)
+            for (int b = 0; b < ali->nCodes; b++)
+                dEij(i, j, a, b) += siteDE(j, a, b);
+    for (int a = 0; a < ali->nCodes; a++) dHi(i, a) += siteDH(i, a);
+}
+
+void MergeSiteGradients(numeric_t *g, const numeric_t *gHalf,
+    alignment_t *ali) {
+    /* Adds the parked halves after all sites have contributed. The order of
+       summation is that of a serial sweep over sites, so the gradient does
+       not depend on the number of threads */
+    size_t start = (size_t) ali->nSites * ali->nCodes;
+    size_t end = start + (size_t) ali->nSites * (ali->nSites - 1) / 2
+        * ali->nCodes * ali->nCodes;
+    #pragma omp parallel for
+    for (size_t k = start; k < end; k++) g[k] += gHalf[k];
+}
+
 const char *LBFGSErrorString(int ret) {
     const char *p;
     switch(ret) {
@@ -251,6 +251,22 @@ int lbfgs(
     void *instance,
     lbfgs_parameter_t *_param
     )
+{
+    return lbfgs_checkpoint(
+        n, x, ptr_fx, proc_evaluate, proc_progress, NULL, instance, _param
+        );
+}
+
+int lbfgs_checkpoint(
+    int n,
+    lbfgsfloatval_t *x,
+    lbfgsfloatval_t *ptr_fx,
+    lbfgs_evaluate_t proc_evaluate,
+    lbfgs_progress_t proc_progress,
+    lbfgs_checkpoint_t proc_checkpoint,
+    void *instance,
+    lbfgs_parameter_t *_param
+    )
 {
     int ret;
     int i, j, k, ls, end, bound;
@@ -269,6 +285,7 @@ int lbfgs(
     lbfgsfloatval_t fx = 0.;
     lbfgsfloatval_t rate = 0.;
     line_search_proc linesearch = line_search_morethuente;
+    lbfgs_state_t state = {0};
 
     /* Construct a callback data. */
     callback_data_t cd;
@@ -408,6 +425,46 @@ int lbfgs(
         pf = (lbfgsfloatval_t*)vecalloc(param.past * sizeof(lbfgsfloatval_t));
     }
 
+    /* Expose the state to the checkpoint callback. */
+    if (proc_checkpoint) {
+        state.n = n;
+        state.m = m;
+        state.past = param.past;
+        state.x = x;
+        state.g = g;
+        state.d = d;
+        state.pf = pf;
+        state.s = (lbfgsfloatval_t**)vecalloc(m * sizeof(lbfgsfloatval_t*));
+        state.y = (lbfgsfloatval_t**)vecalloc(m * sizeof(lbfgsfloatval_t*));
+        state.ys = (lbfgsfloatval_t*)vecalloc(m * sizeof(lbfgsfloatval_t));
+        if (state.s == NULL || state.y == NULL || state.ys == NULL) {
+            ret = LBFGSERR_OUTOFMEMORY;
+            goto lbfgs_exit;
+        }
+        for (i = 0;i < m;++i) {
+            state.s[i] = lm[i].s;
+            state.y[i] = lm[i].y;
+        }
+
+        /* Resume from a stored state. */
+        if (proc_checkpoint(instance, &state, 1)) {
+            k = state.k;
+            end = state.end;
+            fx = state.fx;
+            step = state.step;
+            for (i = 0;i < m;++i) {
+                lm[i].ys = state.ys[i];
+            }
+            if (param.orthantwise_c != 0.) {
+                owlqn_pseudo_gradient(
+                    pg, x, g, n,
+                    param.orthantwise_c, param.orthantwise_start, param.orthantwise_end
+                    );
+            }
+            goto lbfgs_resume;
+        }
+    }
+
     /* Evaluate the function value and its gradient. */
     fx = cd.proc_evaluate(cd.instance, x, g, cd.n, 0);
     if (0. != param.orthantwise_c) {
@@ -457,6 +514,7 @@ int lbfgs(
 
     k = 1;
     end = 0;
+lbfgs_resume:
     for (;;) {
         /* Store the current position and gradient vectors. */
         veccpy(xp, x, n);
@@ -612,6 +670,20 @@ int lbfgs(
             Now the search direction d is ready. We try step = 1 first.
          */
         step = 1.0;
+
+        /* Checkpoint the state for the next iteration. */
+        if (proc_checkpoint) {
+            state.k = k;
+            state.end = end;
+            state.fx = fx;
+            state.step = step;
+            for (i = 0;i < m;++i) {
+                state.ys[i] = lm[i].ys;
+            }
+            if ((ret = proc_checkpoint(instance, &state, 0))) {
+                goto lbfgs_exit;
+            }
+        }
     }
 
 lbfgs_exit:
@@ -621,6 +693,9 @@ lbfgs_exit:
     }
 
     vecfree(pf);
+    vecfree(state.ys);
+    vecfree(state.y);
+    vecfree(state.s);
 
     /* Free memory blocks used by this function. */
     if (lm != NULL) {
@@ -72,6 +72,22 @@ void init_genrand(unsigned long s)
     }
 }
 
+/* copies the state to or from state[GENRAND_STATE_WORDS], */
+/* mt[N] followed by mti, to checkpoint the generator */
+void get_genrand_state(unsigned long state[])
+{
+    int i;
+    for (i=0; i<N; i++) state[i] = mt[i];
+    state[N] = (unsigned long) mti;
+}
+
+void set_genrand_state(const unsigned long state[])
+{
+    int i;
+    for (i=0; i<N; i++) mt[i] = state[i];
+    mti = (int) state[N];
+}
+
 /* initialize by an array with array-length */
 /* init_key is the array for initializing keys */
 /* key_length is its length */
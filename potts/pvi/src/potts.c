@@ -0,0 +1,219 @@
+/*
+ *      Parallel Gibbs sampling of Potts models estimated by pvi
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+/* Optionally include OpenMP with the -fopenmp flag */
+#if defined(_OPENMP)
+    #include <omp.h>
+#endif
+
+#include "include/potts.h"
+#include "include/rng.h"
+
+/* Parameter files are written in single precision */
+#define PARAMETER_PRECISION float
+
+/* Internal to PottsRead */
+void PottsReadBlock(void *buffer, size_t size, size_t count, FILE *fp,
+    const char *paramFile);
+
+/* Internal to PottsSample */
+void PottsInitFields(double *F, const potts_model_t *model, const uint8_t *x);
+double PottsUpdateSite(double *F, double *P, uint8_t *x, int i,
+    const potts_model_t *model, uint64_t *rng);
+
+potts_model_t *PottsRead(const char *paramFile) {
+    FILE *fp = fopen(paramFile, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Error opening parameter file %s\n", paramFile);
+        exit(1);
+    }
+
+    potts_model_t *model = (potts_model_t *) malloc(sizeof(potts_model_t));
+    PottsReadBlock(&(model->nSites), sizeof(int), 1, fp, paramFile);
+    PottsReadBlock(&(model->nCodes), sizeof(int), 1, fp, paramFile);
+    int L = model->nSites;
+    int q = model->nCodes;
+    if (L < 1 || q < 2 || q > 256) {
+        fprintf(stderr, "Parameter file %s: unsupported dimensions "
+            "(%d sites, %d states)\n", paramFile, L, q);
+        exit(1);
+    }
+
+    /* Focus sequence and offsets */
+    model->target = (char *) malloc((L + 1) * sizeof(char));
+    PottsReadBlock(model->target, sizeof(char), L, fp, paramFile);
+    model->target[L] = '\0';
+    model->offsets = (int *) malloc(L * sizeof(int));
+    PottsReadBlock(model->offsets, sizeof(int), L, fp, paramFile);
+
+    /* Sitewise marginals (skipped), then fields */
+    PARAMETER_PRECISION *block = (PARAMETER_PRECISION *)
+        malloc(L * q * sizeof(PARAMETER_PRECISION));
+    PottsReadBlock(block, sizeof(PARAMETER_PRECISION), L * q, fp, paramFile);
+    PottsReadBlock(block, sizeof(PARAMETER_PRECISION), L * q, fp, paramFile);
+    model->h = (double *) malloc(L * q * sizeof(double));
+    for (int k = 0; k < L * q; k++) model->h[k] = (double) block[k];
+
+    /* Pair marginals (skipped) and couplings of every pair i < j */
+    size_t nE = (size_t) L * L * q * q;
+    model->e = (double *) calloc(nE, sizeof(double));
+    for (int i = 0; i < L - 1; i++)
+        for (int j = i + 1; j < L; j++) {
+            int ix[2];
+            PottsReadBlock(ix, sizeof(int), 2, fp, paramFile);
+            if (ix[0] != i + 1 || ix[1] != j + 1) {
+                fprintf(stderr, "Parameter file %s: expected pair (%d, %d) "
+                    "but found (%d, %d)\n", paramFile, i + 1, j + 1,
+                    ix[0], ix[1]);
+                exit(1);
+            }
+            PottsReadBlock(block, sizeof(PARAMETER_PRECISION), q * q, fp,
+                paramFile);
+            PottsReadBlock(block, sizeof(PARAMETER_PRECISION), q * q, fp,
+                paramFile);
+            double *Eij = model->e + (size_t) (i * L + j) * q * q;
+            double *Eji = model->e + (size_t) (j * L + i) * q * q;
+            for (int a = 0; a < q; a++)
+                for (int b = 0; b < q; b++) {
+                    Eij[b * q + a] = (double) block[a * q + b];
+                    Eji[a * q + b] = (double) block[a * q + b];
+                }
+        }
+    free(block);
+
+    /* Files of the other formats are longer */
+    if (fgetc(fp) != EOF) {
+        fprintf(stderr, "Parameter file %s: trailing data, expected the "
+            "format of pvi -o without -v\n", paramFile);
+        exit(1);
+    }
+    fclose(fp);
+    return model;
+}
+
+void PottsReadBlock(void *buffer, size_t size, size_t count, FILE *fp,
+    const char *paramFile) {
+    if (fread(buffer, size, count, fp) != count) {
+        fprintf(stderr, "Parameter file %s is truncated\n", paramFile);
+        exit(1);
+    }
+}
+
+void PottsFree(potts_model_t *model) {
+    free(model->target);
+    free(model->offsets);
+    free(model->h);
+    free(model->e);
+    free(model);
+}
+
+double PottsEnergy(const potts_model_t *model, const uint8_t *x) {
+    int L = model->nSites;
+    int q = model->nCodes;
+    double energy = 0;
+    for (int i = 0; i < L; i++) {
+        energy -= model->h[i * q + x[i]];
+        for (int j = i + 1; j < L; j++)
+            energy -= model->e[((size_t) (i * L + j) * q + x[j]) * q + x[i]];
+    }
+    return energy;
+}
+
+void PottsSample(uint8_t *samples, double *energies,
+    const potts_model_t *model, int nChains, int nSamples, int burnin,
+    int thin, uint64_t seed) {
+    int L = model->nSites;
+    int q = model->nCodes;
+
+    uint64_t *streams =
+        (uint64_t *) malloc(nChains * RNG_STATE_WORDS * sizeof(uint64_t));
+    RNGSeedStreams(streams, nChains, seed);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < nChains; c++) {
+        uint64_t *rng = &(streams[c * RNG_STATE_WORDS]);
+        uint8_t *x = (uint8_t *) malloc(L * sizeof(uint8_t));
+        double *F = (double *) malloc(L * q * sizeof(double));
+        double *P = (double *) malloc(q * sizeof(double));
+
+        for (int i = 0; i < L; i++) x[i] = (uint8_t) RNGIndex(rng, q);
+        PottsInitFields(F, model, x);
+        double energy = PottsEnergy(model, x);
+
+        for (int t = 0; t < burnin; t++)
+            for (int k = 0; k < L; k++)
+                energy += PottsUpdateSite(F, P, x, RNGIndex(rng, L), model,
+                    rng);
+
+        for (int s = 0; s < nSamples; s++) {
+            for (int t = 0; t < thin; t++)
+                for (int k = 0; k < L; k++)
+                    energy += PottsUpdateSite(F, P, x, RNGIndex(rng, L),
+                        model, rng);
+            uint8_t *out = samples + ((size_t) c * nSamples + s) * L;
+            for (int i = 0; i < L; i++) out[i] = x[i];
+            energies[(size_t) c * nSamples + s] = energy;
+        }
+
+        free(x);
+        free(F);
+        free(P);
+    }
+    free(streams);
+}
+
+/* Sets F[i * q + a] = h_i(a) + Sum_j e_ij(a, x_j), the log-potential of state
+   a at site i given the states of all other sites */
+void PottsInitFields(double *F, const potts_model_t *model, const uint8_t *x) {
+    int L = model->nSites;
+    int q = model->nCodes;
+    for (int i = 0; i < L; i++) {
+        double *Fi = F + i * q;
+        for (int a = 0; a < q; a++) Fi[a] = model->h[i * q + a];
+        for (int j = 0; j < L; j++) {
+            const double *Eij =
+                model->e + ((size_t) (i * L + j) * q + x[j]) * q;
+            for (int a = 0; a < q; a++) Fi[a] += Eij[a];
+        }
+    }
+}
+
+/* Draws site i from its conditional given the cached log-potentials F,
+   updates F for a change of state and returns the change in energy */
+double PottsUpdateSite(double *F, double *P, uint8_t *x, int i,
+    const potts_model_t *model, uint64_t *rng) {
+    int L = model->nSites;
+    int q = model->nCodes;
+    const double *Fi = F + i * q;
+
+    double scale = Fi[0];
+    for (int a = 1; a < q; a++) scale = (scale >= Fi[a] ? scale : Fi[a]);
+    double Z = 0;
+    for (int a = 0; a < q; a++) {
+        Z += exp(Fi[a] - scale);
+        P[a] = Z;
+    }
+    double u = RNGUniform(rng) * Z;
+    int b = 0;
+    while (b < q - 1 && u > P[b]) b++;
+
+    int a = x[i];
+    if (b == a) return 0;
+    double dE = Fi[a] - Fi[b];
+
+    /* Each other site j sees e_ji(., b) - e_ji(., a) */
+    for (int j = 0; j < L; j++) {
+        const double *Ea = model->e + ((size_t) (j * L + i) * q + a) * q;
+        const double *Eb = model->e + ((size_t) (j * L + i) * q + b) * q;
+        double *Fj = F + j * q;
+        for (int c = 0; c < q; c++) Fj[c] += Eb[c] - Ea[c];
+    }
+    x[i] = (uint8_t) b;
+    return dE;
+}
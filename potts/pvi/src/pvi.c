@@ -13,6 +13,11 @@ This software estimates undirected graphical models of multiple sequence alignme
 #include <sys/time.h>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /* Optionally include OpenMP with the -fopenmp flag */
 #if defined(_OPENMP)
@@ -22,6 +27,9 @@ This software estimates undirected graphical models of multiple sequence alignme
 #include "include/pvi.h"
 #include "include/bayes.h"
 #include "include/inference.h"
+#include "include/cache.h"
+#include "include/reweight.h"
+#include "include/gibbs.h"
 
 /* Usage pattern */
 const char *usage =
@@ -43,6 +51,9 @@ const char *usage =
 "    Options, alignment processing:\n"
 "      -s  --scale      <value>         Sequence weights: neighborhood weight [s > 0]\n"
 "      -t  --theta      <value>         Sequence weights: neighborhood divergence [0 < t < 1]\n"
+"      -ar --approxreweight             Sequence weights: approximate neighborhoods by hashing\n"
+"      -ca --cache                      Cache the processed alignment next to alignmentfile\n"
+"      -cm --cachemarginals             Cache the processed alignment and its marginals\n"
 "\n"
 "    Options, Maximum a posteriori estimation (L-BFGS, default):\n"
 "      -eh --estimatelh                 Estimate L2 lambdas for fields (Bayesian)\n"
@@ -50,19 +61,59 @@ const char *usage =
 "      -lh --lambdah    <value>         Set L2 lambda for fields (h_i)\n"
 "      -le --lambdae    <value>         Set L2 lambda for couplings (e_ij)\n"
 "\n"
+"    Options, variational Bayes:\n"
+"      -v  --variational                Estimate a variational posterior by stochastic gradients\n"
+"      -vs --vsamples   <number>        Samples per gradient of the ELBO\n"
+"      -vp --vparallel                  Evaluate the samples of each gradient concurrently, each\n"
+"                                       with its own Gibbs chains (with -vs of 2 or more)\n"
+"      -va --vantithetic                Draw the samples in antithetic pairs Z, -Z (requires an even\n"
+"                                       number of samples, -vs)\n"
+"      -vl --vstl                       Take the entropy gradient along the sampling path\n"
+"      -vc --vcontrol                   Subtract running linear control variates from the gradients\n"
+"      -af --adamfloat                  Store the Adam moment estimates in single precision (also\n"
+"                                       for -p)\n"
+"\n"
+"    Options, Gibbs sampling:\n"
+"      -go --gorder     order           Site updates: random, permuted, systematic, blocked,\n"
+"                                       colored or hogwild. Colors track the current couplings,\n"
+"                                       recomputed at every sampling step\n"
+"      -gt --gthreshold <value>         Coupling norm linking blocked or colored sites\n"
+"      -gf --gfields                    Cache local fields in each chain (not colored or hogwild)\n"
+"      -gr --greplicas  <number>        Tempered replicas per chain for replica exchange [r >= 1],\n"
+"                                       not with -go colored or hogwild\n"
+"      -gb --gbetamin   <value>         Lowest inverse temperature of the replicas [0 < b <= 1]\n"
+"      -ge --gexchange  <number>        Sweeps between replica exchanges [e >= 1]\n"
+"      -ap --aisparticles <number>      Particles of annealed importance sampling for log Z [p >= 1]\n"
+"      -as --aissweeps  <number>        Annealing sweeps per particle [s >= 1]\n"
+"      -gm --gmaterialize precision     Materialize the scaled couplings once per gradient step,\n"
+"                                       in double or float precision\n"
+"      -ga --gautocorr  <number>        After estimation, report the autocorrelation time of each\n"
+"                                       scan order over this many sweeps\n"
+"\n"
 "    Options, general:\n"
 "      -a  --alphabet   alphabet        Alternative character set to use for analysis\n"
 "      -f  --focus      identifier      Select only uppercase, non-gapped sites from a focus sequence\n"
 "      -g  --gapignore                  Model sequence likelihoods only by coding, non-gapped portions\n"
 "      -i  --independent                Estimate a site-independent model\n"
 "      -m  --maxiter                    Maximum number of iterations\n"
+"      -ck --checkpoint checkpointfile  Periodically save the optimizer state to file\n"
+"      -ci --cinterval  <number>        Iterations between checkpoints\n"
+"      -rs --resume                     Resume the optimization from the checkpoint\n"
 "      -n  --ncores    [<number>|max]   Maximum number of threads to use in OpenMP\n"
 "      -h  --help                       Usage\n\n";
 
 /* Internal functions to MSARead */
-void MSAReadSeq(char *seq, FILE *fpAli);
+void MSAReadFASTA(alignment_t *ali, const char *buffer, size_t length);
 letter_t MSAReadCode(char c, char *alphabet, int nCodes);
 
+/* Internal functions to MSACountMarginals */
+void MSACountPairMarginals(alignment_t *ali, const letter_t *columns,
+    int gapReduce, numeric_t scale);
+
+/* Pair marginals are counted over tiles of MARGINALS_BLOCK x MARGINALS_BLOCK
+   sites, sized so that a tile's slice of fij stays in L2 */
+#define MARGINALS_BLOCK 8
+
 numeric_t *DEBUGParams(alignment_t *ali);
 
 /* Global verbosity & profiling options */
@@ -99,13 +150,31 @@ int main(int argc, char **argv) {
     options->bayesLH = 0;
     options->maxIter = 0;
     options->vSamples = 1;
+    options->vParallel = 0;
+    options->vReduce = 0;
+    options->adamFloat = 0;
+    options->checkpointFile = NULL;
+    options->checkpointInterval = 100;
+    options->resume = 0;
     options->gChains = 20;
     options->gSweeps = 5;
+    options->gibbs = GIBBS_DIRECT;
+    options->gOrder = GIBBS_ORDER_RANDOM;
+    options->gThreshold = 0;
+    options->gTemps = 1;
+    options->gBetaMin = 0.5;
+    options->gExchange = 1;
+    options->gTensor = GIBBS_TENSOR_NONE;
+    options->gAutocorr = 0;
+    options->aisParticles = 4;
+    options->aisSweeps = 20;
     options->usePairs = 1;
     options->estimator = INFER_PLM;
     options->estimatorMAP = INFER_MAP_PLM;
     options->target = NULL;
     options->alphabet = (char *) codesAA;
+    options->cache = CACHE_NONE;
+    options->reweight = REWEIGHT_EXACT;
 
     /* Print usage if no arguments */
     if (argc == 1) {
@@ -139,6 +208,15 @@ int main(int argc, char **argv) {
         } else if ((arg < argc-1) && (strcmp(argv[arg], "--scale") == 0
                     || strcmp(argv[arg], "-s") == 0)) {
             options->scale = atof(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--approxreweight") == 0
+                    || strcmp(argv[arg], "-ar") == 0)) {
+            options->reweight = REWEIGHT_LSH;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--cache") == 0
+                    || strcmp(argv[arg], "-ca") == 0)) {
+            if (options->cache == CACHE_NONE) options->cache = CACHE_ALIGNMENT;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--cachemarginals") == 0
+                    || strcmp(argv[arg], "-cm") == 0)) {
+            options->cache = CACHE_MARGINALS;
         } else if ((arg < argc-1)  && (strcmp(argv[arg], "--maxiter") == 0
                     || strcmp(argv[arg], "-m") == 0)) {
             options->maxIter = atoi(argv[++arg]);
@@ -172,6 +250,26 @@ int main(int argc, char **argv) {
                     || strcmp(argv[arg], "-vs") == 0)) {
             /* Set the number of samples for KL gradient estimation */
             options->vSamples =  atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--vparallel") == 0
+                    || strcmp(argv[arg], "-vp") == 0)) {
+            /* Evaluate the samples for each KL gradient concurrently */
+            options->vParallel = 1;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--vantithetic") == 0
+                    || strcmp(argv[arg], "-va") == 0)) {
+            /* Draw the samples for KL gradients in antithetic pairs */
+            options->vReduce |= SVI_ANTITHETIC;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--vstl") == 0
+                    || strcmp(argv[arg], "-vl") == 0)) {
+            /* Estimate the entropy gradient along the sampling path */
+            options->vReduce |= SVI_STL;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--vcontrol") == 0
+                    || strcmp(argv[arg], "-vc") == 0)) {
+            /* Subtract running control variates from the KL gradients */
+            options->vReduce |= SVI_CONTROL;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--adamfloat") == 0
+                    || strcmp(argv[arg], "-af") == 0)) {
+            /* Store the moment estimates of Adam in single precision */
+            options->adamFloat = 1;
         } else if ((arg < argc-1) && (strcmp(argv[arg], "--gchains") == 0
                     || strcmp(argv[arg], "-gc") == 0)) {
             /* Set the number of MCMC chains for Gibbs sampling */
@@ -180,6 +278,85 @@ int main(int argc, char **argv) {
                     || strcmp(argv[arg], "-gs") == 0)) {
             /* Set the number of MCMC sweeps per chaing for Gibbs sampling */
             options->gSweeps = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gfields") == 0
+                    || strcmp(argv[arg], "-gf") == 0)) {
+            /* Cache local fields in each chain for Gibbs sampling */
+            options->gibbs = GIBBS_FIELDS;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gorder") == 0
+                    || strcmp(argv[arg], "-go") == 0)) {
+            /* Set the site update order for Gibbs sampling */
+            arg++;
+            if (strcmp(argv[arg], "random") == 0) {
+                options->gOrder = GIBBS_ORDER_RANDOM;
+            } else if (strcmp(argv[arg], "permuted") == 0) {
+                options->gOrder = GIBBS_ORDER_PERMUTED;
+            } else if (strcmp(argv[arg], "systematic") == 0) {
+                options->gOrder = GIBBS_ORDER_SYSTEMATIC;
+            } else if (strcmp(argv[arg], "blocked") == 0) {
+                options->gOrder = GIBBS_ORDER_BLOCKED;
+            } else if (strcmp(argv[arg], "colored") == 0) {
+                options->gOrder = GIBBS_ORDER_COLORED;
+            } else if (strcmp(argv[arg], "hogwild") == 0) {
+                options->gOrder = GIBBS_ORDER_HOGWILD;
+            } else {
+                fprintf(stderr, "Error (-go/--gorder) unknown order %s, use "
+                    "random, permuted, systematic, blocked, colored or "
+                    "hogwild\n", argv[arg]);
+                exit(1);
+            }
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gthreshold") == 0
+                    || strcmp(argv[arg], "-gt") == 0)) {
+            /* Set the coupling norm that links colored or blocked sites */
+            options->gThreshold = atof(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--greplicas") == 0
+                    || strcmp(argv[arg], "-gr") == 0)) {
+            /* Set the number of tempered replicas per chain */
+            options->gTemps = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gbetamin") == 0
+                    || strcmp(argv[arg], "-gb") == 0)) {
+            /* Set the lowest inverse temperature of the replica ladder */
+            options->gBetaMin = atof(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gexchange") == 0
+                    || strcmp(argv[arg], "-ge") == 0)) {
+            /* Set the number of sweeps between replica exchanges */
+            options->gExchange = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gmaterialize") == 0
+                    || strcmp(argv[arg], "-gm") == 0)) {
+            /* Materialize the scaled couplings for Gibbs sampling */
+            arg++;
+            if (strcmp(argv[arg], "double") == 0) {
+                options->gTensor = GIBBS_TENSOR_NUMERIC;
+            } else if (strcmp(argv[arg], "float") == 0) {
+                options->gTensor = GIBBS_TENSOR_FLOAT;
+            } else {
+                fprintf(stderr, "Error (-gm/--gmaterialize) unknown precision "
+                    "%s, use double or float\n", argv[arg]);
+                exit(1);
+            }
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--gautocorr") == 0
+                    || strcmp(argv[arg], "-ga") == 0)) {
+            /* Compare the autocorrelation of scan orders after estimation */
+            options->gAutocorr = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--aisparticles") == 0
+                    || strcmp(argv[arg], "-ap") == 0)) {
+            /* Set the number of particles for annealed importance sampling */
+            options->aisParticles = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--aissweeps") == 0
+                    || strcmp(argv[arg], "-as") == 0)) {
+            /* Set the number of annealing sweeps per particle */
+            options->aisSweeps = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--checkpoint") == 0
+                    || strcmp(argv[arg], "-ck") == 0)) {
+            /* Periodically checkpoint the optimization to a file */
+            options->checkpointFile = argv[++arg];
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--cinterval") == 0
+                    || strcmp(argv[arg], "-ci") == 0)) {
+            /* Set the number of iterations between checkpoints */
+            options->checkpointInterval = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--resume") == 0
+                    || strcmp(argv[arg], "-rs") == 0)) {
+            /* Resume the optimization from the checkpoint */
+            options->resume = 1;
         } else if ((arg < argc-1) && (strcmp(argv[arg], "--ncores") == 0
                     || strcmp(argv[arg], "-n") == 0)) {
             #if defined(_OPENMP)
@@ -220,19 +397,74 @@ int main(int argc, char **argv) {
         }
     }
     alignFile = argv[argc - 1];
+    if (options->gTemps < 1 || options->gExchange < 1
+        || options->gBetaMin <= 0 || options->gBetaMin > 1) {
+        fprintf(stderr, "Error (-gr/-gb/-ge) replica exchange needs at least "
+            "1 replica and 1 sweep per exchange, with 0 < beta <= 1\n");
+        exit(1);
+    }
+    if (options->aisParticles < 1 || options->aisSweeps < 1) {
+        fprintf(stderr, "Error (-ap/-as) annealed importance sampling needs "
+            "at least 1 particle and 1 sweep\n");
+        exit(1);
+    }
+    if ((options->vReduce & SVI_ANTITHETIC) && options->vSamples % 2 != 0) {
+        fprintf(stderr, "Error (-va/--vantithetic) antithetic pairs need an "
+            "even number of samples, -vs\n");
+        exit(1);
+    }
+    if (options->resume && options->checkpointFile == NULL) {
+        fprintf(stderr, "Error (-rs/--resume) requires a checkpoint file, "
+            "-ck checkpointfile\n");
+        exit(1);
+    }
+    if (options->checkpointInterval < 1) {
+        fprintf(stderr, "Error (-ci/--cinterval) checkpoints need at least 1 "
+            "iteration between them\n");
+        exit(1);
+    }
+    if (options->gTemps > 1 && (options->gOrder == GIBBS_ORDER_COLORED
+        || options->gOrder == GIBBS_ORDER_HOGWILD)) {
+        fprintf(stderr, "Error (-gr/--greplicas) replica exchange requires "
+            "sweeps across chains, not -go colored or hogwild\n");
+        exit(1);
+    }
+    if (options->gibbs == GIBBS_FIELDS && (options->gOrder
+        == GIBBS_ORDER_COLORED || options->gOrder == GIBBS_ORDER_HOGWILD)) {
+        fprintf(stderr, "Error (-gf/--gfields) cached fields require sweeps "
+            "across chains, not -go colored or hogwild\n");
+        exit(1);
+    }
+
+    /* Reload a previously processed alignment if the inputs match */
+    alignment_t *ali = NULL;
+    if (options->cache != CACHE_NONE)
+        ali = MSAReadCache(alignFile, options);
+
+    if (ali == NULL) {
+        /* Read multiple seqence alignment */
+        ali = MSARead(alignFile, options);
+
+        /* Reweight sequences by inverse neighborhood density */
+        MSAReweightSequences(ali, options->theta, options->scale,
+            options->reweight);
 
-    /* Read multiple seqence alignment */
-    alignment_t *ali = MSARead(alignFile, options);
+        /* Merge identical sequences into unique rows with summed weights */
+        MSACollapseDuplicates(ali);
 
-    /* Reweight sequences by inverse neighborhood density */
-    MSAReweightSequences(ali, options->theta, options->scale);
+        /* Compute sitwise and pairwise marginal distributions */
+        MSACountMarginals(ali, options);
 
-    /* Compute sitwise and pairwise marginal distributions */
-    MSACountMarginals(ali, options);
+        /* Estimate effective sample size */
+        if (options->theta >= 0 && options->theta <= 1)
+            MSAEstimateSampleSize(ali, options);
 
-    /* Estimate effective sample size */
-    if (options->theta >= 0 && options->theta <= 1)
-        MSAEstimateSampleSize(ali, options);
+        if (options->cache != CACHE_NONE)
+            MSAWriteCache(alignFile, ali, options);
+    } else if (ali->fij == NULL) {
+        /* Marginals were not cached; recount them from the cached weights */
+        MSACountMarginals(ali, options);
+    }
 
     /* Infer model parameters */
     numeric_t *x = InferPairModel(ali, options);
@@ -264,18 +496,31 @@ int main(int argc, char **argv) {
 }
 
 alignment_t *MSARead(char *alignFile, options_t *options) {
-    /* Read FASTA-formatted alignment */
-    FILE *fpAli = NULL;
-    if (alignFile != NULL) {
-        fpAli = fopen(alignFile, "r");
-    } else {
+    /* Map FASTA-formatted alignment into memory */
+    if (alignFile == NULL) {
         fprintf(stderr, "Must specify alignment file: -a ALIGN_FILE\n");
         exit(1);
     }
-    if (fpAli == NULL) {
+    int fdAli = open(alignFile, O_RDONLY);
+    struct stat statAli;
+    if (fdAli < 0 || fstat(fdAli, &statAli) != 0) {
         fprintf(stderr, "Error opening alignment file\n");
         exit(1);
     }
+    size_t fileSize = (size_t) statAli.st_size;
+    if (fileSize == 0) {
+        fprintf(stderr, "Error reading alignment: file is empty\n");
+        exit(1);
+    }
+    char *fileBuffer = (char *)
+        mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fdAli, 0);
+    if (fileBuffer == MAP_FAILED) {
+        fprintf(stderr, "Error mapping alignment file into memory\n");
+        exit(1);
+    }
+    #if defined(MADV_SEQUENTIAL)
+    madvise(fileBuffer, fileSize, MADV_SEQUENTIAL);
+    #endif
 
     /* Allocate alignment */
     alignment_t *ali = (alignment_t *) malloc(sizeof(alignment_t));
@@ -285,60 +530,36 @@ alignment_t *MSARead(char *alignFile, options_t *options) {
     ali->sequences = NULL;
     ali->target = -1;
     ali->offsets = NULL;
+    ali->samples = NULL;
+    ali->sampleStreams = NULL;
+    ali->swapStats = NULL;
+    ali->aisStreams = NULL;
+    ali->aisStats = NULL;
     ali->nEff = 0;
     ali->weights = ali->fi = ali->fij = ali->gapi = ali->ungapij = NULL;
+    ali->nSeqsAll = 0;
+    ali->uniqueMap = NULL;
     ali->nParams = 0;
-
-    /* Verify alignment dimensions and structure (first pass through file) */
-    char name[BUFFER_SIZE];
-    char seq[BUFFER_SIZE];
-    fgetstr(name, fpAli);
-    if (*name == '>') MSAReadSeq(seq, fpAli);
     ali->nCodes = strlen(ali->alphabet);
-    ali->nSites = strlen(seq);
-    ali->nSeqs = 1;
-    while (!feof(fpAli)) {
-        char c = fgetc(fpAli);
-        if (c == '>') {
-            /* Read name and sequence pair */
-            fgetstr(name, fpAli);
-            MSAReadSeq(seq, fpAli);
-        } else {
-            fprintf(stderr, "Error reading alignment:"
-                            " sequences should start with >\n");
-            exit(1);
-        }
-
-        /* Validate sequence length */
-        if (strlen(seq) != ali->nSites) {
-            fprintf(stderr,
-                "Incompatible sequence length (%lu should be %d) for %s:\n%s\n",
-                strlen(seq), ali->nSites, name, seq);
-            exit(1);
-        }
-        ali->nSeqs++;
+    if (ali->nCodes > LETTER_MAX_CODES) {
+        fprintf(stderr, "Alphabet has %d characters, at most %d are supported\n",
+            ali->nCodes, LETTER_MAX_CODES);
+        exit(1);
     }
 
-    /* Encode full alignment block (second pass through file) */
-    ali->sequences = (letter_t *)
-        malloc(ali->nSites * ali->nSeqs * sizeof(letter_t));
-    ali->names = (char **) malloc(ali->nSeqs * sizeof(char *));
-    for (int s = 0; s < ali->nSeqs; s++)
-        for (int i = 0; i < ali->nSites; i++) seq(s, i) = 0;
-    for (int s = 0; s < ali->nSeqs; s++) ali->names[s] = NULL;
-    rewind(fpAli);
-    for (int s = 0; s < ali->nSeqs; s++) {
-        /* >Name */
-        getc(fpAli);
-        fgetstr(name, fpAli);
-        ali->names[s] = (char *) malloc((strlen(name) + 1) * sizeof(char));
-        strcpy(ali->names[s], name);
+    /* Validate and encode the full alignment block in a single pass */
+    struct timeval readStart, readStop;
+    gettimeofday(&readStart, NULL);
+    MSAReadFASTA(ali, fileBuffer, fileSize);
+    gettimeofday(&readStop, NULL);
+    munmap(fileBuffer, fileSize);
+    close(fdAli);
 
-        /* Sequence */
-        MSAReadSeq(seq, fpAli);
-        for (int i = 0; i < ali->nSites; i++)
-            seq(s, i) = MSAReadCode(seq[i], ali->alphabet, ali->nCodes);
-    }
+    numeric_t readTime = (numeric_t) (readStop.tv_sec - readStart.tv_sec)
+        + ((numeric_t) (readStop.tv_usec - readStart.tv_usec)) / 1E6;
+    numeric_t readMB = ((numeric_t) fileSize) / (1024.0 * 1024.0);
+    fprintf(stderr, "Parsed %.1f MB in %.3f s (%.1f MB/s)\n",
+        readMB, readTime, readMB / (readTime > 1E-6 ? readTime : 1E-6));
 
     /* --------------------------------_DEBUG_--------------------------------*/
     /* Alignment to stderr */
@@ -478,6 +699,15 @@ alignment_t *MSARead(char *alignFile, options_t *options) {
                 sx++;
             }
 
+        /* Keep the names of the selected rows */
+        sx = 0;
+        for (int s = 0; s < ali->nSeqs; s++)
+            if (seqValid[s] == ali->nSites) {
+                ali->names[sx++] = ali->names[s];
+            } else {
+                free(ali->names[s]);
+            }
+
         /* Reallocate alignment with reduced dimensions */
         free(ali->sequences);
         ali->nSeqs = nValidSeqs;
@@ -502,6 +732,7 @@ alignment_t *MSARead(char *alignFile, options_t *options) {
     ali->weights = (numeric_t *) malloc(ali->nSeqs * sizeof(numeric_t));
     for (int s = 0; s < ali->nSeqs; s++) ali->weights[s] = 1.0;
     ali->nEff = (numeric_t) ali->nSeqs;
+    ali->nSeqsAll = ali->nSeqs;
 
     /* --------------------------------_DEBUG_--------------------------------*/
     /* Display offset map */
@@ -529,18 +760,104 @@ alignment_t *MSARead(char *alignFile, options_t *options) {
     return ali;
 }
 
-void MSAReadSeq(char *seq, FILE *fpAli) {
-    /* Read sequence from the current line(s) */
-    char buf[BUFFER_SIZE];
-    char c = fgetc(fpAli);
-    ungetc(c, fpAli);
-    seq[0] = '\0';
-    while (c != '>' && !feof(fpAli)) {
-        fgetstr(buf, fpAli);
-        strcat(seq, buf);
-        c = fgetc(fpAli);
-        ungetc(c, fpAli);
+void MSAReadFASTA(alignment_t *ali, const char *buffer, size_t length) {
+    /* Parse a memory-mapped FASTA alignment in a single pass. Residues are
+       encoded directly into the alignment block by a table built from 
+       MSAReadCode, and the block grows geometrically as sequences are read
+     */
+    letter_t codeMap[256];
+    for (int c = 0; c < 256; c++)
+        codeMap[c] = MSAReadCode((char) c, ali->alphabet, ali->nCodes);
+
+    const char *p = buffer;
+    const char *end = buffer + length;
+    while (p < end && (*p == '\n' || *p == '\r')) p++;
+
+    int capacity = 0;
+    ali->nSeqs = 0;
+    while (p < end) {
+        if (*p != '>') {
+            fprintf(stderr, "Error reading alignment:"
+                            " sequences should start with >\n");
+            exit(1);
+        }
+
+        /* >Name */
+        const char *name = ++p;
+        const char *nameEnd = (const char *) memchr(p, '\n', end - p);
+        if (nameEnd == NULL) nameEnd = end;
+        p = (nameEnd < end) ? nameEnd + 1 : end;
+        if (nameEnd > name && *(nameEnd - 1) == '\r') nameEnd--;
+        size_t nameLength = nameEnd - name;
+
+        /* The first sequence sets the dimensions of the alignment */
+        if (ali->nSeqs == 0) {
+            int nSites = 0;
+            const char *q = p;
+            while (q < end && *q != '>') {
+                for (; q < end && *q != '\n'; q++) if (*q != '\r') nSites++;
+                if (q < end) q++;
+            }
+            ali->nSites = nSites;
+
+            /* Initial capacity is the number of records of this size */
+            size_t recordSize = (size_t) (q - buffer);
+            capacity = (int) (length / (recordSize > 0 ? recordSize : 1)) + 1;
+            ali->sequences = (letter_t *)
+                malloc((size_t) capacity * ali->nSites * sizeof(letter_t));
+            ali->names = (char **) malloc(capacity * sizeof(char *));
+        }
+
+        /* Grow the alignment block geometrically */
+        if (ali->nSeqs == capacity) {
+            capacity *= 2;
+            ali->sequences = (letter_t *) realloc(ali->sequences,
+                (size_t) capacity * ali->nSites * sizeof(letter_t));
+            ali->names = (char **)
+                realloc(ali->names, capacity * sizeof(char *));
+        }
+        if (ali->sequences == NULL || ali->names == NULL) {
+            fprintf(stderr,
+                "ERROR: Failed to allocate a memory block for the alignment.\n");
+            exit(1);
+        }
+
+        int s = ali->nSeqs;
+        ali->names[s] = (char *) malloc((nameLength + 1) * sizeof(char));
+        memcpy(ali->names[s], name, nameLength);
+        ali->names[s][nameLength] = '\0';
+
+        /* Sequence, possibly spanning multiple lines */
+        int i = 0;
+        while (p < end && *p != '>') {
+            for (; p < end && *p != '\n'; p++)
+                if (*p != '\r') {
+                    if (i < ali->nSites)
+                        seq(s, i) = codeMap[(unsigned char) *p];
+                    i++;
+                }
+            if (p < end) p++;
+        }
+
+        /* Validate sequence length */
+        if (i != ali->nSites) {
+            fprintf(stderr,
+                "Incompatible sequence length (%d should be %d) for %s\n",
+                i, ali->nSites, ali->names[s]);
+            exit(1);
+        }
+        ali->nSeqs++;
+    }
+
+    if (ali->nSeqs == 0) {
+        fprintf(stderr, "Error reading alignment: no sequences found\n");
+        exit(1);
     }
+
+    /* Release unused capacity */
+    ali->sequences = (letter_t *) realloc(ali->sequences,
+        (size_t) ali->nSeqs * ali->nSites * sizeof(letter_t));
+    ali->names = (char **) realloc(ali->names, ali->nSeqs * sizeof(char *));
 }
 
 letter_t MSAReadCode(char c, char *alphabet, int nCodes) {
@@ -563,7 +880,8 @@ letter_t MSAReadCode(char c, char *alphabet, int nCodes) {
     return i;
 }
 
-void MSAReweightSequences(alignment_t *ali, numeric_t theta, numeric_t scale) {
+void MSAReweightSequences(alignment_t *ali, numeric_t theta, numeric_t scale,
+    int method) {
     /* Reweight seqeuences by their inverse neighborhood size. Each sequence's
        weight is the inverse of the number of neighboring sequences with less
        than THETA percent divergence
@@ -574,32 +892,11 @@ void MSAReweightSequences(alignment_t *ali, numeric_t theta, numeric_t scale) {
     if (theta >= 0 && theta <= 1) {
         /* The neighborhood size of each sequence is the number of sequences 
            in the alignment within theta percent divergence */
-
-        #if defined(_OPENMP)
-        /* Naive parallelization is faster ignoring symmetry */
-        #pragma omp parallel for
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int t = 0; t < ali->nSeqs; t++)
-                if (s != t) {
-                    int id = 0;
-                    for (int n = 0; n < ali->nSites; n++)
-                        id += (seq(s, n) == seq(t, n));
-                    if (id >= ((1 - theta) * ali->nSites))
-                        ali->weights[s] += 1.0;
-                }
-        #else
-        /* For a single core, take advantage of symmetry */
-        for (int s = 0; s < ali->nSeqs - 1; s++)
-            for (int t = s + 1; t < ali->nSeqs; t++) {
-                int id = 0;
-                for (int n = 0; n < ali->nSites; n++)
-                    id += (seq(s, n) == seq(t, n));
-                if (id >= ((1 - theta) * ali->nSites)) {
-                    ali->weights[s] += 1.0;
-                    ali->weights[t] += 1.0;
-                }
-            }
-        #endif
+        if (method == REWEIGHT_LSH) {
+            MSACountNeighborsApprox(ali, theta, ali->weights);
+        } else {
+            MSACountNeighbors(ali, theta, ali->weights);
+        }
 
         /* Reweight sequences by the inverse of the neighborhood size */
         for (int i = 0; i < ali->nSeqs; i++)
@@ -624,33 +921,104 @@ void MSAReweightSequences(alignment_t *ali, numeric_t theta, numeric_t scale) {
     }
 }
 
+void MSACollapseDuplicates(alignment_t *ali) {
+    /* Merge identical rows, keeping the first occurrence of each. Rows are
+       bucketed by an FNV-1a hash in an open-addressing table and compared in
+       full on a hash match */
+    int capacity = 1;
+    while (capacity < 2 * ali->nSeqs) capacity *= 2;
+    int *table = (int *) malloc(capacity * sizeof(int));
+    uint64_t *tableHash = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+    for (int k = 0; k < capacity; k++) table[k] = -1;
+
+    size_t rowBytes = ali->nSites * sizeof(letter_t);
+    ali->uniqueMap = (int *) malloc(ali->nSeqs * sizeof(int));
+    int nUnique = 0;
+    for (int s = 0; s < ali->nSeqs; s++) {
+        const unsigned char *row = (const unsigned char *) &seq(s, 0);
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t b = 0; b < rowBytes; b++)
+            h = (h ^ row[b]) * 1099511628211ULL;
+        int k = (int) (h & (uint64_t) (capacity - 1));
+        while (table[k] >= 0 && (tableHash[k] != h
+               || memcmp(&seq(table[k], 0), row, rowBytes) != 0))
+            k = (k + 1) & (capacity - 1);
+        if (table[k] < 0) {
+            /* New unique row, moved down in place */
+            if (nUnique != s) memmove(&seq(nUnique, 0), row, rowBytes);
+            ali->weights[nUnique] = ali->weights[s];
+            table[k] = nUnique;
+            tableHash[k] = h;
+            nUnique++;
+        } else {
+            ali->weights[table[k]] += ali->weights[s];
+        }
+        ali->uniqueMap[s] = table[k];
+    }
+    free(table);
+    free(tableHash);
+
+    /* The focus sequence is now its unique row */
+    if (ali->target >= 0) ali->target = ali->uniqueMap[ali->target];
+
+    fprintf(stderr, "%d unique sequences out of %d (%.2fx compression)\n",
+        nUnique, ali->nSeqs, (numeric_t) ali->nSeqs / (numeric_t) nUnique);
+    ali->nSeqsAll = ali->nSeqs;
+    ali->nSeqs = nUnique;
+    ali->sequences = (letter_t *) realloc(ali->sequences,
+        (size_t) nUnique * ali->nSites * sizeof(letter_t));
+    ali->weights = (numeric_t *)
+        realloc(ali->weights, nUnique * sizeof(numeric_t));
+}
+
 void MSACountMarginals(alignment_t *ali, options_t *options) {
     /* Compute first and second order marginal distributions, according to the 
        sequence weights
      */
-    if (options->estimatorMAP == INFER_MAP_PLM_GAPREDUCE) {
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+    int gapReduce = (options->estimatorMAP == INFER_MAP_PLM_GAPREDUCE);
+    if (gapReduce) ali->nCodes = strlen(ali->alphabet) - 1;
+
+    /* Site-major copy of the alignment, so that each site streams linearly */
+    letter_t *columns = (letter_t *)
+        malloc((size_t) ali->nSeqs * ali->nSites * sizeof(letter_t));
+    #pragma omp parallel for
+    for (int i = 0; i < ali->nSites; i++)
+        for (int s = 0; s < ali->nSeqs; s++)
+            columns[(size_t) i * ali->nSeqs + s] = seq(s, i);
+
+    numeric_t Zinv = 1.0 / ali->nEff;
+    int nPairs = ali->nSites * (ali->nSites - 1) / 2;
+    int nFi = ali->nSites * ali->nCodes;
+    int nFij = nPairs * ali->nCodes * ali->nCodes;
+    ali->fi = (numeric_t *) malloc(nFi * sizeof(numeric_t));
+    ali->fij = (numeric_t *) malloc(nFij * sizeof(numeric_t));
+    for (int i = 0; i < nFi; i++) ali->fi[i] = 0.0;
+    #pragma omp parallel for
+    for (int i = 0; i < nFij; i++) ali->fij[i] = 0.0;
+
+    if (gapReduce) {
         /* Condition the marginals on ungapped */
-        ali->nCodes = strlen(ali->alphabet) - 1;
-
-        /* Gap frequencies at each position */
-        numeric_t Zinv = 1.0 / ali->nEff;
         ali->gapi = (numeric_t *) malloc(ali->nSites * sizeof(numeric_t));
-        for (int i = 0; i < ali->nSites; i++) ali->gapi[i] = 0.0;
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int i = 0; i < ali->nSites; i++)
-                    ali->gapi[i] += (seq(s, i) == 0) * ali->weights[s];
-        for (int i = 0; i < ali->nSites; i++) ali->gapi[i] *= Zinv;
-
-        /* Doubly ungapped frequencies at each pair of positions */
-        int nPairs = ali->nSites * (ali->nSites - 1) / 2;
         ali->ungapij = (numeric_t *) malloc(nPairs * sizeof(numeric_t));
+        for (int i = 0; i < ali->nSites; i++) ali->gapi[i] = 0.0;
         for (int i = 0; i < nPairs; i++) ali->ungapij[i] = 0.0;
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int i = 0; i < ali->nSites - 1; i++)
-                for (int j = i + 1; j < ali->nSites; j++)
-                    ungapij(i, j) += (seq(s, i) > 0) 
-                                   * (seq(s, j) > 0) 
-                                   * ali->weights[s];
+
+        /* Gap frequencies and first-order ungapped marginals P_i(Ai) */
+        #pragma omp parallel for
+        for (int i = 0; i < ali->nSites; i++) {
+            const letter_t *col = columns + (size_t) i * ali->nSeqs;
+            for (int s = 0; s < ali->nSeqs; s++) {
+                ali->gapi[i] += (col[s] == 0) * ali->weights[s];
+                if (col[s] > 0) fi(i, col[s] - 1) += ali->weights[s];
+            }
+            ali->gapi[i] *= Zinv;
+        }
+
+        /* Doubly ungapped frequencies and second-order ungapped marginals
+           P_ij(Ai, Aj) at each pair of positions */
+        MSACountPairMarginals(ali, columns, gapReduce, 1.0);
         for (int i = 0; i < nPairs; i++) ali->ungapij[i] *= Zinv;
 
         /* ------------------------------_DEBUG_------------------------------*/
@@ -667,29 +1035,8 @@ void MSACountMarginals(alignment_t *ali, options_t *options) {
         // exit(0);
         /* ------------------------------^DEBUG^------------------------------*/
 
-        /* First-order ungapped marginals P_i(Ai) */
-        int nFi = ali->nSites * ali->nCodes;
-        ali->fi = (numeric_t *) malloc(nFi * sizeof(numeric_t));
-        for (int i = 0; i < nFi; i++) ali->fi[i] = 0.0;
-
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int i = 0; i < ali->nSites; i++)
-                if (seq(s, i) > 0)
-                    fi(i, seq(s, i) - 1) += ali->weights[s];
-
-        /* Second-order ungapped marginals P_ij(Ai, Aj) */
-        int nFij = ali->nSites * (ali->nSites - 1) / 2 * ali->nCodes * ali->nCodes;
-        ali->fij = (numeric_t *) malloc(nFij * sizeof(numeric_t));
-        for (int i = 0; i < nFij; i++) ali->fij[i] = 0.0;
-
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int i = 0; i < ali->nSites - 1; i++)
-                for (int j = i + 1; j < ali->nSites; j++)
-                    if (seq(s, i) > 0) if(seq(s, j) > 0)
-                        fij(i, j, seq(s, i) - 1, seq(s, j) - 1)
-                            += ali->weights[s];
-
         /* Normalize conditional distributions */
+        #pragma omp parallel for
         for (int i = 0; i < ali->nSites; i++) {
             double fsum = 0.0;
             for (int ai = 0; ai < ali->nCodes; ai++)
@@ -698,8 +1045,9 @@ void MSACountMarginals(alignment_t *ali, options_t *options) {
             for (int ai = 0; ai < ali->nCodes; ai++)
                 fi(i, ai) *= fsumInv;
         }
-        for (int i = 0; i < ali->nSites - 1; i++)
-            for (int j = i + 1; j < ali->nSites; j++) {
+        #pragma omp parallel for schedule(dynamic)
+        for (int j = 1; j < ali->nSites; j++)
+            for (int i = 0; i < j; i++) {
                 double fsum = 0.0;
                 for (int ai = 0; ai < ali->nCodes; ai++)
                     for (int aj = 0; aj < ali->nCodes; aj++)
@@ -725,27 +1073,64 @@ void MSACountMarginals(alignment_t *ali, options_t *options) {
     /* --------------------------------^DEBUG^--------------------------------*/
 
     } else {
-        /* Compute regular marginals */
-        numeric_t Zinv = 1.0 / ali->nEff;
-
         /* First-order marginals P_i(Ai) */
-        int nFi = ali->nSites * ali->nCodes;
-        ali->fi = (numeric_t *) malloc(nFi * sizeof(numeric_t));
-        for (int i = 0; i < nFi; i++) ali->fi[i] = 0.0;
-
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int i = 0; i < ali->nSites; i++)
-                fi(i, seq(s, i)) += ali->weights[s] * Zinv;
+        #pragma omp parallel for
+        for (int i = 0; i < ali->nSites; i++) {
+            const letter_t *col = columns + (size_t) i * ali->nSeqs;
+            for (int s = 0; s < ali->nSeqs; s++)
+                fi(i, col[s]) += ali->weights[s] * Zinv;
+        }
 
         /* Second-order marginals P_ij(Ai, Aj) */
-        int nFij = ali->nSites * (ali->nSites - 1) / 2 * ali->nCodes * ali->nCodes;
-        ali->fij = (numeric_t *) malloc(nFij * sizeof(numeric_t));
-        for (int i = 0; i < nFij; i++) ali->fij[i] = 0.0;
+        MSACountPairMarginals(ali, columns, gapReduce, Zinv);
+    }
+    free(columns);
 
-        for (int s = 0; s < ali->nSeqs; s++)
-            for (int i = 0; i < ali->nSites - 1; i++)
-                for (int j = i + 1; j < ali->nSites; j++)
-                    fij(i, j, seq(s, i), seq(s, j)) += ali->weights[s] * Zinv;
+    gettimeofday(&stop, NULL);
+    numeric_t elapsed = (numeric_t) (stop.tv_sec - start.tv_sec)
+        + ((numeric_t) (stop.tv_usec - start.tv_usec)) / 1E6;
+    fprintf(stderr, "Marginals counted in %.3f s\n", elapsed);
+}
+
+void MSACountPairMarginals(alignment_t *ali, const letter_t *columns,
+    int gapReduce, numeric_t scale) {
+    /* Each tile of site blocks I <= J owns a disjoint slice of fij (and
+       ungapij), so threads never write to the same pair. Every tile streams
+       all sequences in order, which keeps the summation order, and thus the
+       result, identical to a serial count */
+    int nBlocks = (ali->nSites + MARGINALS_BLOCK - 1) / MARGINALS_BLOCK;
+    int nTiles = nBlocks * (nBlocks + 1) / 2;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int t = 0; t < nTiles; t++) {
+        int J = 0;
+        while ((J + 1) * (J + 2) / 2 <= t) J++;
+        int I = t - J * (J + 1) / 2;
+        int iStart = I * MARGINALS_BLOCK;
+        int jStart = J * MARGINALS_BLOCK;
+        int jStop = jStart + MARGINALS_BLOCK < ali->nSites ?
+                    jStart + MARGINALS_BLOCK : ali->nSites;
+        for (int s = 0; s < ali->nSeqs; s++) {
+            numeric_t w = ali->weights[s] * scale;
+            for (int j = jStart; j < jStop; j++) {
+                letter_t aj = columns[(size_t) j * ali->nSeqs + s];
+                int iStop = iStart + MARGINALS_BLOCK < j ?
+                            iStart + MARGINALS_BLOCK : j;
+                if (gapReduce) {
+                    if (aj > 0)
+                        for (int i = iStart; i < iStop; i++) {
+                            letter_t ai = columns[(size_t) i * ali->nSeqs + s];
+                            if (ai > 0) {
+                                ungapij(i, j) += w;
+                                fij(i, j, ai - 1, aj - 1) += w;
+                            }
+                        }
+                } else {
+                    for (int i = iStart; i < iStop; i++)
+                        fij(i, j, columns[(size_t) i * ali->nSeqs + s], aj)
+                            += w;
+                }
+            }
+        }
     }
 }
 
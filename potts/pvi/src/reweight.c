@@ -0,0 +1,460 @@
+/*
+ *      Neighborhood counting for sequence reweighting
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+/* Optionally include OpenMP with the -fopenmp flag */
+#if defined(_OPENMP)
+    #include <omp.h>
+#endif
+
+/* SIMD kernels are compiled per function and dispatched at runtime */
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+    #define REWEIGHT_X86
+    #include <immintrin.h>
+#endif
+
+#include "include/pvi.h"
+#include "include/bayes.h"
+#include "include/reweight.h"
+
+/* Packed rows are padded to a multiple of this many bytes (and aligned to it),
+   which is also the granularity of the early exit test */
+#define REWEIGHT_CHUNK 64
+
+/* Tiles of rows (of both operands) should fit together in L2 */
+#define REWEIGHT_TILE_BYTES (256 * 1024)
+
+/* Mismatch kernels count differing bytes between two padded rows, stopping
+   early once the count exceeds maxMismatch. Padding bytes always agree. */
+typedef int (*mismatch_fun_t) (const uint8_t *a, const uint8_t *b,
+    int length, int maxMismatch);
+
+static inline int MismatchesScalar(const uint8_t *a, const uint8_t *b,
+    int length, int maxMismatch) {
+    int mismatch = 0;
+    for (int n = 0; n < length; n += REWEIGHT_CHUNK) {
+        for (int k = n; k < n + REWEIGHT_CHUNK; k++) mismatch += (a[k] != b[k]);
+        if (mismatch > maxMismatch) break;
+    }
+    return mismatch;
+}
+
+#if defined(REWEIGHT_X86)
+__attribute__((target("sse4.2,popcnt")))
+static inline int MismatchesSSE42(const uint8_t *a, const uint8_t *b,
+    int length, int maxMismatch) {
+    int mismatch = 0;
+    for (int n = 0; n < length; n += REWEIGHT_CHUNK) {
+        for (int k = 0; k < REWEIGHT_CHUNK; k += 16) {
+            __m128i va = _mm_load_si128((const __m128i *) (a + n + k));
+            __m128i vb = _mm_load_si128((const __m128i *) (b + n + k));
+            unsigned int eq =
+                (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+            mismatch += 16 - __builtin_popcount(eq);
+        }
+        if (mismatch > maxMismatch) break;
+    }
+    return mismatch;
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline int MismatchesAVX2(const uint8_t *a, const uint8_t *b,
+    int length, int maxMismatch) {
+    int mismatch = 0;
+    for (int n = 0; n < length; n += REWEIGHT_CHUNK) {
+        __m256i a0 = _mm256_load_si256((const __m256i *) (a + n));
+        __m256i a1 = _mm256_load_si256((const __m256i *) (a + n + 32));
+        __m256i b0 = _mm256_load_si256((const __m256i *) (b + n));
+        __m256i b1 = _mm256_load_si256((const __m256i *) (b + n + 32));
+        unsigned int eq0 =
+            (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a0, b0));
+        unsigned int eq1 =
+            (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a1, b1));
+        mismatch += REWEIGHT_CHUNK
+                    - __builtin_popcount(eq0) - __builtin_popcount(eq1);
+        if (mismatch > maxMismatch) break;
+    }
+    return mismatch;
+}
+#endif
+
+/* Tile kernels compare rows [sStart, sStop) against [tStart, tStop), only
+   for t > s, and count neighbors of both rows. Each is specialized for one
+   mismatch kernel so that the comparison inlines into the tile loop. */
+typedef void (*tile_fun_t) (const uint8_t *packed, int stride, int sStart,
+    int sStop, int tStart, int tStop, int maxMismatch, int *counts);
+
+#define REWEIGHT_TILE_BODY(MISMATCHES)                                        \
+    for (int s = sStart; s < sStop; s++) {                                    \
+        const uint8_t *a = packed + (size_t) s * stride;                      \
+        for (int t = (tStart > s ? tStart : s + 1); t < tStop; t++)           \
+            if (MISMATCHES(a, packed + (size_t) t * stride, stride,           \
+                maxMismatch) <= maxMismatch) {                                \
+                counts[s]++;                                                  \
+                counts[t]++;                                                  \
+            }                                                                 \
+    }
+
+static void TileScalar(const uint8_t *packed, int stride, int sStart,
+    int sStop, int tStart, int tStop, int maxMismatch, int *counts) {
+    REWEIGHT_TILE_BODY(MismatchesScalar)
+}
+
+#if defined(REWEIGHT_X86)
+__attribute__((target("sse4.2,popcnt")))
+static void TileSSE42(const uint8_t *packed, int stride, int sStart,
+    int sStop, int tStart, int tStop, int maxMismatch, int *counts) {
+    REWEIGHT_TILE_BODY(MismatchesSSE42)
+}
+
+__attribute__((target("avx2,popcnt")))
+static void TileAVX2(const uint8_t *packed, int stride, int sStart,
+    int sStop, int tStart, int tStop, int maxMismatch, int *counts) {
+    REWEIGHT_TILE_BODY(MismatchesAVX2)
+}
+#endif
+
+static void SelectKernels(const char **name, tile_fun_t *tile,
+    mismatch_fun_t *pair) {
+    #if defined(REWEIGHT_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "AVX2";
+        *tile = TileAVX2;
+        *pair = MismatchesAVX2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        *name = "SSE4.2";
+        *tile = TileSSE42;
+        *pair = MismatchesSSE42;
+        return;
+    }
+    #endif
+    *name = "scalar";
+    *tile = TileScalar;
+    *pair = MismatchesScalar;
+}
+
+static int MaxMismatches(const alignment_t *ali, numeric_t theta) {
+    /* Smallest identity satisfying the original criterion, evaluated in the
+       same precision so that the neighborhoods are unchanged */
+    int minId = 0;
+    while (minId <= ali->nSites && !(minId >= ((1 - theta) * ali->nSites)))
+        minId++;
+    return ali->nSites - minId;
+}
+
+/* Letters are int8_t and every alphabet has at most LETTER_MAX_CODES of
+   them, so each fits a byte */
+#if LETTER_MAX_CODES > 256
+#error "PackAlignment requires alphabets of at most 256 letters"
+#endif
+
+static uint8_t *PackAlignment(const alignment_t *ali, int *stride,
+    void **block) {
+    /* Pack sequences into aligned, padded rows of bytes. Letters outside the
+       alphabet (lowercase in custom alphabets) stay negative, so the bytes
+       are not on [0, nCodes). The cast is one-to-one on letter_t, which
+       preserves equality, the only thing the comparisons need */
+    *stride = (ali->nSites + REWEIGHT_CHUNK - 1)
+              / REWEIGHT_CHUNK * REWEIGHT_CHUNK;
+    if (*stride == 0) *stride = REWEIGHT_CHUNK;
+    *block = malloc((size_t) ali->nSeqs * *stride + REWEIGHT_CHUNK);
+    if (*block == NULL) {
+        fprintf(stderr, "ERROR: Failed to allocate packed alignment\n");
+        exit(1);
+    }
+    uint8_t *packed = (uint8_t *) (((uintptr_t) *block
+        + REWEIGHT_CHUNK - 1) / REWEIGHT_CHUNK * REWEIGHT_CHUNK);
+    memset(packed, 0, (size_t) ali->nSeqs * *stride);
+    for (int s = 0; s < ali->nSeqs; s++)
+        for (int i = 0; i < ali->nSites; i++)
+            packed[(size_t) s * *stride + i] = (uint8_t) seq(s, i);
+    return packed;
+}
+
+void MSACountNeighbors(const alignment_t *ali, numeric_t theta,
+    numeric_t *counts) {
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+
+    const char *kernelName = NULL;
+    tile_fun_t tileKernel = NULL;
+    mismatch_fun_t pairKernel = NULL;
+    SelectKernels(&kernelName, &tileKernel, &pairKernel);
+    int maxMismatch = MaxMismatches(ali, theta);
+
+    int stride = 0;
+    void *packedBlock = NULL;
+    uint8_t *packed = PackAlignment(ali, &stride, &packedBlock);
+
+    /* Tiles of the upper triangle (including the diagonal tiles) */
+    int tileSize = REWEIGHT_TILE_BYTES / (2 * stride);
+    if (tileSize < 8) tileSize = 8;
+    if (tileSize > 1024) tileSize = 1024;
+    int nTiles = (ali->nSeqs + tileSize - 1) / tileSize;
+    long nTilePairs = (long) nTiles * (nTiles + 1) / 2;
+    int *tileI = (int *) malloc(nTilePairs * sizeof(int));
+    int *tileJ = (int *) malloc(nTilePairs * sizeof(int));
+    long p = 0;
+    for (int I = 0; I < nTiles; I++)
+        for (int J = I; J < nTiles; J++) {
+            tileI[p] = I;
+            tileJ[p] = J;
+            p++;
+        }
+
+    /* Per-thread neighbor counts are reduced after the sweep */
+    int nThreads = 1;
+    #if defined(_OPENMP)
+    nThreads = omp_get_max_threads();
+    #endif
+    int *threadCounts = (int *)
+        calloc((size_t) nThreads * ali->nSeqs, sizeof(int));
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long tp = 0; tp < nTilePairs; tp++) {
+        int threadID = 0;
+        #if defined(_OPENMP)
+        threadID = omp_get_thread_num();
+        #endif
+        int *local = threadCounts + (size_t) threadID * ali->nSeqs;
+        int sStart = tileI[tp] * tileSize;
+        int sStop = sStart + tileSize < ali->nSeqs ?
+                    sStart + tileSize : ali->nSeqs;
+        int tStart = tileJ[tp] * tileSize;
+        int tStop = tStart + tileSize < ali->nSeqs ?
+                    tStart + tileSize : ali->nSeqs;
+        if (tileKernel != NULL) {
+            tileKernel(packed, stride, sStart, sStop, tStart, tStop,
+                maxMismatch, local);
+        } else {
+            for (int s = sStart; s < sStop; s++)
+                for (int t = (tStart > s ? tStart : s + 1); t < tStop; t++) {
+                    int mismatch = 0;
+                    for (int n = 0; n < ali->nSites
+                                    && mismatch <= maxMismatch; n++)
+                        mismatch += (seq(s, n) != seq(t, n));
+                    if (mismatch <= maxMismatch) {
+                        local[s]++;
+                        local[t]++;
+                    }
+                }
+        }
+    }
+
+    for (int r = 0; r < nThreads; r++)
+        for (int s = 0; s < ali->nSeqs; s++)
+            counts[s] += (numeric_t) threadCounts[(size_t) r * ali->nSeqs + s];
+
+    free(threadCounts);
+    free(tileI);
+    free(tileJ);
+    free(packedBlock);
+
+    gettimeofday(&stop, NULL);
+    numeric_t elapsed = (numeric_t) (stop.tv_sec - start.tv_sec)
+        + ((numeric_t) (stop.tv_usec - start.tv_usec)) / 1E6;
+    fprintf(stderr, "Neighborhoods counted in %.3f s (%s kernel, %d threads)\n",
+        elapsed, kernelName, nThreads);
+}
+
+/* Locality-sensitive hashing: each band hashes the letters at a random subset
+   of sites, sequences sharing a band bucket become candidate neighbors and
+   candidates are verified exactly. Bands are sized so that a pair right at
+   the identity threshold is found with probability LSH_RECALL. */
+#define LSH_BANDS 32
+#define LSH_RECALL 0.99
+#define LSH_VALIDATION_SEQS 200
+
+typedef struct {
+    uint32_t hash;
+    int s;
+} lsh_key_t;
+
+static int CompareLSHKeys(const void *a, const void *b) {
+    const lsh_key_t *ka = (const lsh_key_t *) a;
+    const lsh_key_t *kb = (const lsh_key_t *) b;
+    if (ka->hash != kb->hash) return (ka->hash < kb->hash) ? -1 : 1;
+    return (ka->s > kb->s) - (ka->s < kb->s);
+}
+
+static int SameLetters(const uint8_t *a, const uint8_t *b, const int *sites,
+    int nSites) {
+    for (int k = 0; k < nSites; k++)
+        if (a[sites[k]] != b[sites[k]]) return 0;
+    return 1;
+}
+
+void MSACountNeighborsApprox(const alignment_t *ali, numeric_t theta,
+    numeric_t *counts) {
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+
+    const char *kernelName = NULL;
+    tile_fun_t tileKernel = NULL;
+    mismatch_fun_t pairKernel = NULL;
+    SelectKernels(&kernelName, &tileKernel, &pairKernel);
+    int maxMismatch = MaxMismatches(ali, theta);
+
+    /* Sites per band from P(all r sites agree) = identity^r at threshold */
+    numeric_t identity =
+        (numeric_t) (ali->nSites - maxMismatch) / (numeric_t) ali->nSites;
+    numeric_t bandRecall = 1.0 - pow(1.0 - LSH_RECALL, 1.0 / LSH_BANDS);
+    int bandSites = ali->nSites;
+    if (identity < 1) bandSites = (int) floor(log(bandRecall) / log(identity));
+    if (bandSites > ali->nSites) bandSites = ali->nSites;
+    if (bandSites < 1) {
+        fprintf(stderr, "Approximate reweighting not applicable, "
+            "counting neighborhoods exactly\n");
+        MSACountNeighbors(ali, theta, counts);
+        return;
+    }
+
+    int stride = 0;
+    void *packedBlock = NULL;
+    uint8_t *packed = PackAlignment(ali, &stride, &packedBlock);
+
+    /* Random sites for each band (partial Fisher-Yates) */
+    InitRNG(42);
+    int *bandSite = (int *) malloc(LSH_BANDS * bandSites * sizeof(int));
+    int *perm = (int *) malloc(ali->nSites * sizeof(int));
+    for (int b = 0; b < LSH_BANDS; b++) {
+        for (int i = 0; i < ali->nSites; i++) perm[i] = i;
+        for (int k = 0; k < bandSites; k++) {
+            int swap = k + RandomInt(ali->nSites - k);
+            int tmp = perm[k];
+            perm[k] = perm[swap];
+            perm[swap] = tmp;
+            bandSite[k + b * bandSites] = perm[k];
+        }
+    }
+    free(perm);
+
+    int nThreads = 1;
+    #if defined(_OPENMP)
+    nThreads = omp_get_max_threads();
+    #endif
+    int *threadCounts = (int *)
+        calloc((size_t) nThreads * ali->nSeqs, sizeof(int));
+    long nCandidates = 0;
+
+    /* Hash the letters of every band for every sequence (32-bit FNV-1a) */
+    uint32_t *bandHash = (uint32_t *)
+        malloc((size_t) ali->nSeqs * LSH_BANDS * sizeof(uint32_t));
+    #pragma omp parallel for
+    for (int s = 0; s < ali->nSeqs; s++) {
+        const uint8_t *row = packed + (size_t) s * stride;
+        for (int b = 0; b < LSH_BANDS; b++) {
+            const int *sites = bandSite + b * bandSites;
+            uint32_t h = 2166136261U;
+            for (int k = 0; k < bandSites; k++)
+                h = (h ^ row[sites[k]]) * 16777619U;
+            bandHash[(size_t) s * LSH_BANDS + b] = h;
+        }
+    }
+
+    lsh_key_t *keys = (lsh_key_t *) malloc(ali->nSeqs * sizeof(lsh_key_t));
+    for (int b = 0; b < LSH_BANDS; b++) {
+        const int *sites = bandSite + b * bandSites;
+
+        /* Bucket sequences by band hash */
+        for (int s = 0; s < ali->nSeqs; s++) {
+            keys[s].hash = bandHash[(size_t) s * LSH_BANDS + b];
+            keys[s].s = s;
+        }
+        qsort(keys, ali->nSeqs, sizeof(lsh_key_t), CompareLSHKeys);
+
+        /* Verify each pair in a bucket unless it already met in an earlier
+           band, so that every pair is tested at most once. Hashes rule out
+           most earlier bands before the letters are compared. */
+        #pragma omp parallel for schedule(dynamic, 64) reduction(+:nCandidates)
+        for (int k = 0; k < ali->nSeqs; k++) {
+            int threadID = 0;
+            #if defined(_OPENMP)
+            threadID = omp_get_thread_num();
+            #endif
+            int *local = threadCounts + (size_t) threadID * ali->nSeqs;
+            int s = keys[k].s;
+            const uint8_t *a = packed + (size_t) s * stride;
+            const uint32_t *hashS = bandHash + (size_t) s * LSH_BANDS;
+            for (int l = k + 1; l < ali->nSeqs
+                                && keys[l].hash == keys[k].hash; l++) {
+                int t = keys[l].s;
+                const uint8_t *c = packed + (size_t) t * stride;
+                const uint32_t *hashT = bandHash + (size_t) t * LSH_BANDS;
+                if (!SameLetters(a, c, sites, bandSites)) continue;
+                int seen = 0;
+                for (int e = 0; e < b && !seen; e++)
+                    seen = (hashS[e] == hashT[e])
+                           && SameLetters(a, c, bandSite + e * bandSites,
+                                bandSites);
+                if (seen) continue;
+                nCandidates++;
+                if (pairKernel(a, c, stride, maxMismatch) <= maxMismatch) {
+                    local[s]++;
+                    local[t]++;
+                }
+            }
+        }
+    }
+    free(bandHash);
+    free(keys);
+    free(bandSite);
+
+    int *approx = (int *) calloc(ali->nSeqs, sizeof(int));
+    for (int r = 0; r < nThreads; r++)
+        for (int s = 0; s < ali->nSeqs; s++)
+            approx[s] += threadCounts[(size_t) r * ali->nSeqs + s];
+    for (int s = 0; s < ali->nSeqs; s++) counts[s] += (numeric_t) approx[s];
+    free(threadCounts);
+
+    gettimeofday(&stop, NULL);
+    numeric_t elapsed = (numeric_t) (stop.tv_sec - start.tv_sec)
+        + ((numeric_t) (stop.tv_usec - start.tv_usec)) / 1E6;
+    numeric_t nPairs = 0.5 * (numeric_t) ali->nSeqs * (ali->nSeqs - 1);
+    fprintf(stderr, "Neighborhoods approximated in %.3f s (%d bands x %d sites,"
+        " %.2f%% of pairs verified, %s kernel)\n", elapsed, LSH_BANDS,
+        bandSites, 100.0 * nCandidates / (nPairs > 0 ? nPairs : 1), kernelName);
+
+    /* Estimate the error against exact counts on a subsample of sequences */
+    int nCheck = ali->nSeqs < LSH_VALIDATION_SEQS ?
+                 ali->nSeqs : LSH_VALIDATION_SEQS;
+    int *exact = (int *) calloc(nCheck, sizeof(int));
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int c = 0; c < nCheck; c++) {
+        int s = (int) (((long) c * ali->nSeqs) / nCheck);
+        const uint8_t *a = packed + (size_t) s * stride;
+        for (int t = 0; t < ali->nSeqs; t++)
+            if (t != s && pairKernel(a, packed + (size_t) t * stride, stride,
+                    maxMismatch) <= maxMismatch)
+                exact[c]++;
+    }
+    numeric_t found = 0, total = 0, weightError = 0, wExact = 0, wApprox = 0;
+    for (int c = 0; c < nCheck; c++) {
+        int s = (int) (((long) c * ali->nSeqs) / nCheck);
+        numeric_t we = 1.0 / (1.0 + exact[c]);
+        numeric_t wa = 1.0 / (1.0 + approx[s]);
+        found += approx[s];
+        total += exact[c];
+        weightError += fabs(wa - we) / we;
+        wExact += we;
+        wApprox += wa;
+    }
+    fprintf(stderr, "Approximation error on %d sequences: neighbor recall %.4f,"
+        " mean weight error %.3f%%, sample size error %+.3f%%\n", nCheck,
+        total > 0 ? found / total : 1.0, 100.0 * weightError / nCheck,
+        100.0 * (wApprox - wExact) / wExact);
+    free(exact);
+    free(approx);
+    free(packedBlock);
+}
@@ -0,0 +1,140 @@
+/*
+ *      Independent random streams for parallel samplers
+ */
+
+#include <stdint.h>
+#include <math.h>
+
+#include "include/rng.h"
+
+/* Ziggurat of 128 layers of equal area under the standard normal, with the
+   base layer including the tail beyond ZIG_R (Doornik 2005) */
+#define ZIG_LAYERS 128
+#define ZIG_R 3.442619855899
+#define ZIG_V 9.91256303526217e-3
+
+/* Normals are filled in chunks of this many draws per thread */
+#define RNG_NORMAL_CHUNK 4096
+
+/* Right edges of the layers, and the fraction of each layer that lies
+   under the layer above it */
+static double zigX[ZIG_LAYERS + 1];
+static double zigRatio[ZIG_LAYERS];
+static int zigReady = 0;
+
+/* Internal to RNGNormals */
+void RNGZigguratInit(void);
+double RNGNormalSlow(uint64_t bits, double u, int layer);
+
+/* Expands a 64-bit seed into well-mixed state words (splitmix64) */
+static uint64_t RNGSplitMix(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Advances the stream by 2^128 draws */
+static void RNGJump(uint64_t *s) {
+    static const uint64_t jump[RNG_STATE_WORDS] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+    };
+    uint64_t t[RNG_STATE_WORDS] = {0, 0, 0, 0};
+    for (int w = 0; w < RNG_STATE_WORDS; w++)
+        for (int b = 0; b < 64; b++) {
+            if (jump[w] & ((uint64_t) 1 << b))
+                for (int k = 0; k < RNG_STATE_WORDS; k++) t[k] ^= s[k];
+            RNGNext(s);
+        }
+    for (int k = 0; k < RNG_STATE_WORDS; k++) s[k] = t[k];
+}
+
+/* Normal number counter under key. Nearly all draws take one hash, whose
+   low 7 bits pick the layer and whose high 53 bits the position in it */
+static inline double RNGNormal(uint64_t key, uint64_t counter) {
+    uint64_t bits = RNGHash(key, counter);
+    double u = 2.0 * RNGUniformBits(bits) - 1.0;
+    int layer = (int) (bits & (ZIG_LAYERS - 1));
+    if (fabs(u) < zigRatio[layer]) return u * zigX[layer];
+    return RNGNormalSlow(bits, u, layer);
+}
+
+void RNGSeedStreams(uint64_t *states, int nStreams, uint64_t seed) {
+    uint64_t x = seed;
+    for (int k = 0; k < RNG_STATE_WORDS; k++) states[k] = RNGSplitMix(&x);
+    for (int c = 1; c < nStreams; c++) {
+        for (int k = 0; k < RNG_STATE_WORDS; k++)
+            states[c * RNG_STATE_WORDS + k]
+                = states[(c - 1) * RNG_STATE_WORDS + k];
+        RNGJump(&(states[c * RNG_STATE_WORDS]));
+    }
+}
+
+void RNGNormals(double *z, int n, uint64_t key, uint64_t counter) {
+    RNGZigguratInit();
+    int nChunks = (n + RNG_NORMAL_CHUNK - 1) / RNG_NORMAL_CHUNK;
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < nChunks; c++) {
+        int lo = c * RNG_NORMAL_CHUNK;
+        int hi = (n - lo < RNG_NORMAL_CHUNK ? n : lo + RNG_NORMAL_CHUNK);
+        for (int i = lo; i < hi; i++) z[i] = RNGNormal(key, counter + i);
+    }
+}
+
+void RNGNormalsFloat(float *z, int n, uint64_t key, uint64_t counter) {
+    RNGZigguratInit();
+    int nChunks = (n + RNG_NORMAL_CHUNK - 1) / RNG_NORMAL_CHUNK;
+    #pragma omp parallel for schedule(static)
+    for (int c = 0; c < nChunks; c++) {
+        int lo = c * RNG_NORMAL_CHUNK;
+        int hi = (n - lo < RNG_NORMAL_CHUNK ? n : lo + RNG_NORMAL_CHUNK);
+        for (int i = lo; i < hi; i++)
+            z[i] = (float) RNGNormal(key, counter + i);
+    }
+}
+
+void RNGZigguratInit(void) {
+    if (zigReady) return;
+    double f = exp(-0.5 * ZIG_R * ZIG_R);
+    zigX[0] = ZIG_V / f;
+    zigX[1] = ZIG_R;
+    zigX[ZIG_LAYERS] = 0;
+    for (int i = 2; i < ZIG_LAYERS; i++) {
+        zigX[i] = sqrt(-2.0 * log(ZIG_V / zigX[i - 1] + f));
+        f = exp(-0.5 * zigX[i] * zigX[i]);
+    }
+    for (int i = 0; i < ZIG_LAYERS; i++) zigRatio[i] = zigX[i + 1] / zigX[i];
+    zigReady = 1;
+}
+
+/* Finishes a draw that fell outside the rectangle of its layer, taking any
+   further random bits from hashes of the first */
+double RNGNormalSlow(uint64_t bits, double u, int layer) {
+    uint64_t key = bits;
+    uint64_t counter = 0;
+    for (;;) {
+        if (layer == 0) {
+            /* Tail beyond ZIG_R (Marsaglia 1964) */
+            double x, y;
+            do {
+                x = log(RNGUniformBits(RNGHash(key, counter++))) / ZIG_R;
+                y = log(RNGUniformBits(RNGHash(key, counter++)));
+            } while (-2.0 * y < x * x);
+            return (u < 0 ? x - ZIG_R : ZIG_R - x);
+        }
+
+        /* Wedge between the layer and the density */
+        double x = u * zigX[layer];
+        double f0 = exp(-0.5 * (zigX[layer] * zigX[layer] - x * x));
+        double f1 = exp(-0.5 * (zigX[layer + 1] * zigX[layer + 1] - x * x));
+        if (f1 + RNGUniformBits(RNGHash(key, counter++)) * (f0 - f1) < 1.0)
+            return x;
+
+        /* Otherwise start over */
+        bits = RNGHash(key, counter++);
+        u = 2.0 * RNGUniformBits(bits) - 1.0;
+        layer = (int) (bits & (ZIG_LAYERS - 1));
+        if (fabs(u) < zigRatio[layer]) return u * zigX[layer];
+    }
+}
@@ -0,0 +1,230 @@
+/*
+ *      gibbs_potts Sampling of Potts models estimated by pvi
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+/* Optionally include OpenMP with the -fopenmp flag */
+#if defined(_OPENMP)
+    #include <omp.h>
+#endif
+
+#include "include/potts.h"
+
+/* Usage pattern */
+const char *usage =
+"gibbs_potts\n"
+"\n"
+"Usage:\n"
+"      gibbs_potts [options] paramfile\n"
+"      gibbs_potts -o samplefile -c 16 -s 1000 paramfile\n"
+"      gibbs_potts [-h | --help]\n"
+"      \n"
+"    Required input:\n"
+"      paramfile                        Parameters written by pvi -o\n"
+"\n"
+"    Options, output:\n"
+"      -o  --output     samplefile      Save samples to file (default: standard output)\n"
+"      -b  --binary                     Save samples in binary instead of FASTA\n"
+"      -a  --alphabet   alphabet        Characters of the states in FASTA output\n"
+"\n"
+"    Options, sampling:\n"
+"      -c  --chains     <number>        Number of independent chains\n"
+"      -s  --samples    <number>        Number of samples from each chain\n"
+"      -bi --burnin     <number>        Sweeps discarded at the start of each chain\n"
+"      -t  --thin       <number>        Sweeps between samples\n"
+"      -r  --seed       <number>        Random seed\n"
+"\n"
+"    Options, general:\n"
+"      -n  --ncores    [<number>|max]   Maximum number of threads to use in OpenMP\n"
+"      -h  --help                       Usage\n\n";
+
+/* Reference amino acid indexing */
+const char *codesAA = "-ACDEFGHIKLMNPQRSTVWY";
+
+/* Sampling default parameters */
+const int SAMPLING_CHAINS = 8;
+const int SAMPLING_SAMPLES = 1000;
+const int SAMPLING_BURNIN = 100;
+const int SAMPLING_THIN = 10;
+const uint64_t SAMPLING_SEED = 42;
+
+/* Internal to main */
+void WriteSamplesFASTA(FILE *fpOutput, const uint8_t *samples,
+    const double *energies, int nChains, int nSamples, int nSites,
+    const char *alphabet);
+void WriteSamplesBinary(FILE *fpOutput, const uint8_t *samples,
+    const double *energies, int nChains, int nSamples, int nSites,
+    int nCodes);
+
+int main(int argc, char **argv) {
+    char *paramFile = NULL;
+    char *outputFile = NULL;
+    const char *alphabet = codesAA;
+    int binary = 0;
+    int nChains = SAMPLING_CHAINS;
+    int nSamples = SAMPLING_SAMPLES;
+    int burnin = SAMPLING_BURNIN;
+    int thin = SAMPLING_THIN;
+    uint64_t seed = SAMPLING_SEED;
+
+    /* Print usage if no arguments */
+    if (argc == 1) {
+        fprintf(stderr, "%s", usage);
+        exit(1);
+    }
+
+    /* Parse command line arguments */
+    for (int arg = 1; arg < argc; arg++) {
+        if ((arg < argc-1) && (strcmp(argv[arg], "--output") == 0
+                    || strcmp(argv[arg], "-o") == 0)) {
+            outputFile = argv[++arg];
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--binary") == 0
+                    || strcmp(argv[arg], "-b") == 0)) {
+            binary = 1;
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--alphabet") == 0
+                    || strcmp(argv[arg], "-a") == 0)) {
+            alphabet = argv[++arg];
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--chains") == 0
+                    || strcmp(argv[arg], "-c") == 0)) {
+            nChains = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--samples") == 0
+                    || strcmp(argv[arg], "-s") == 0)) {
+            nSamples = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--burnin") == 0
+                    || strcmp(argv[arg], "-bi") == 0)) {
+            burnin = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--thin") == 0
+                    || strcmp(argv[arg], "-t") == 0)) {
+            thin = atoi(argv[++arg]);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--seed") == 0
+                    || strcmp(argv[arg], "-r") == 0)) {
+            seed = (uint64_t) strtoull(argv[++arg], NULL, 10);
+        } else if ((arg < argc-1) && (strcmp(argv[arg], "--ncores") == 0
+                    || strcmp(argv[arg], "-n") == 0)) {
+            #if defined(_OPENMP)
+                if (strcmp(argv[arg + 1], "max") == 0) {
+                    int maxThreads = omp_get_max_threads();
+                    omp_set_num_threads(maxThreads);
+                    fprintf(stderr, "OpenMP: Using %d of %d threads\n",
+                        maxThreads, maxThreads);
+                } else {
+                    int numThreads = atoi(argv[arg + 1]);
+                    int maxThreads = omp_get_max_threads();
+                    if (numThreads >= 1 && numThreads <= maxThreads) {
+                        omp_set_num_threads(numThreads);
+                        fprintf(stderr, "OpenMP: Using %d of %d threads\n",
+                            numThreads, maxThreads);
+                    } else if (numThreads > maxThreads) {
+                        omp_set_num_threads(maxThreads);
+                        fprintf(stderr, "OpenMP: More threads requested than "
+                            "available. Using %d of %d threads instead.\n",
+                            maxThreads, maxThreads);
+                    } else {
+                        omp_set_num_threads(1);
+                        fprintf(stderr, "OpenMP: Using 1 of %d threads\n",
+                            maxThreads);
+                    }
+                }
+                arg++;
+            #else
+                fprintf(stderr, "Error (-n/--ncores) only available when "
+                    "compiled with OpenMP\n");
+                exit(1);
+            #endif
+        } else if (strcmp(argv[arg], "--help") == 0
+                    || strcmp(argv[arg], "-h") == 0) {
+            fprintf(stderr, "%s", usage);
+            exit(1);
+        }
+    }
+    paramFile = argv[argc - 1];
+    if (nChains < 1 || nSamples < 1 || burnin < 0 || thin < 1) {
+        fprintf(stderr, "Error (-c/-s/-bi/-t) chains, samples and thinning "
+            "must be positive and burn-in nonnegative\n");
+        exit(1);
+    }
+
+    potts_model_t *model = PottsRead(paramFile);
+    if (!binary && (int) strlen(alphabet) != model->nCodes) {
+        fprintf(stderr, "Error (-a/--alphabet) alphabet %s has %d characters "
+            "but the model has %d states\n", alphabet,
+            (int) strlen(alphabet), model->nCodes);
+        exit(1);
+    }
+    fprintf(stderr, "Sampling %d chains x %d samples of %d sites x %d states "
+        "(burn-in %d sweeps, thinning %d sweeps)\n", nChains, nSamples,
+        model->nSites, model->nCodes, burnin, thin);
+
+    size_t nTotal = (size_t) nChains * nSamples;
+    uint8_t *samples =
+        (uint8_t *) malloc(nTotal * model->nSites * sizeof(uint8_t));
+    double *energies = (double *) malloc(nTotal * sizeof(double));
+
+    struct timeval start, stop;
+    gettimeofday(&start, NULL);
+    PottsSample(samples, energies, model, nChains, nSamples, burnin, thin,
+        seed);
+    gettimeofday(&stop, NULL);
+    double elapsed = (stop.tv_sec - start.tv_sec)
+        + 1e-6 * (stop.tv_usec - start.tv_usec);
+    fprintf(stderr, "Sampled in %.2f s (%.3g sweeps/s)\n", elapsed,
+        (double) nChains * (burnin + (double) nSamples * thin) / elapsed);
+
+    FILE *fpOutput = stdout;
+    if (outputFile != NULL) fpOutput = fopen(outputFile, "w");
+    if (fpOutput == NULL) {
+        fprintf(stderr, "Error writing samples\n");
+        exit(1);
+    }
+    if (binary) {
+        WriteSamplesBinary(fpOutput, samples, energies, nChains, nSamples,
+            model->nSites, model->nCodes);
+    } else {
+        WriteSamplesFASTA(fpOutput, samples, energies, nChains, nSamples,
+            model->nSites, alphabet);
+    }
+    if (outputFile != NULL) fclose(fpOutput);
+
+    free(samples);
+    free(energies);
+    PottsFree(model);
+    return 0;
+}
+
+/* One record per sample, named by chain and sample with its energy */
+void WriteSamplesFASTA(FILE *fpOutput, const uint8_t *samples,
+    const double *energies, int nChains, int nSamples, int nSites,
+    const char *alphabet) {
+    char *line = (char *) malloc((nSites + 2) * sizeof(char));
+    line[nSites] = '\n';
+    line[nSites + 1] = '\0';
+    for (int c = 0; c < nChains; c++)
+        for (int s = 0; s < nSamples; s++) {
+            size_t ix = (size_t) c * nSamples + s;
+            const uint8_t *x = samples + ix * nSites;
+            for (int i = 0; i < nSites; i++) line[i] = alphabet[x[i]];
+            fprintf(fpOutput, ">chain%d_%d energy=%.6f\n", c + 1, s + 1,
+                energies[ix]);
+            fputs(line, fpOutput);
+        }
+    free(line);
+}
+
+/* 1: number of samples, nSites and nCodes (int)
+   2: states of every sample, chain by chain (nSamples x nSites uint8_t)
+   3: energies (nSamples double) */
+void WriteSamplesBinary(FILE *fpOutput, const uint8_t *samples,
+    const double *energies, int nChains, int nSamples, int nSites,
+    int nCodes) {
+    int nTotal = nChains * nSamples;
+    fwrite(&nTotal, sizeof(nTotal), 1, fpOutput);
+    fwrite(&nSites, sizeof(nSites), 1, fpOutput);
+    fwrite(&nCodes, sizeof(nCodes), 1, fpOutput);
+    fwrite(samples, sizeof(uint8_t), (size_t) nTotal * nSites, fpOutput);
+    fwrite(energies, sizeof(double), nTotal, fpOutput);
+}
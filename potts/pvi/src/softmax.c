@@ -0,0 +1,192 @@
+/*
+ *      Vectorized exponentials for conditional distributions over states
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "include/pvi.h"
+#include "include/softmax.h"
+
+/* Kernels are compiled per function and dispatched at runtime */
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+    #define SOFTMAX_X86
+#endif
+
+/* Exponential kernels set P[a] = exp(H[a] - shift) and return the sum */
+typedef numeric_t (*exp_kernel_t) (const numeric_t *H, numeric_t *P, int n,
+    numeric_t shift);
+
+static numeric_t ExpScalar(const numeric_t *H, numeric_t *P, int n,
+    numeric_t shift) {
+    numeric_t sum = 0;
+    for (int a = 0; a < n; a++) {
+        P[a] = exp(H[a] - shift);
+        sum += P[a];
+    }
+    return sum;
+}
+
+static exp_kernel_t expKernel = ExpScalar;
+
+#if defined(SOFTMAX_X86)
+/* exp(x) = 2^k exp(r) with k = round(x / log 2) and |r| <= log(2) / 2. The
+   Taylor polynomial for exp(r), evaluated by Estrin's scheme to keep the
+   dependency chains short, is accurate to within an ulp or two, 2^k is
+   assembled directly in the exponent bits, and x is clamped so that 2^k
+   stays normal (exp(x) underflows to a tiny positive number, not zero) */
+#if defined(USE_FLOAT)
+typedef uint32_t numeric_bits_t;
+#define EXP_MIN         -87.0f
+#define EXP_MAX         88.0f
+/* 1.5 * 2^23 rounds to integers, which then sit in the low mantissa bits */
+#define EXP_ROUND       12582912.0f
+#define EXP_BIAS        127
+#define EXP_MANTISSA    23
+#define EXP_LN2_HI      0.693359375f
+#define EXP_LN2_LO      -2.12194440e-4f
+#define EXP_POLY(VEC, p, r)                                                  \
+    {                                                                        \
+        VEC r2 = r * r;                                                      \
+        VEC r4 = r2 * r2;                                                    \
+        VEC q0 = r + (numeric_t) 1.0;                                        \
+        VEC q1 = r * (numeric_t) (1.0 / 6.0) + (numeric_t) 0.5;              \
+        VEC q2 = r * (numeric_t) (1.0 / 120.0) + (numeric_t) (1.0 / 24.0);   \
+        VEC q3 = r * (numeric_t) (1.0 / 5040.0) + (numeric_t) (1.0 / 720.0); \
+        p = (q0 + q1 * r2) + (q2 + q3 * r2) * r4;                            \
+    }
+#else
+typedef uint64_t numeric_bits_t;
+#define EXP_MIN         -708.0
+#define EXP_MAX         709.0
+/* 1.5 * 2^52 rounds to integers, which then sit in the low mantissa bits */
+#define EXP_ROUND       6755399441055744.0
+#define EXP_BIAS        1023
+#define EXP_MANTISSA    52
+#define EXP_LN2_HI      6.93147180369123816490e-01
+#define EXP_LN2_LO      1.90821492927058770002e-10
+#define EXP_POLY(VEC, p, r)                                                  \
+    {                                                                        \
+        VEC r2 = r * r;                                                      \
+        VEC r4 = r2 * r2;                                                    \
+        VEC r8 = r4 * r4;                                                    \
+        VEC q0 = r + 1.0;                                                    \
+        VEC q1 = r * (1.0 / 6.0) + 0.5;                                      \
+        VEC q2 = r * (1.0 / 120.0) + (1.0 / 24.0);                           \
+        VEC q3 = r * (1.0 / 5040.0) + (1.0 / 720.0);                         \
+        VEC q4 = r * (1.0 / 362880.0) + (1.0 / 40320.0);                     \
+        VEC q5 = r * (1.0 / 39916800.0) + (1.0 / 3628800.0);                 \
+        VEC q6 = r * (1.0 / 6227020800.0) + (1.0 / 479001600.0);             \
+        p = ((q0 + q1 * r2) + (q2 + q3 * r2) * r4)                           \
+            + ((q4 + q5 * r2) + q6 * r4) * r8;                               \
+    }
+#endif
+#define EXP_LOG2E       ((numeric_t) 1.44269504088896340736)
+
+/* Vectors of numeric_t with the widths of SSE, AVX and AVX-512 registers */
+typedef numeric_t vec128_t __attribute__((vector_size(16)));
+typedef numeric_bits_t bits128_t __attribute__((vector_size(16)));
+typedef numeric_t vec256_t __attribute__((vector_size(32)));
+typedef numeric_bits_t bits256_t __attribute__((vector_size(32)));
+typedef numeric_t vec512_t __attribute__((vector_size(64)));
+typedef numeric_bits_t bits512_t __attribute__((vector_size(64)));
+
+/* y = exp(x) over vectors of type VEC, with x clobbered */
+#define EXP_VECTOR(VEC, BITS, y, x)                                          \
+    {                                                                        \
+        BITS low = (BITS) (x < (numeric_t) EXP_MIN);                        \
+        x = (VEC) (((BITS) x & ~low) | ((BITS) ((VEC) {0} + EXP_MIN) & low));\
+        BITS high = (BITS) (x > (numeric_t) EXP_MAX);                       \
+        x = (VEC) (((BITS) x & ~high) | ((BITS) ((VEC) {0} + EXP_MAX) & high));\
+        VEC t = x * EXP_LOG2E + (numeric_t) EXP_ROUND;                       \
+        VEC k = t - (numeric_t) EXP_ROUND;                                   \
+        VEC r = x - k * (numeric_t) EXP_LN2_HI - k * (numeric_t) EXP_LN2_LO; \
+        VEC p;                                                               \
+        EXP_POLY(VEC, p, r)                                                  \
+        BITS pow2 = ((BITS) t + EXP_BIAS) << EXP_MANTISSA;                   \
+        y = p * (VEC) pow2;                                                  \
+    }
+
+/* Full vectors, then the tail padded with exp(0) lanes that are dropped */
+#define EXP_KERNEL_BODY(VEC, BITS)                                           \
+    const int lanes = sizeof(VEC) / sizeof(numeric_t);                       \
+    VEC acc = (VEC) {0};                                                     \
+    int a = 0;                                                               \
+    for (; a + lanes <= n; a += lanes) {                                     \
+        VEC x, y;                                                            \
+        memcpy(&x, H + a, sizeof(VEC));                                      \
+        x = x - shift;                                                       \
+        EXP_VECTOR(VEC, BITS, y, x)                                          \
+        memcpy(P + a, &y, sizeof(VEC));                                      \
+        acc += y;                                                            \
+    }                                                                        \
+    numeric_t sum = 0;                                                       \
+    for (int k = 0; k < lanes; k++) sum += acc[k];                           \
+    if (a < n) {                                                             \
+        VEC x = (VEC) {0}, y;                                                \
+        for (int k = 0; k < n - a; k++) x[k] = H[a + k] - shift;             \
+        EXP_VECTOR(VEC, BITS, y, x)                                          \
+        for (int k = 0; k < n - a; k++) {                                    \
+            P[a + k] = y[k];                                                 \
+            sum += y[k];                                                     \
+        }                                                                    \
+    }                                                                        \
+    return sum;
+
+__attribute__((target("sse4.2")))
+static numeric_t ExpSSE42(const numeric_t *H, numeric_t *P, int n,
+    numeric_t shift) {
+    EXP_KERNEL_BODY(vec128_t, bits128_t)
+}
+
+__attribute__((target("avx2")))
+static numeric_t ExpAVX2(const numeric_t *H, numeric_t *P, int n,
+    numeric_t shift) {
+    EXP_KERNEL_BODY(vec256_t, bits256_t)
+}
+
+__attribute__((target("avx512f")))
+static numeric_t ExpAVX512(const numeric_t *H, numeric_t *P, int n,
+    numeric_t shift) {
+    EXP_KERNEL_BODY(vec512_t, bits512_t)
+}
+#endif
+
+const char *SelectSoftmaxKernel(void) {
+#if defined(SOFTMAX_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        expKernel = ExpAVX512;
+        return "AVX-512";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        expKernel = ExpAVX2;
+        return "AVX2";
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        expKernel = ExpSSE42;
+        return "SSE4.2";
+    }
+#endif
+    expKernel = ExpScalar;
+    return "scalar";
+}
+
+numeric_t ExpShifted(const numeric_t *H, numeric_t *P, int n) {
+    numeric_t scale = H[0];
+    for (int a = 1; a < n; a++) scale = (scale >= H[a] ? scale : H[a]);
+    return expKernel(H, P, n, scale);
+}
+
+numeric_t Softmax(const numeric_t *H, numeric_t *P, int n) {
+    numeric_t scale = H[0];
+    for (int a = 1; a < n; a++) scale = (scale >= H[a] ? scale : H[a]);
+    numeric_t Z = expKernel(H, P, n, scale);
+    numeric_t Zinv = 1.0 / Z;
+    for (int a = 0; a < n; a++) P[a] *= Zinv;
+    return scale + log(Z);
+}
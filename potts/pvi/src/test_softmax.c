@@ -0,0 +1,154 @@
+/*
+ *      Accuracy of the exponential kernels against libm
+ *
+ *      Builds with softmax.c included so that every kernel the dispatcher
+ *      can select is exercised, not only the one this CPU would get.
+ *      Exits with status 1 if any kernel exceeds the ulp bounds below
+ */
+
+#include <stdio.h>
+
+#include "softmax.c"
+
+/* Error bounds, in ulps of numeric_t */
+#define TEST_ULP_EXP        4.0
+#define TEST_ULP_SOFTMAX    8.0
+
+/* Draws per size and the spread of H, which stays inside the clamped range */
+#define TEST_TRIALS         200
+#if defined(USE_FLOAT)
+#define TEST_RANGE          -80.0
+#else
+#define TEST_RANGE          -700.0
+#endif
+
+typedef struct {
+    const char *name;
+    exp_kernel_t kernel;
+    int supported;
+} test_kernel_t;
+
+/* Spacing of numeric_t at y, the unit for the errors */
+double TestUlp(double y) {
+    numeric_t x = (numeric_t) fabs(y);
+    if (x == 0) x = (numeric_t) 1E-30;
+#if defined(USE_FLOAT)
+    return (double) (nextafterf(x, INFINITY) - x);
+#else
+    return nextafter(x, INFINITY) - x;
+#endif
+}
+
+/* Uniform on [0, 1) from a fixed generator so failures are reproducible */
+double TestUniform(uint64_t *state) {
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (double) (*state >> 11) / 9007199254740992.0;
+}
+
+/* Fills H with a mix of wide and narrow spreads, including ties at the max */
+void TestFill(numeric_t *H, int n, int trial, uint64_t *state) {
+    double spread = (trial % 4 == 0) ? 1.0 : TEST_RANGE;
+    numeric_t offset = (numeric_t) (20.0 * (TestUniform(state) - 0.5));
+    for (int a = 0; a < n; a++)
+        H[a] = offset + (numeric_t) (spread * TestUniform(state));
+    if (trial % 8 == 1 && n > 1) H[n - 1] = H[0];
+}
+
+/* Maximum errors of ExpShifted and Softmax over all sizes, in ulps */
+void TestKernel(double *errExp, double *errSoftmax) {
+    numeric_t H[SOFTMAX_MAX_STATES];
+    numeric_t P[SOFTMAX_MAX_STATES];
+    double ref[SOFTMAX_MAX_STATES];
+    uint64_t state = 1;
+    *errExp = 0;
+    *errSoftmax = 0;
+    for (int n = 1; n <= SOFTMAX_MAX_STATES; n++)
+        for (int trial = 0; trial < TEST_TRIALS; trial++) {
+            TestFill(H, n, trial, &state);
+            numeric_t shift = H[0];
+            for (int a = 1; a < n; a++) if (H[a] > shift) shift = H[a];
+
+            /* The kernels and the reference see the same rounded argument */
+            double Z = 0;
+            for (int a = 0; a < n; a++) {
+                ref[a] = exp((double) (H[a] - shift));
+                Z += ref[a];
+            }
+
+            numeric_t sum = ExpShifted(H, P, n);
+            for (int a = 0; a < n; a++) {
+                double err = fabs((double) P[a] - ref[a]) / TestUlp(ref[a]);
+                if (err > *errExp) *errExp = err;
+            }
+            /* The sum carries one rounding per term */
+            double err = fabs((double) sum - Z) / TestUlp(Z) / n;
+            if (err > *errExp) *errExp = err;
+
+            /* Normalizing by the kernel's own sum, whose rounding the check
+               above already bounds, keeps errors from being counted twice */
+            numeric_t logZ = Softmax(H, P, n);
+            for (int a = 0; a < n; a++) {
+                double p = ref[a] / (double) sum;
+                err = fabs((double) P[a] - p) / TestUlp(p);
+                if (err > *errSoftmax) *errSoftmax = err;
+            }
+            /* log(Z) turns the relative error of Z into an absolute one,
+               and shift + log(Z) can cancel, so measure against the larger
+               of the terms and one */
+            double logZRef = (double) shift + log(Z);
+            double scale = fmax(fmax(fabs((double) shift), log(Z)), 1.0);
+            err = fabs((double) logZ - logZRef) / TestUlp(scale);
+            if (err > *errSoftmax) *errSoftmax = err;
+        }
+}
+
+int main(int argc, char **argv) {
+    test_kernel_t kernels[] = {
+        {"scalar", ExpScalar, 1},
+#if defined(SOFTMAX_X86)
+        {"SSE4.2", ExpSSE42, 0},
+        {"AVX2", ExpAVX2, 0},
+        {"AVX-512", ExpAVX512, 0},
+#endif
+    };
+    int nKernels = sizeof(kernels) / sizeof(kernels[0]);
+#if defined(SOFTMAX_X86)
+    __builtin_cpu_init();
+    kernels[1].supported = __builtin_cpu_supports("sse4.2");
+    kernels[2].supported = __builtin_cpu_supports("avx2");
+    kernels[3].supported = __builtin_cpu_supports("avx512f");
+#endif
+
+    /* The dispatcher must land on one of the kernels checked here */
+    const char *selected = SelectSoftmaxKernel();
+    int found = 0;
+    for (int k = 0; k < nKernels; k++)
+        if (strcmp(kernels[k].name, selected) == 0
+            && kernels[k].kernel == expKernel) found = 1;
+    if (!found) {
+        fprintf(stderr, "ERROR: selected kernel %s is not tested\n", selected);
+        exit(1);
+    }
+
+    int failed = 0;
+    fprintf(stderr, "%s precision, n = 1..%d, bounds %.0f and %.0f ulps\n",
+        (sizeof(numeric_t) == sizeof(float)) ? "Single" : "Double",
+        SOFTMAX_MAX_STATES, TEST_ULP_EXP, TEST_ULP_SOFTMAX);
+    for (int k = 0; k < nKernels; k++) {
+        if (!kernels[k].supported) {
+            fprintf(stderr, "%-8s skipped, not supported by this CPU\n",
+                kernels[k].name);
+            continue;
+        }
+        expKernel = kernels[k].kernel;
+        double errExp, errSoftmax;
+        TestKernel(&errExp, &errSoftmax);
+        int pass = (errExp <= TEST_ULP_EXP)
+                   && (errSoftmax <= TEST_ULP_SOFTMAX);
+        fprintf(stderr, "%-8s ExpShifted %6.2f ulps   Softmax %6.2f ulps   %s\n",
+            kernels[k].name, errExp, errSoftmax, pass ? "ok" : "FAILED");
+        if (!pass) failed = 1;
+    }
+    if (failed) exit(1);
+    return 0;
+}
@@ -0,0 +1,22 @@
+function [sample, energies] = read_samples(samplefile)
+%READ_SAMPLES reads a binary file of samples written by gibbs_potts -b. The
+%  outputs are:
+%   
+%   Object      Description                         Dimensions
+%   sample      states (1...q) of every sample      N x L
+%   energies    energy of every sample              N x 1
+%
+%   Samples are ordered by chain, then by sweep within each chain
+%
+
+f_samples = fopen(samplefile, 'r');
+%
+N = fread(f_samples, 1, 'int');
+L = fread(f_samples, 1, 'int');
+q = fread(f_samples, 1, 'int');
+
+sample = fread(f_samples, [L N], 'uint8')' + 1;
+energies = fread(f_samples, N, 'double');
+
+fclose(f_samples);
+end
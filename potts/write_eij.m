@@ -0,0 +1,36 @@
+function write_eij(paramfile, hi, eij)
+%WRITE_EIJ writes the fields and couplings of a Potts model in the binary
+%  format of the parameter files of pvi, so that the model can be sampled
+%  by pvi/bin/gibbs_potts. The inputs are:
+%
+%   Object      Description                         Dimensions
+%   hi          sitewise fields     hi(i,Ai)        L x q
+%   eij         pairwise couplings  eij(i,j,Ai,Aj)  L x L x q x q
+%
+%   Only the blocks eij(i,j,:,:) with i < j are written. The marginals fi
+%   and fij are written as zeros and the focus sequence as gaps
+%
+
+PRECISION = 'single';
+
+[L, q] = size(hi);
+f_eij = fopen(paramfile, 'w');
+%
+fwrite(f_eij, L, 'int');
+fwrite(f_eij, q, 'int');
+fwrite(f_eij, repmat('-', 1, L), 'char');
+fwrite(f_eij, 1:L, 'int');
+
+fwrite(f_eij, zeros(q, L), PRECISION);
+fwrite(f_eij, hi', PRECISION);
+
+for i=1:(L-1)
+    for j=(i+1):L
+        fwrite(f_eij, [i j], 'int');
+        fwrite(f_eij, zeros(q, q), PRECISION);
+        fwrite(f_eij, squeeze(eij(i,j,:,:))', PRECISION);
+    end
+end
+
+fclose(f_eij);
+end